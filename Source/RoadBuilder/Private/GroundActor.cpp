@@ -3,9 +3,46 @@
 
 #include "GroundActor.h"
 #include "RoadScene.h"
+#include "GeoReferencingSystem.h"
 #include "Components/SplineComponent.h"
 #include "Engine/World.h"
 
+//Splits the curve until the midpoint of every piece is within Tolerance of its chord
+static void SampleCurve(TFunctionRef<FVector(double)> Eval, double T0, const FVector& P0, double T1, const FVector& P1, double Tolerance, int Depth, TArray<FVector>& Result)
+{
+	const int MinDepth = 2;
+	const int MaxDepth = 12;
+	double T = (T0 + T1) / 2;
+	FVector P = Eval(T);
+	if (Depth < MinDepth || (Depth < MaxDepth && FMath::PointDistToSegment(P, P0, P1) > Tolerance))
+	{
+		SampleCurve(Eval, T0, P0, T, P, Tolerance, Depth + 1, Result);
+		SampleCurve(Eval, T, P, T1, P1, Tolerance, Depth + 1, Result);
+	}
+	else if (!Result.Last().Equals(P1))
+		Result.Add(P1);
+}
+
+//Removes vertices whose span can be replaced by a single segment within Tolerance, a closed loop is simplified from its first vertex around to itself
+static void DecimateBorder(TArray<FVector>& Vertices, double Tolerance, bool bClosedLoop)
+{
+	if (Tolerance <= 0 || Vertices.Num() < 4)
+		return;
+	int Num = Vertices.Num();
+	TArray<int> Indices = { 0 };
+	if (!bClosedLoop)
+		Indices.Add(Num - 1);
+	FRoadMesh::SimplifyPoints([&](int Index) { return Vertices[Index % Num]; }, 0, bClosedLoop ? Num : Num - 1, Tolerance, Indices);
+	if (Indices.Num() < 3)
+		return;
+	Indices.Sort();
+	TArray<FVector> Result;
+	Result.SetNumUninitialized(Indices.Num());
+	for (int i = 0; i < Indices.Num(); i++)
+		Result[i] = Vertices[Indices[i]];
+	Vertices = MoveTemp(Result);
+}
+
 double FGroundPoint::GetDist(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadSlots)
 {
 	TArray<FJunctionSlot>& Slots = RoadSlots[Road];
@@ -79,11 +116,7 @@ FGroundPoint FGroundPoint::NextPoint(TMap<ARoadActor*, TArray<FJunctionSlot>>& R
 
 AGroundActor::AGroundActor(const FObjectInitializer& ObjectInitializer) : Super(ObjectInitializer)
 {
-#if USE_PROC_ROAD_MESH
-	RootComponent = CreateDefaultSubobject<UProceduralMeshComponent>(TEXT("RootComponent"));
-#else
 	RootComponent = CreateDefaultSubobject<URoadMeshComponent>(TEXT("RootComponent"));
-#endif
 }
 
 void AGroundActor::AddManualPoint(const FVector& Pos, int& Index)
@@ -134,14 +167,63 @@ void AGroundActor::Join(AGroundActor* Other, int& Index)
 
 void AGroundActor::BuildMesh(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadSlots)
 {
-	FRoadMesh Builder;
+	TUniquePtr<FRoadMesh> Builder = FRoadMesh::Create(GetScene()->MeshBackend);
 	if (bClosedLoop)
 	{
 		TArray<FVector> Vertices = GetVertices(RoadSlots);
 		if (!Material)
 			Material = GetMutableDefault<USettings_Global>()->DefaultGroundMaterial.LoadSynchronous();
-		Builder.AddPolygon(Material, nullptr, Vertices);
-		Builder.Build(GetRootComponent());
+		if (TileSize > 0)
+			BuildTiles(Vertices);
+		else
+		{
+			MeshStats = Builder->AddPolygon(Material, nullptr, Vertices, Refinement, GetBaseHeights());
+			Builder->Build(GetRootComponent());
+			SetTileComponents(0);
+		}
+	}
+}
+
+void AGroundActor::BuildTiles(const TArray<FVector>& Vertices)
+{
+	TArray<FPolygonTile> Tiles = FRoadMesh::TriangulateTiles(Vertices, Refinement, TileSize, GetBaseHeights());
+	FRoadMesh::Clear(GetRootComponent());
+	SetTileComponents(Tiles.Num());
+	MeshStats = FPolygonStats();
+	for (int i = 0; i < Tiles.Num(); i++)
+	{
+		TUniquePtr<FRoadMesh> Builder = FRoadMesh::Create(GetScene()->MeshBackend);
+		FPolygonStats Stats = Builder->AddPolygonTile(Material, nullptr, Tiles[i]);
+		Builder->Build(TileComponents[i]);
+		MeshStats.NumVertices += Stats.NumVertices;
+		MeshStats.NumTriangles += Stats.NumTriangles;
+	}
+}
+
+FHeightSampler AGroundActor::GetBaseHeights()
+{
+	if (!Heightfield.IsValid())
+		return nullptr;
+	return [this](TArray<FVector>& Positions) { Heightfield.SampleHeights(AGeoReferencingSystem::GetGeoReferencingSystem(this), Positions); };
+}
+
+void AGroundActor::SetTileComponents(int Num)
+{
+	while (TileComponents.Num() > Num)
+	{
+		if (URoadMeshComponent* Component = TileComponents.Pop(false))
+		{
+			FRoadMesh::Clear(Component);
+			Component->DestroyComponent();
+		}
+	}
+	while (TileComponents.Num() < Num)
+	{
+		URoadMeshComponent* Component = NewObject<URoadMeshComponent>(this);
+		Component->AttachToComponent(GetRootComponent(), FAttachmentTransformRules::KeepRelativeTransform);
+		AddInstanceComponent(Component);
+		Component->RegisterComponent();
+		TileComponents.Add(Component);
 	}
 }
 
@@ -178,31 +260,13 @@ TArray<FVector> AGroundActor::GetVertices(TMap<ARoadActor*, TArray<FJunctionSlot
 	};
 	auto AddSpline = [&](const FVector& StartPos, const FVector& EndPos, const FVector& PrevDir, const FVector& NextDir)
 	{
-		FVector Dir = EndPos - StartPos;
-		double Length = Dir.Size();
-		Dir /= Length;
-		FVector StartTangent = (PrevDir + Dir).GetSafeNormal();
-		FVector EndTangent = (NextDir + Dir).GetSafeNormal();
-		int NumSegments = FMath::Max(1, FMath::RoundToInt(Length / 1000));
-		for (int i = 0; i <= NumSegments; i++)
-		{
-			int NumSegs = 1;
-			if (i < NumSegments)
-			{
-				FVector StartT = FMath::CubicInterpDerivative(StartPos, StartTangent, EndPos, EndTangent, double(i) / NumSegments);
-				FVector EndT = FMath::CubicInterpDerivative(StartPos, StartTangent, EndPos, EndTangent, double(i + 1) / NumSegments);
-				double StartR = FMath::Atan2(StartT.Y, StartT.X);
-				double EndR = FMath::Atan2(EndT.Y, EndT.X);
-				NumSegs = FMath::Max(1, FMath::RoundToInt(16 * FMath::Abs(WrapRadian(EndR - StartR)) / DOUBLE_PI));
-			}
-			for (int j = 0; j < NumSegs; j++)
-			{
-				FVector Pos = FMath::CubicInterp(StartPos, StartTangent * Length, EndPos, EndTangent * Length, double(i) / NumSegments + double(j) / (NumSegments * NumSegs));
-				if (Vertices.Num() && Vertices.Last().Equals(Pos))
-					continue;
-				Vertices.Add(Pos);
-			}
-		}
+		double Length = FVector::Distance(StartPos, EndPos);
+		FVector Dir = (EndPos - StartPos) / Length;
+		FVector StartTangent = (PrevDir + Dir).GetSafeNormal() * Length;
+		FVector EndTangent = (NextDir + Dir).GetSafeNormal() * Length;
+		if (!Vertices.Num() || !Vertices.Last().Equals(StartPos))
+			Vertices.Add(StartPos);
+		SampleCurve([&](double T) { return FMath::CubicInterp(StartPos, StartTangent, EndPos, EndTangent, T); }, 0, StartPos, 1, EndPos, FMath::Max(BorderTolerance, 1.0), 0, Vertices);
 	};
 	for (int i = 0; i < Points.Num() - !bClosedLoop; i++)
 	{
@@ -301,27 +365,46 @@ TArray<FVector> AGroundActor::GetVertices(TMap<ARoadActor*, TArray<FJunctionSlot
 	}
 	if (bClosedLoop)
 		Vertices.Pop();
+	DecimateBorder(Vertices, BorderTolerance, bClosedLoop);
 	return MoveTemp(Vertices);
 }
 
 void AGroundActor::CreatePCGSpline()
 {
 	TMap<ARoadActor*, TArray<FJunctionSlot>> RoadSlots = GetScene()->GetAllJunctionSlots();
+	UpdatePCGSpline(RoadSlots);
+}
+
+void AGroundActor::UpdatePCGSpline(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadSlots)
+{
 	TArray<FVector> Vertices = GetVertices(RoadSlots);
-	AActor* Actor = GetWorld()->SpawnActor<AActor>();
-	USceneComponent* RootComp = NewObject<USceneComponent>(Actor);
-	Actor->SetRootComponent(RootComp);
-	Actor->AddInstanceComponent(RootComp);
-	USplineComponent* Spline = NewObject<USplineComponent>(Actor, TEXT("Spline"));
-	Spline->SetupAttachment(RootComp);
-	Actor->AddInstanceComponent(Spline);
-	UPCGComponent* PCGComponent = NewObject<UPCGComponent>(Actor, TEXT("PCG Component"));
-	Actor->AddInstanceComponent(PCGComponent);
-	Actor->RegisterAllComponents();
-	Actor->AttachToActor(this, FAttachmentTransformRules::KeepWorldTransform);
-	Spline->ClearSplinePoints(false);
+	USplineComponent* Spline = nullptr;
+	ForEachAttachedActors([&](AActor* Actor)->bool
+	{
+		Spline = Actor->FindComponentByClass<USplineComponent>();
+		return !Spline;
+	});
+	if (!Spline)
+	{
+		AActor* Actor = GetWorld()->SpawnActor<AActor>();
+		USceneComponent* RootComp = NewObject<USceneComponent>(Actor);
+		Actor->SetRootComponent(RootComp);
+		Actor->AddInstanceComponent(RootComp);
+		Spline = NewObject<USplineComponent>(Actor, TEXT("Spline"));
+		Spline->SetupAttachment(RootComp);
+		Actor->AddInstanceComponent(Spline);
+		UPCGComponent* PCGComponent = NewObject<UPCGComponent>(Actor, TEXT("PCG Component"));
+		Actor->AddInstanceComponent(PCGComponent);
+		Actor->RegisterAllComponents();
+		Actor->AttachToActor(this, FAttachmentTransformRules::KeepWorldTransform);
+	}
+	Spline->Modify();
+	TArray<FSplinePoint> SplinePoints;
+	SplinePoints.Reserve(Vertices.Num());
 	for (int i = 0; i < Vertices.Num(); i++)
-		Spline->AddPoint(FSplinePoint(i, Vertices[i], ESplinePointType::Linear));
+		SplinePoints.Add(FSplinePoint(i, Vertices[i], ESplinePointType::Linear));
+	Spline->ClearSplinePoints(false);
+	Spline->AddPoints(SplinePoints, false);
 	Spline->SetClosedLoop(true, true);
 	Spline->bSplineHasBeenEdited = true;
 }
@@ -332,7 +415,15 @@ void AGroundActor::PostEditChangeProperty(FPropertyChangedEvent& PropertyChanged
 	{
 		if (PropertyChangedEvent.MemberProperty->GetFName() == GET_MEMBER_NAME_CHECKED(AGroundActor, Material))
 		{
-			Cast<UStaticMeshComponent>(GetRootComponent())->SetMaterial(0, Material);
+			FRoadMesh::GetMeshComponent(GetRootComponent())->SetMaterial(0, Material);
+			for (URoadMeshComponent* Component : TileComponents)
+				if (Component)
+					FRoadMesh::GetMeshComponent(Component)->SetMaterial(0, Material);
+		}
+		else if (PropertyChangedEvent.MemberProperty->GetFName() == GET_MEMBER_NAME_CHECKED(AGroundActor, Refinement) || PropertyChangedEvent.MemberProperty->GetFName() == GET_MEMBER_NAME_CHECKED(AGroundActor, TileSize) || PropertyChangedEvent.MemberProperty->GetFName() == GET_MEMBER_NAME_CHECKED(AGroundActor, BorderTolerance) || PropertyChangedEvent.MemberProperty->GetFName() == GET_MEMBER_NAME_CHECKED(AGroundActor, Heightfield))
+		{
+			TMap<ARoadActor*, TArray<FJunctionSlot>> RoadSlots = GetScene()->GetAllJunctionSlots();
+			BuildMesh(RoadSlots);
 		}
 	}
 	Super::PostEditChangeProperty(PropertyChangedEvent);
@@ -0,0 +1,496 @@
+// Publisher: Fullike (https://github.com/fullike)
+// Copyright 2024. All Rights Reserved.
+
+#include "Heightfield.h"
+#include "RoadBuilder.h"
+#include "GeoReferencingSystem.h"
+#include "Async/MappedFileHandle.h"
+#include "Async/ParallelFor.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/ByteSwap.h"
+#include "Misc/Paths.h"
+
+struct FHeightfieldCacheHeader
+{
+	uint32 Magic;
+	uint32 Version;
+	int32 NumCols;
+	int32 NumRows;
+	int32 TileSize;
+	int32 bHasNoData;
+	double OriginX;
+	double OriginY;
+	double CellSize;
+	double NoData;
+};
+
+static const uint32 HeightfieldCacheMagic = 0x4d454452;
+static const uint32 HeightfieldCacheVersion = 1;
+static const int HeightfieldCacheTileSize = 256;
+
+//Whitespace separated tokens of a text file read in chunks
+class FAsciiTokenReader
+{
+public:
+	FAsciiTokenReader(IFileHandle* InFile) :File(InFile) {}
+	bool Next(TArray<ANSICHAR>& Token)
+	{
+		Token.Reset();
+		while (Pos < Size || Fill())
+		{
+			ANSICHAR C = Buffer[Pos++];
+			if (FCharAnsi::IsWhitespace(C))
+			{
+				if (Token.Num())
+					break;
+				continue;
+			}
+			Token.Add(C);
+		}
+		if (!Token.Num())
+			return false;
+		Token.Add(0);
+		return true;
+	}
+private:
+	bool Fill()
+	{
+		const int64 ChunkSize = 1 << 20;
+		Size = FMath::Min(ChunkSize, File->Size() - File->Tell());
+		Pos = 0;
+		Buffer.SetNumUninitialized(int(FMath::Max<int64>(Size, 1)), false);
+		return Size > 0 && File->Read(Buffer.GetData(), Size);
+	}
+	IFileHandle* File;
+	TArray<ANSICHAR> Buffer;
+	int64 Pos = 0;
+	int64 Size = 0;
+};
+
+FHeightfield::~FHeightfield()
+{
+	FileRegion.Reset();
+	FileHandle.Reset();
+}
+
+TSharedPtr<FHeightfield> FHeightfield::Load(const FString& Path)
+{
+	static TMap<FString, TWeakPtr<FHeightfield>> Cache;
+	if (TWeakPtr<FHeightfield>* Cached = Cache.Find(Path))
+		if (TSharedPtr<FHeightfield> Heightfield = Cached->Pin())
+			return Heightfield;
+	TSharedPtr<FHeightfield> Heightfield = MakeShared<FHeightfield>();
+	FString Extension = FPaths::GetExtension(Path);
+	bool bLoaded = Extension == TEXT("asc") ? Heightfield->LoadAsciiGrid(Path) : Heightfield->LoadGeoTiff(Path);
+	if (!bLoaded)
+		return nullptr;
+	Cache.Add(Path, Heightfield);
+	return Heightfield;
+}
+
+bool FHeightfield::MapFile(const FString& Path)
+{
+	FileHandle.Reset(FPlatformFileManager::Get().GetPlatformFile().OpenMapped(*Path));
+	if (FileHandle)
+		FileRegion.Reset(FileHandle->MapRegion(0, FileHandle->GetFileSize()));
+	if (!FileRegion)
+	{
+		UE_LOG(LogRoadBuilder, Error, TEXT("Failed to map %s"), *Path);
+		return false;
+	}
+	Data = FileRegion->GetMappedPtr();
+	DataSize = FileRegion->GetMappedSize();
+	return true;
+}
+
+bool FHeightfield::LoadAsciiGrid(const FString& Path)
+{
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	FString CachePath = FPaths::ProjectSavedDir() / TEXT("RoadBuilder") / FString::Printf(TEXT("%08x.dem"), GetTypeHash(FPaths::ConvertRelativePathToFull(Path)));
+	if (!PlatformFile.FileExists(*CachePath) || PlatformFile.GetTimeStamp(*CachePath) < PlatformFile.GetTimeStamp(*Path))
+	{
+		TUniquePtr<IFileHandle> In(PlatformFile.OpenRead(*Path));
+		if (!In)
+		{
+			UE_LOG(LogRoadBuilder, Error, TEXT("Failed to open %s"), *Path);
+			return false;
+		}
+		FAsciiTokenReader Reader(In.Get());
+		TArray<ANSICHAR> Token;
+		FHeightfieldCacheHeader Header = { HeightfieldCacheMagic, HeightfieldCacheVersion, 0, 0, HeightfieldCacheTileSize, 0, 0, 0, 1, 0 };
+		double X = 0, Y = 0;
+		bool bCenter = false;
+		while (Reader.Next(Token) && FCharAnsi::IsAlpha(Token[0]))
+		{
+			FString Key = ANSI_TO_TCHAR(Token.GetData());
+			if (!Reader.Next(Token))
+				break;
+			double Value = FCStringAnsi::Atod(Token.GetData());
+			if (Key.Equals(TEXT("ncols"), ESearchCase::IgnoreCase))
+				Header.NumCols = Value;
+			else if (Key.Equals(TEXT("nrows"), ESearchCase::IgnoreCase))
+				Header.NumRows = Value;
+			else if (Key.Equals(TEXT("xllcorner"), ESearchCase::IgnoreCase) || Key.Equals(TEXT("xllcenter"), ESearchCase::IgnoreCase))
+			{
+				X = Value;
+				bCenter = Key.EndsWith(TEXT("center"));
+			}
+			else if (Key.Equals(TEXT("yllcorner"), ESearchCase::IgnoreCase) || Key.Equals(TEXT("yllcenter"), ESearchCase::IgnoreCase))
+				Y = Value;
+			else if (Key.Equals(TEXT("cellsize"), ESearchCase::IgnoreCase))
+				Header.CellSize = Value;
+			else if (Key.Equals(TEXT("nodata_value"), ESearchCase::IgnoreCase))
+			{
+				//Stored as float like the samples so they compare equal
+				Header.NoData = float(Value);
+				Header.bHasNoData = 1;
+			}
+		}
+		if (Header.NumCols <= 0 || Header.NumRows <= 0 || Header.CellSize <= 0)
+		{
+			UE_LOG(LogRoadBuilder, Error, TEXT("Invalid ASCII grid header in %s"), *Path);
+			return false;
+		}
+		double Half = bCenter ? Header.CellSize / 2 : 0;
+		Header.OriginX = X - Half;
+		Header.OriginY = Y - Half + Header.NumRows * Header.CellSize;
+		PlatformFile.CreateDirectoryTree(*FPaths::GetPath(CachePath));
+		TUniquePtr<IFileHandle> Out(PlatformFile.OpenWrite(*CachePath));
+		if (!Out)
+		{
+			UE_LOG(LogRoadBuilder, Error, TEXT("Failed to write %s"), *CachePath);
+			return false;
+		}
+		Out->Write((const uint8*)&Header, sizeof(Header));
+		//Values are read one band of tile rows at a time and written out tile by tile
+		int TileSize = Header.TileSize;
+		int TilesAcross = FMath::DivideAndRoundUp(Header.NumCols, TileSize);
+		float Missing = Header.bHasNoData ? Header.NoData : std::numeric_limits<float>::quiet_NaN();
+		TArray<float> Band, Tile;
+		Tile.SetNumUninitialized(TileSize * TileSize);
+		for (int BandY = 0; BandY < Header.NumRows; BandY += TileSize)
+		{
+			Band.Init(Missing, TileSize * TilesAcross * TileSize);
+			int Rows = FMath::Min(TileSize, Header.NumRows - BandY);
+			for (int i = 0; i < Rows * Header.NumCols && Token.Num(); i++)
+			{
+				Band[i / Header.NumCols * TilesAcross * TileSize + i % Header.NumCols] = FCStringAnsi::Atod(Token.GetData());
+				Reader.Next(Token);
+			}
+			for (int TileX = 0; TileX < TilesAcross; TileX++)
+			{
+				for (int Row = 0; Row < TileSize; Row++)
+					FMemory::Memcpy(&Tile[Row * TileSize], &Band[Row * TilesAcross * TileSize + TileX * TileSize], TileSize * sizeof(float));
+				Out->Write((const uint8*)Tile.GetData(), Tile.Num() * sizeof(float));
+			}
+		}
+	}
+	if (!MapFile(CachePath))
+		return false;
+	FHeightfieldCacheHeader Header;
+	if (DataSize < int64(sizeof(Header)))
+		return false;
+	FMemory::Memcpy(&Header, Data, sizeof(Header));
+	if (Header.Magic != HeightfieldCacheMagic || Header.Version != HeightfieldCacheVersion)
+	{
+		UE_LOG(LogRoadBuilder, Error, TEXT("Invalid heightfield cache %s"), *CachePath);
+		return false;
+	}
+	NumCols = Header.NumCols;
+	NumRows = Header.NumRows;
+	TileWidth = TileHeight = Header.TileSize;
+	TilesAcross = FMath::DivideAndRoundUp(NumCols, TileWidth);
+	int NumTiles = TilesAcross * FMath::DivideAndRoundUp(NumRows, TileHeight);
+	TileOffsets.SetNumUninitialized(NumTiles);
+	for (int i = 0; i < NumTiles; i++)
+		TileOffsets[i] = sizeof(Header) + uint64(i) * TileWidth * TileHeight * sizeof(float);
+	Format = ESampleFormat::Float32;
+	SampleSize = PixelStride = sizeof(float);
+	Origin = FVector2D(Header.OriginX, Header.OriginY);
+	CellSize = FVector2D(Header.CellSize);
+	NoData = Header.NoData;
+	bHasNoData = Header.bHasNoData != 0;
+	return true;
+}
+
+bool FHeightfield::LoadGeoTiff(const FString& Path)
+{
+	if (!MapFile(Path) || DataSize < 16)
+		return false;
+	bool bLittleEndian = Data[0] == 'I';
+	bSwapBytes = bLittleEndian != bool(PLATFORM_LITTLE_ENDIAN);
+	auto Read16 = [&](uint64 Offset) -> uint16
+	{
+		uint16 Value = 0;
+		if (Offset + 2 <= uint64(DataSize))
+			FMemory::Memcpy(&Value, Data + Offset, 2);
+		return bSwapBytes ? BYTESWAP_ORDER16(Value) : Value;
+	};
+	auto Read32 = [&](uint64 Offset) -> uint32
+	{
+		uint32 Value = 0;
+		if (Offset + 4 <= uint64(DataSize))
+			FMemory::Memcpy(&Value, Data + Offset, 4);
+		return bSwapBytes ? BYTESWAP_ORDER32(Value) : Value;
+	};
+	auto Read64 = [&](uint64 Offset) -> uint64
+	{
+		uint64 Value = 0;
+		if (Offset + 8 <= uint64(DataSize))
+			FMemory::Memcpy(&Value, Data + Offset, 8);
+		return bSwapBytes ? BYTESWAP_ORDER64(Value) : Value;
+	};
+	uint16 Version = Read16(2);
+	bool bBigTiff = Version == 43;
+	if (Version != 42 && !bBigTiff)
+	{
+		UE_LOG(LogRoadBuilder, Error, TEXT("%s is not a TIFF file"), *Path);
+		return false;
+	}
+	struct FEntry
+	{
+		uint16 Type;
+		uint64 Count;
+		uint64 Offset;
+	};
+	TMap<uint16, FEntry> Entries;
+	uint64 IFD = bBigTiff ? Read64(8) : Read32(4);
+	uint64 NumEntries = bBigTiff ? Read64(IFD) : Read16(IFD);
+	int EntrySize = bBigTiff ? 20 : 12;
+	int FieldSize = bBigTiff ? 8 : 4;
+	for (uint64 i = 0; i < NumEntries; i++)
+	{
+		uint64 Entry = IFD + (bBigTiff ? 8 : 2) + i * EntrySize;
+		static const int TypeSizes[] = { 0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8, 4, 0, 0, 8, 8, 8 };
+		uint16 Type = Read16(Entry + 2);
+		uint64 Count = bBigTiff ? Read64(Entry + 4) : Read32(Entry + 4);
+		uint64 Field = Entry + (bBigTiff ? 12 : 8);
+		uint64 Size = Count * (Type < UE_ARRAY_COUNT(TypeSizes) ? TypeSizes[Type] : 0);
+		Entries.Add(Read16(Entry), { Type, Count, Size <= uint64(FieldSize) ? Field : (bBigTiff ? Read64(Field) : Read32(Field)) });
+	}
+	auto GetInt = [&](uint16 Tag, uint64 Index, uint64 Default) -> uint64
+	{
+		FEntry* Entry = Entries.Find(Tag);
+		if (!Entry || Index >= Entry->Count)
+			return Default;
+		switch (Entry->Type)
+		{
+		case 3: return Read16(Entry->Offset + Index * 2);
+		case 4: return Read32(Entry->Offset + Index * 4);
+		case 16: return Read64(Entry->Offset + Index * 8);
+		}
+		return Default;
+	};
+	auto GetDouble = [&](uint16 Tag, uint64 Index, double Default) -> double
+	{
+		FEntry* Entry = Entries.Find(Tag);
+		if (!Entry || Index >= Entry->Count || Entry->Type != 12)
+			return Default;
+		uint64 Bits = Read64(Entry->Offset + Index * 8);
+		double Value;
+		FMemory::Memcpy(&Value, &Bits, 8);
+		return Value;
+	};
+	NumCols = GetInt(256, 0, 0);
+	NumRows = GetInt(257, 0, 0);
+	int BitsPerSample = GetInt(258, 0, 1);
+	int SamplesPerPixel = GetInt(277, 0, 1);
+	int SampleFormat = GetInt(339, 0, 1);
+	if (GetInt(259, 0, 1) != 1)
+	{
+		UE_LOG(LogRoadBuilder, Error, TEXT("%s is compressed, only uncompressed GeoTIFFs can be mapped"), *Path);
+		return false;
+	}
+	if (SampleFormat == 1 && BitsPerSample == 16)
+		Format = ESampleFormat::UInt16;
+	else if (SampleFormat == 2 && BitsPerSample == 16)
+		Format = ESampleFormat::Int16;
+	else if (SampleFormat == 1 && BitsPerSample == 32)
+		Format = ESampleFormat::UInt32;
+	else if (SampleFormat == 2 && BitsPerSample == 32)
+		Format = ESampleFormat::Int32;
+	else if (SampleFormat == 3 && BitsPerSample == 32)
+		Format = ESampleFormat::Float32;
+	else if (SampleFormat == 3 && BitsPerSample == 64)
+		Format = ESampleFormat::Float64;
+	else
+	{
+		UE_LOG(LogRoadBuilder, Error, TEXT("%s has unsupported sample format %d/%d"), *Path, SampleFormat, BitsPerSample);
+		return false;
+	}
+	SampleSize = BitsPerSample / 8;
+	//Only the first band is used, planar configuration 2 stores it in the first tiles
+	PixelStride = GetInt(284, 0, 1) == 1 ? SampleSize * SamplesPerPixel : SampleSize;
+	uint16 OffsetsTag;
+	if (Entries.Contains(322))
+	{
+		TileWidth = GetInt(322, 0, 0);
+		TileHeight = GetInt(323, 0, 0);
+		OffsetsTag = 324;
+	}
+	else
+	{
+		TileWidth = NumCols;
+		TileHeight = GetInt(278, 0, NumRows);
+		OffsetsTag = 273;
+	}
+	if (NumCols <= 0 || NumRows <= 0 || TileWidth <= 0 || TileHeight <= 0)
+		return false;
+	TilesAcross = FMath::DivideAndRoundUp(NumCols, TileWidth);
+	int NumTiles = TilesAcross * FMath::DivideAndRoundUp(NumRows, TileHeight);
+	TileOffsets.SetNumUninitialized(NumTiles);
+	for (int i = 0; i < NumTiles; i++)
+		TileOffsets[i] = GetInt(OffsetsTag, i, 0);
+	//ModelPixelScale and ModelTiepoint place the raster in the projected CRS
+	if (!Entries.Contains(33550) || !Entries.Contains(33922))
+	{
+		UE_LOG(LogRoadBuilder, Error, TEXT("%s has no georeference"), *Path);
+		return false;
+	}
+	CellSize = FVector2D(GetDouble(33550, 0, 1), GetDouble(33550, 1, 1));
+	Origin = FVector2D(GetDouble(33922, 3, 0) - GetDouble(33922, 0, 0) * CellSize.X, GetDouble(33922, 4, 0) + GetDouble(33922, 1, 0) * CellSize.Y);
+	//GDAL_NODATA is stored as text
+	if (FEntry* Entry = Entries.Find(42113))
+	{
+		if (Entry->Offset + Entry->Count <= uint64(DataSize))
+		{
+			FString Text(int(Entry->Count), (const ANSICHAR*)Data + Entry->Offset);
+			NoData = FCString::Atod(*Text);
+			bHasNoData = true;
+		}
+	}
+	return true;
+}
+
+bool FHeightfield::GetSample(int X, int Y, double& Value) const
+{
+	uint64 Offset = TileOffsets[(Y / TileHeight) * TilesAcross + X / TileWidth] + uint64((Y % TileHeight) * TileWidth + X % TileWidth) * PixelStride;
+	if (Offset + SampleSize > uint64(DataSize))
+		return false;
+	const uint8* Sample = Data + Offset;
+	switch (Format)
+	{
+	case ESampleFormat::Int16:
+	case ESampleFormat::UInt16:
+	{
+		uint16 Bits;
+		FMemory::Memcpy(&Bits, Sample, 2);
+		Bits = bSwapBytes ? BYTESWAP_ORDER16(Bits) : Bits;
+		Value = Format == ESampleFormat::Int16 ? double(int16(Bits)) : double(Bits);
+		break;
+	}
+	case ESampleFormat::Int32:
+	case ESampleFormat::UInt32:
+	case ESampleFormat::Float32:
+	{
+		uint32 Bits;
+		FMemory::Memcpy(&Bits, Sample, 4);
+		Bits = bSwapBytes ? BYTESWAP_ORDER32(Bits) : Bits;
+		if (Format == ESampleFormat::Float32)
+		{
+			float Float;
+			FMemory::Memcpy(&Float, &Bits, 4);
+			Value = Float;
+		}
+		else
+			Value = Format == ESampleFormat::Int32 ? double(int32(Bits)) : double(Bits);
+		break;
+	}
+	case ESampleFormat::Float64:
+	{
+		uint64 Bits;
+		FMemory::Memcpy(&Bits, Sample, 8);
+		Bits = bSwapBytes ? BYTESWAP_ORDER64(Bits) : Bits;
+		FMemory::Memcpy(&Value, &Bits, 8);
+		break;
+	}
+	}
+	return !FMath::IsNaN(Value) && !(bHasNoData && Value == NoData);
+}
+
+bool FHeightfield::GetHeight(const FVector2D& Pos, double& Height) const
+{
+	//Pixel centers are at half cells
+	double FX = (Pos.X - Origin.X) / CellSize.X - 0.5;
+	double FY = (Origin.Y - Pos.Y) / CellSize.Y - 0.5;
+	if (FX < -0.5 || FY < -0.5 || FX > NumCols - 0.5 || FY > NumRows - 0.5)
+		return false;
+	FX = FMath::Clamp(FX, 0.0, NumCols - 1.0);
+	FY = FMath::Clamp(FY, 0.0, NumRows - 1.0);
+	int X0 = FMath::Min(FMath::FloorToInt(FX), FMath::Max(NumCols - 2, 0));
+	int Y0 = FMath::Min(FMath::FloorToInt(FY), FMath::Max(NumRows - 2, 0));
+	int X1 = FMath::Min(X0 + 1, NumCols - 1);
+	int Y1 = FMath::Min(Y0 + 1, NumRows - 1);
+	double AX = FX - X0, AY = FY - Y0;
+	const int Xs[] = { X0, X1, X0, X1 };
+	const int Ys[] = { Y0, Y0, Y1, Y1 };
+	const double Weights[] = { (1 - AX) * (1 - AY), AX * (1 - AY), (1 - AX) * AY, AX * AY };
+	//Samples without data are left out and the rest renormalized
+	double Sum = 0, Weight = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		double Value;
+		if (GetSample(Xs[i], Ys[i], Value))
+		{
+			Sum += Value * Weights[i];
+			Weight += Weights[i];
+		}
+	}
+	if (Weight <= 0)
+		return false;
+	Height = Sum / Weight;
+	return true;
+}
+
+void FHeightfield::GetHeights(const TArray<FVector2D>& Positions, TArray<double>& Heights, TBitArray<>& Valid) const
+{
+	Heights.SetNumUninitialized(Positions.Num());
+	TArray<bool> Found;
+	Found.SetNumUninitialized(Positions.Num());
+	ParallelFor(Positions.Num(), [&](int Index)
+	{
+		Found[Index] = GetHeight(Positions[Index], Heights[Index]);
+	});
+	Valid.Init(false, Positions.Num());
+	for (int i = 0; i < Positions.Num(); i++)
+		Valid[i] = Found[i];
+}
+
+bool FHeightfieldSource::SampleHeights(AGeoReferencingSystem* GeoReferencing, TArray<FVector>& Positions) const
+{
+	if (!IsValid())
+		return false;
+	if (!GeoReferencing)
+	{
+		UE_LOG(LogRoadBuilder, Error, TEXT("Heightfield %s needs a georeferencing system in the level"), *File.FilePath);
+		return false;
+	}
+	FString Path = FPaths::ConvertRelativePathToFull(FPaths::IsRelative(File.FilePath) ? FPaths::ProjectDir() / File.FilePath : File.FilePath);
+	if (!Loaded || LoadedPath != Path)
+	{
+		Loaded = FHeightfield::Load(Path);
+		LoadedPath = Path;
+	}
+	if (!Loaded)
+		return false;
+	TArray<FVector2D> Projected;
+	Projected.SetNumUninitialized(Positions.Num());
+	for (int i = 0; i < Positions.Num(); i++)
+	{
+		FCartesianCoordinates Coordinates;
+		GeoReferencing->EngineToProjected(Positions[i], Coordinates);
+		Projected[i] = FVector2D(Coordinates.X, Coordinates.Y);
+	}
+	TArray<double> Heights;
+	TBitArray<> Valid;
+	Loaded->GetHeights(Projected, Heights, Valid);
+	for (int i = 0; i < Positions.Num(); i++)
+	{
+		if (!Valid[i])
+			continue;
+		FVector Engine;
+		GeoReferencing->ProjectedToEngine(FCartesianCoordinates(Projected[i].X, Projected[i].Y, Heights[i]), Engine);
+		Positions[i].Z = Engine.Z + HeightOffset;
+	}
+	return true;
+}
@@ -3,8 +3,28 @@
 
 #include "LaneMarkStyle.h"
 #include "RoadScene.h"
+#include "Engine/StaticMesh.h"
+#include "Algo/Reverse.h"
 
 void ULaneMarkStyle::BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPolyline& Curve)
+{
+	double Phase = 0;
+	BuildMarks(Caller, Builder, nullptr, Curve, Phase, false);
+}
+
+void ULaneMarkStyle::Build(UObject* Caller, FRoadActorBuilder& Builder, const FPolyline& Curve)
+{
+	double Phase = 0;
+	BuildBoundary(Caller, Builder, Curve, Phase, false);
+}
+
+void ULaneMarkStyle::BuildBoundary(UObject* Caller, FRoadActorBuilder& Builder, const FPolyline& Curve, double& Phase, bool bReversed)
+{
+	//Dashes baked into the mask texture need no instances
+	BuildMarks(Caller, Builder.GetMarkingBuilder(), bInstancedDashes && !Builder.MaskBuilder ? &Builder.InstanceBuilder : nullptr, Curve, Phase, bReversed);
+}
+
+void ULaneMarkStyle::BuildMarks(UObject* Caller, FRoadMesh& Builder, FInstanceBuilder* InstanceBuilder, const FPolyline& Curve, double& Phase, bool bReversed)
 {
 	TArray<double> DashOffsets, SolidOffsets;
 	AJunctionActor* Junction = Cast<AJunctionActor>(Cast<ARoadActor>(Caller)->GetAttachParentActor());
@@ -33,30 +53,95 @@ void ULaneMarkStyle::BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPolyl
 		SolidOffsets.Add(+Separation);
 		break;
 	}
-	if (DashOffsets.Num())
-	{
-		double Start = Curve.Points[0].Dist;
-		double End = Curve.Points.Last().Dist;
-		double Length = End - Start;
-		int NumSegments = FMath::RoundToInt(Length / (DashLength + DashSpacing));
-		double Step = Length / NumSegments;
-		double ActualSpacing = Step - DashLength;
-		for (int i = 0; i < NumSegments; i++)
+	//Dashes are laid out by arc length, Curve.Dist need not be arc length
+	FArcLengthTable Table(Curve);
+	double Length = Table.Length();
+	double Period = DashLength + DashSpacing;
+	double Start = Phase;
+	Phase += Length;
+	if (DashOffsets.Num() && DashLength > 0 && Period > 0)
+	{
+		//Dash k covers [k * Period + DashSpacing / 2, +DashLength] of the boundary's arc length, clipped to this piece
+		TArray<FVector2D> Dashes;
+		for (int64 k = FMath::FloorToInt64((Start - DashSpacing / 2 - DashLength) / Period) + 1; k * Period + DashSpacing / 2 < Start + Length; k++)
+		{
+			double DashFirst = FMath::Max(k * Period + DashSpacing / 2 - Start, 0.0);
+			double DashLast = FMath::Min(k * Period + DashSpacing / 2 + DashLength - Start, Length);
+			if (DashLast > DashFirst)
+				Dashes.Add(bReversed ? FVector2D(Length - DashLast, Length - DashFirst) : FVector2D(DashFirst, DashLast));
+		}
+		if (bReversed)
+			Algo::Reverse(Dashes);
+		//Walk the curve once, dashes spanning curve points keep them with their mitered rights
+		TArray<FVector> Rights;
+		Rights.AddUninitialized(Curve.Points.Num());
+		for (int i = 0; i < Curve.Points.Num(); i++)
+			Rights[i] = Curve.GetStraightRight(i);
+		TArray<FPolyPoint> DashPoints;
+		TArray<FVector> DashRights;
+		TArray<FPolyPoint> LeftPoints, RightPoints;
+		TArray<FIntPoint> Spans;
+		//Dashes projected onto junction surface can't be flat instances
+		UStaticMesh* Mesh = InstanceBuilder && !Junction ? DashMesh.LoadSynchronous() : nullptr;
+		FVector MeshSize = Mesh ? Mesh->GetBoundingBox().GetSize() : FVector::ZeroVector;
+		if (FMath::IsNearlyZero(MeshSize.X) || FMath::IsNearlyZero(MeshSize.Y))
+			Mesh = nullptr;
+		int Cursor = 0;
+		for (const FVector2D& Dash : Dashes)
 		{
-			double Base = Start + Step * i;
-			FPolyline SubCurve = Curve.SubCurve(Base + ActualSpacing / 2, Base + ActualSpacing / 2 + DashLength);
+			double DashStart = Table.ArcToS(Dash.X);
+			double DashEnd = Table.ArcToS(Dash.Y);
+			if (DashEnd <= DashStart)
+				continue;
+			while (Cursor + 2 < Curve.Points.Num() && Curve.Points[Cursor + 1].Dist <= DashStart)
+				Cursor++;
+			auto GetSegmentRight = [&](int Index)
+			{
+				return (FVector::UpVector ^ (Curve.Points[Index + 1].Pos - Curve.Points[Index].Pos)).GetSafeNormal();
+			};
+			DashPoints.Reset();
+			DashRights.Reset();
+			DashPoints.Add(FPolyPoint::Lerp(Curve.Points[Cursor], Curve.Points[Cursor + 1], DashStart));
+			DashRights.Add(GetSegmentRight(Cursor));
+			int Index = Cursor + 1;
+			for (; Index + 1 < Curve.Points.Num() && Curve.Points[Index].Dist < DashEnd; Index++)
+			{
+				DashPoints.Add(Curve.Points[Index]);
+				DashRights.Add(Rights[Index]);
+			}
+			DashPoints.Add(FPolyPoint::Lerp(Curve.Points[Index - 1], Curve.Points[Index], DashEnd));
+			DashRights.Add(GetSegmentRight(Index - 1));
+			if (Mesh && FMath::Acos(FMath::Clamp(DashRights[0] | DashRights.Last(), -1.0, 1.0)) <= MaxDashCurvature * (DashEnd - DashStart))
+			{
+				for (double Offset : DashOffsets)
+				{
+					FVector DashFirst = DashPoints[0].Pos + DashRights[0] * Offset;
+					FVector DashLast = DashPoints.Last().Pos + DashRights.Last() * Offset;
+					FVector Dir = DashLast - DashFirst;
+					FVector Scale(Dir.Size() / MeshSize.X, Width / MeshSize.Y, 1);
+					FTransform Trans(FRotationMatrix::MakeFromXZ(Dir, FVector::UpVector).ToQuat(), (DashFirst + DashLast) / 2, Scale);
+					InstanceBuilder->AddInstance(Mesh, Trans, false, Material);
+				}
+				continue;
+			}
 			for (double Offset : DashOffsets)
 			{
-				FPolyline LeftCurve = SubCurve.Offset(FVector2D(Offset - Width / 2, 0), true);
-				FPolyline RightCurve = SubCurve.Offset(FVector2D(Offset + Width / 2, 0), true);
-				if (Junction)
+				Spans.Add(FIntPoint(LeftPoints.Num(), DashPoints.Num()));
+				for (int j = 0; j < DashPoints.Num(); j++)
 				{
-					Junction->FixHeight(LeftCurve);
-					Junction->FixHeight(RightCurve);
+					const FPolyPoint& Point = DashPoints[j];
+					LeftPoints.Add(FPolyPoint(Point.Pos + DashRights[j] * (Offset - Width / 2), Point.Radian, Point.Dist));
+					RightPoints.Add(FPolyPoint(Point.Pos + DashRights[j] * (Offset + Width / 2), Point.Radian, Point.Dist));
 				}
-				Builder.AddStrip(Material, LeftCurve, RightCurve);
 			}
 		}
+		if (Junction)
+		{
+			Junction->FixHeight(LeftPoints);
+			Junction->FixHeight(RightPoints);
+		}
+		if (Spans.Num())
+			Builder.AddStrips(Material, LeftPoints, RightPoints, Spans);
 	}
 	for (double Offset : SolidOffsets)
 	{
@@ -75,13 +160,15 @@ void ULaneMarkStyle::BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPolyl
 
 void UCrosswalkStyle::BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPolyline& Curve)
 {
-	FPolyline Points = Curve.Resample(DashLength + DashGap);
+	FArcLengthTable Table(Curve);
+	int NumStripes = FMath::Max(1, FMath::RoundToInt(Table.Length() / (DashLength + DashGap)));
+	double Step = Table.Length() / NumStripes;
 	AJunctionActor* Junction = Cast<AJunctionActor>(Cast<ARoadActor>(Caller)->GetAttachParentActor());
-	for (int i = 0; i < Points.Points.Num(); i++)
+	for (int i = 0; i <= NumStripes; i++)
 	{
-		FVector VDir = Points.GetStraightDir(i);
+		FVector VDir = Table.GetDir(i * Step);
 		FVector HDir(-VDir.Y, VDir.X, VDir.Z);
-		FVector& Pos = Points.Points[i].Pos;
+		FVector Pos = Table.Sample(i * Step).Pos;
 		FPolyline LeftCurve({ FPolyPoint(Pos + VDir * DashLength / 2 - HDir * Width / 2, 0), FPolyPoint(Pos + VDir * DashLength / 2 + HDir * Width / 2, Width) });
 		FPolyline RightCurve({ FPolyPoint(Pos - VDir * DashLength / 2 - HDir * Width / 2, 0), FPolyPoint(Pos - VDir * DashLength / 2 + HDir * Width / 2, Width) });
 		if (Junction)
@@ -93,41 +180,76 @@ void UCrosswalkStyle::BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPoly
 	}
 }
 
-void UPolygonMarkStyle::BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPolyline& Curve)
+struct FHatchEdge
 {
-	struct FLine
+	double GetU(double V) const
 	{
-		FVector GetPoint(double S) const
-		{
-			return FMath::Lerp(Start, End, S);
-		}
-		FVector GetDir()
-		{
-			return (End - Start).GetSafeNormal();
-		}
-		FVector GetRight()
-		{
-			FVector Dir = GetDir();
-			return FVector(-Dir.Y, Dir.X, Dir.Z);
-		}
-		FLine LeftLine(double Offset)
-		{
-			FVector Right = GetRight();
-			return { Start - Right * Offset, End - Right * Offset };
-		}
-		FLine RightLine(double Offset)
+		return FMath::Lerp(U0, U1, (V - V0) / (V1 - V0));
+	}
+	double GetZ(double V) const
+	{
+		return FMath::Lerp(Z0, Z1, (V - V0) / (V1 - V0));
+	}
+	double U0, V0, Z0;
+	double U1, V1, Z1;
+};
+
+//Edges of the region in the frame of hatch direction Dir (U along Dir, V across), sorted by lower V
+static TArray<FHatchEdge> GetHatchEdges(const FPolyline& Curve, const FVector2D& Dir)
+{
+	FVector2D Right(-Dir.Y, Dir.X);
+	TArray<FHatchEdge> Edges;
+	Edges.Reserve(Curve.Points.Num() - 1);
+	for (int i = 0; i < Curve.Points.Num() - 1; i++)
+	{
+		const FVector& P0 = Curve.Points[i].Pos;
+		const FVector& P1 = Curve.Points[i + 1].Pos;
+		FHatchEdge Edge = { Dir | FVector2D(P0), Right | FVector2D(P0), P0.Z, Dir | FVector2D(P1), Right | FVector2D(P1), P1.Z };
+		//Edges parallel to hatch lines are never crossed
+		if (Edge.V0 == Edge.V1)
+			continue;
+		if (Edge.V0 > Edge.V1)
 		{
-			FVector Right = GetRight();
-			return { Start + Right * Offset, End + Right * Offset };
+			Swap(Edge.U0, Edge.U1);
+			Swap(Edge.V0, Edge.V1);
+			Swap(Edge.Z0, Edge.Z1);
 		}
+		Edges.Add(Edge);
+	}
+	Edges.Sort([](const FHatchEdge& A, const FHatchEdge& B) { return A.V0 < B.V0; });
+	return MoveTemp(Edges);
+}
+
+//Keeps the edges crossing scanline V in [V0, V1), V must not decrease between calls
+struct FActiveEdgeTable
+{
+	FActiveEdgeTable(const TArray<FHatchEdge>& InEdges) :Edges(InEdges) {}
+	void Advance(double V)
+	{
+		while (Next < Edges.Num() && Edges[Next].V0 <= V)
+			Active.Add(Next++);
+		for (int i = Active.Num() - 1; i >= 0; i--)
+			if (Edges[Active[i]].V1 <= V)
+				Active.RemoveAtSwap(i, 1, false);
+	}
+	const TArray<FHatchEdge>& Edges;
+	TArray<int> Active;
+	int Next = 0;
+};
+
+void UPolygonMarkStyle::BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPolyline& Curve)
+{
+	struct FLine
+	{
 		FVector Start;
 		FVector End;
-
 	};
 	UMarkingCurve* Marking = Cast<UMarkingCurve>(Caller);
 	ARoadActor* Road = Marking->GetRoad();
 	double Margin = 10.0;
-	TArray<FLine> Lines;
+	double HalfWidth = 5.0;
+	//Hatch lines grouped by direction
+	TArray<FLine> Families[2];
 	const FVector& Origin = Curve.Points[0].Pos;
 	FTransform Trans(FRotator(0, Marking->Orientation, 0), Origin);
 	FBox Box(EForceInit::ForceInit);
@@ -138,14 +260,47 @@ void UPolygonMarkStyle::BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPo
 	{
 		return { Trans.TransformPosition(Start), Trans.TransformPosition(End) };
 	};
+	TArray<FVector> Vertices;
+	TArray<FIndex3i> Triangles;
+	auto AddQuad = [&](const FVector& Upper0, const FVector& Upper1, const FVector& Lower0, const FVector& Lower1)
+	{
+		int Base = Vertices.Num();
+		Vertices.Append({ Upper0, Upper1, Lower0, Lower1 });
+		Triangles.Add(FIndex3i(Base + 0, Base + 1, Base + 2));
+		Triangles.Add(FIndex3i(Base + 2, Base + 1, Base + 3));
+	};
 	switch (MarkType)
 	{
 	case EPolygonMarkType::Solid:
 	{
-		TArray<FVector> Points = Curve.GetPositions();
-		if (Junction)
-			Junction->FixHeight(Points);
-		Builder.AddPolygon(Material, nullptr, Points);
+		//Trapezoids between consecutive vertex scanlines
+		FVector2D Dir(Trans.GetUnitAxis(EAxis::X));
+		FVector2D Right(-Dir.Y, Dir.X);
+		TArray<FHatchEdge> Edges = GetHatchEdges(Curve, Dir);
+		TArray<double> Events;
+		for (const FHatchEdge& Edge : Edges)
+			Events.Append({ Edge.V0, Edge.V1 });
+		Events.Sort();
+		FActiveEdgeTable Table(Edges);
+		TArray<const FHatchEdge*> Crossings;
+		auto GetPoint = [&](const FHatchEdge& Edge, double V)
+		{
+			return FVector(Dir * Edge.GetU(V) + Right * V, Edge.GetZ(V));
+		};
+		for (int i = 0; i + 1 < Events.Num(); i++)
+		{
+			double Lower = Events[i], Upper = Events[i + 1];
+			if (Upper <= Lower)
+				continue;
+			Table.Advance(Lower);
+			double Mid = (Lower + Upper) / 2;
+			Crossings.Reset();
+			for (int Index : Table.Active)
+				Crossings.Add(&Edges[Index]);
+			Crossings.Sort([Mid](const FHatchEdge& A, const FHatchEdge& B) { return A.GetU(Mid) < B.GetU(Mid); });
+			for (int j = 0; j + 1 < Crossings.Num(); j += 2)
+				AddQuad(GetPoint(*Crossings[j], Upper), GetPoint(*Crossings[j + 1], Upper), GetPoint(*Crossings[j], Lower), GetPoint(*Crossings[j + 1], Lower));
+		}
 		break;
 	}
 	case EPolygonMarkType::Striped:
@@ -156,7 +311,7 @@ void UPolygonMarkStyle::BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPo
 		double StepY = Size.Y / NumRows;
 		for (int i = 0; i < NumRows; i++)
 		{
-			Lines.Add(CreateLine(Start, Start + FVector(Size.X, 0, 0)));
+			Families[0].Add(CreateLine(Start, Start + FVector(Size.X, 0, 0)));
 			Start.Y += StepY;
 		}
 		break;
@@ -171,13 +326,13 @@ void UPolygonMarkStyle::BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPo
 		double StepY = Size.Y / NumRows;
 		for (int i = 0; i < NumRows; i++)
 		{
-			Lines.Add(CreateLine(Start, Start + FVector(Size.X, 0, 0)));
+			Families[0].Add(CreateLine(Start, Start + FVector(Size.X, 0, 0)));
 			Start.Y += StepY;
 		}
 		Start = Box.Min - FVector(Margin, Margin, 0);
 		for (int i = 0; i < NumCols; i++)
 		{
-			Lines.Add(CreateLine(Start, Start + FVector(0, Size.Y, 0)));
+			Families[1].Add(CreateLine(Start, Start + FVector(0, Size.Y, 0)));
 			Start.X += StepX;
 		}
 		break;
@@ -195,44 +350,58 @@ void UPolygonMarkStyle::BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPo
 		double StepY = Size.Y / NumRows;
 		for (int i = 0; i < NumRows; i++)
 		{
-			Lines.Add(CreateLine(Start, Start + FVector(-Size.X / Sin, Size.X, 0)));
-			Lines.Add(CreateLine(Start, Start + FVector(Size.X / Sin, Size.X, 0)));
+			Families[0].Add(CreateLine(Start, Start + FVector(-Size.X / Sin, Size.X, 0)));
+			Families[1].Add(CreateLine(Start, Start + FVector(Size.X / Sin, Size.X, 0)));
 			Start.Y += StepY;
 		}
 		break;
 	}
 	}
-	for (FLine& Line : Lines)
+	for (TArray<FLine>& Lines : Families)
 	{
-		TArray<double> Hits = { 0 };
-		for (int i = 0; i < Curve.Points.Num() - 1; i++)
-		{
-			const FVector2D& P0 = (FVector2D&)Curve.Points[i].Pos;
-			const FVector2D& P1 = (FVector2D&)Curve.Points[i + 1].Pos;
-			double Hit0, Hit1;
-			if (DoLineSegmentsIntersect((FVector2D&)Line.Start, (FVector2D&)Line.End, P0, P1, Hit0, Hit1))
-				Hits.Add(Hit0);
-		}
-		auto SolvePoints = [](const FLine& Line, TArray<double>& Hits)->TArray<FVector>
+		if (!Lines.Num())
+			continue;
+		//Lines of a family are parallel, sweep across them in the frame of their direction
+		FVector2D Dir = FVector2D(Lines[0].End - Lines[0].Start).GetSafeNormal();
+		FVector2D Right(-Dir.Y, Dir.X);
+		TArray<FHatchEdge> Edges = GetHatchEdges(Curve, Dir);
+		Lines.Sort([&Right](const FLine& A, const FLine& B) { return (Right | FVector2D(A.Start)) < (Right | FVector2D(B.Start)); });
+		FActiveEdgeTable Table(Edges);
+		TArray<TPair<double, double>> Crossings;
+		for (const FLine& Line : Lines)
 		{
-			Hits.Sort();
-			int Start = Hits.Num() % 2 ? 1 : 0;
-			TArray<FVector> Points;
-			for (int i = Start; i < Hits.Num(); i += 2)
+			double V = Right | FVector2D(Line.Start);
+			double UStart = Dir | FVector2D(Line.Start);
+			double UEnd = Dir | FVector2D(Line.End);
+			Table.Advance(V);
+			Crossings.Reset();
+			for (int Index : Table.Active)
+				Crossings.Add(TPair<double, double>(Edges[Index].GetU(V), Edges[Index].GetZ(V)));
+			Crossings.Sort([](const TPair<double, double>& A, const TPair<double, double>& B) { return A.Key < B.Key; });
+			for (int i = 0; i + 1 < Crossings.Num(); i += 2)
 			{
-				Points.Add(Line.GetPoint(Hits[i]));
-				Points.Add(Line.GetPoint(Hits[i + 1]));
+				//Clip inside spans to the extent of the line, chevron lines start inside the region
+				const TPair<double, double>& Enter = Crossings[i];
+				const TPair<double, double>& Leave = Crossings[i + 1];
+				double U0 = FMath::Max(Enter.Key, FMath::Min(UStart, UEnd));
+				double U1 = FMath::Min(Leave.Key, FMath::Max(UStart, UEnd));
+				if (U1 <= U0)
+					continue;
+				auto GetZ = [&](double U)
+				{
+					return Leave.Key > Enter.Key ? FMath::Lerp(Enter.Value, Leave.Value, (U - Enter.Key) / (Leave.Key - Enter.Key)) : Enter.Value;
+				};
+				FVector Offset(Right * HalfWidth, 0);
+				FVector P0(Dir * U0 + Right * V, GetZ(U0));
+				FVector P1(Dir * U1 + Right * V, GetZ(U1));
+				AddQuad(P0 + Offset, P1 + Offset, P0 - Offset, P1 - Offset);
 			}
-			return MoveTemp(Points);
-		};
-		TArray<FVector> LeftPoints = SolvePoints(Line.LeftLine(5), Hits);
-		TArray<FVector> RightPoints = SolvePoints(Line.RightLine(5), Hits);
-		if (Junction)
-		{
-			Junction->FixHeight(LeftPoints);
-			Junction->FixHeight(RightPoints);
 		}
-		for (int i = 0; i < LeftPoints.Num(); i += 2)
-			Builder.AddTriangles(Material, { FIndex3i(0,1,2), FIndex3i(2,1,3) }, { RightPoints[i], RightPoints[i + 1], LeftPoints[i], LeftPoints[i + 1] }, FVector::UpVector);
+	}
+	if (Vertices.Num())
+	{
+		if (Junction)
+			Junction->FixHeight(Vertices);
+		Builder.AddTriangles(Material, Triangles, Vertices, FVector::UpVector);
 	}
 }
\ No newline at end of file
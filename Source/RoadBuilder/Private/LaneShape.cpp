@@ -71,4 +71,16 @@ void ULaneShape::BuildMesh(FRoadMesh& Builder, const FPolyline& LeftCurve, const
 			Builder.AddStrip(CrossSection.Material, StartCurve.Offset(CrossSection.Points[0]), EndCurve.Offset(CrossSection.Points[1]));
 		}
 	}
+}
+
+void ULaneShape::BuildCollision(FRoadMesh& Builder, const FPolyline& LeftCurve, const FPolyline& RightCurve)
+{
+	for (FLaneCrossSection& CrossSection : CrossSections)
+	{
+		if (CrossSection.Alignment == ELaneAlignment::Up && CrossSection.Points.Num() == 2)
+		{
+			Builder.AddCollisionStrip(LeftCurve.Offset(CrossSection.Points[0]), RightCurve.Offset(CrossSection.Points[1]));
+			break;
+		}
+	}
 }
\ No newline at end of file
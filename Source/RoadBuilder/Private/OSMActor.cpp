@@ -2,49 +2,269 @@
 // Copyright 2024. All Rights Reserved.
 
 #include "OSMActor.h"
+#include "OSMReader.h"
 #include "RoadScene.h"
 #include "Settings.h"
 #include "HttpModule.h"
+#include "Async/ParallelFor.h"
 #include "Engine/World.h"
 #include "Interfaces/IHttpRequest.h"
 #include "Interfaces/IHttpResponse.h"
 #include "Kismet/GameplayStatics.h"
-#include "Misc/FileHelper.h"
 #include "StructDialog.h"
 
-FOSMElement::FOSMElement(const FXmlNode* Node)
+int32 FOSMData::InternKey(FName Key)
 {
-	Id = FCString::Strtoui64(*Node->GetAttribute(TEXT("id")), nullptr, 16);
-	for (const FXmlNode* Child = Node->GetFirstChildNode(); Child; Child = Child->GetNextNode())
-		if (Child->GetTag() == TEXT("tag"))
-			Tags.Add(*Child->GetAttribute(TEXT("k")), Child->GetAttribute(TEXT("v")));
+	int32& Index = KeyIndices.FindOrAdd(Key, INDEX_NONE);
+	if (Index == INDEX_NONE)
+		Index = TagKeys.Add(Key);
+	return Index;
 }
 
-FOSMNode::FOSMNode(const FXmlNode* Node) :FOSMElement(Node)
+int32 FOSMData::InternValue(const FString& Value)
 {
-	Lonlat = FVector2D(FCString::Atod(*Node->GetAttribute(TEXT("lon"))), FCString::Atod(*Node->GetAttribute(TEXT("lat"))));
+	int32& Index = ValueIndices.FindOrAdd(Value, INDEX_NONE);
+	if (Index == INDEX_NONE)
+		Index = TagValues.Add(Value);
+	return Index;
 }
 
-void FOSMNode::Build(AOSMActor* OSM)
+void FOSMData::AddTags(const TMap<FName, FString>& Tags, TArray<int32>& Offsets, TArray<FIntPoint>& Dest)
 {
-	OSM->GeographicToEngine(FGeographicCoordinates(Lonlat.X, Lonlat.Y, 0), Pos);
+	if (!Offsets.Num())
+		Offsets.Add(0);
+	for (const TPair<FName, FString>& KV : Tags)
+		Dest.Add(FIntPoint(InternKey(KV.Key), InternValue(KV.Value)));
+	Offsets.Add(Dest.Num());
 }
 
-FOSMWay::FOSMWay(const FXmlNode* Node) :FOSMElement(Node)
+void FOSMData::BuildLookups()
 {
-	for (const FXmlNode* Child = Node->GetFirstChildNode(); Child; Child = Child->GetNextNode())
-		if (Child->GetTag() == TEXT("nd"))
-			Nodes.Add(FCString::Strtoui64(*Child->GetAttribute(TEXT("ref")), nullptr, 16));
+	//Lookups are transient, they are rebuilt once after loading and kept up to date by the Add functions
+	if (KeyIndices.Num() != TagKeys.Num())
+	{
+		KeyIndices.Reset();
+		for (int32 i = 0; i < TagKeys.Num(); i++)
+			KeyIndices.Add(TagKeys[i], i);
+	}
+	if (ValueIndices.Num() != TagValues.Num())
+	{
+		ValueIndices.Reset();
+		for (int32 i = 0; i < TagValues.Num(); i++)
+			ValueIndices.Add(TagValues[i], i);
+	}
+	if (NodeIndices.Num() != NodeIds.Num())
+	{
+		NodeIndices.Reset();
+		for (int32 i = 0; i < NodeIds.Num(); i++)
+			NodeIndices.Add(NodeIds[i], i);
+	}
+	if (WayIndices.Num() != WayIds.Num())
+	{
+		WayIndices.Reset();
+		for (int32 i = 0; i < WayIds.Num(); i++)
+			WayIndices.Add(WayIds[i], i);
+	}
+	if (RelationIndices.Num() != RelationIds.Num())
+	{
+		RelationIndices.Reset();
+		for (int32 i = 0; i < RelationIds.Num(); i++)
+			RelationIndices.Add(RelationIds[i], i);
+	}
+}
+
+void FOSMData::AddNode(const FOSMNode& Node)
+{
+	BuildLookups();
+	int32& Index = NodeIndices.FindOrAdd(Node.Id, INDEX_NONE);
+	if (Index != INDEX_NONE)
+		return;
+	Index = NodeIds.Add(Node.Id);
+	NodeLonlats.Add(Node.Lonlat);
+	AddTags(Node.Tags, NodeTagOffsets, NodeTags);
+}
+
+void FOSMData::AddWay(const FOSMWay& Way)
+{
+	BuildLookups();
+	int32& Index = WayIndices.FindOrAdd(Way.Id, INDEX_NONE);
+	if (Index != INDEX_NONE)
+		return;
+	Index = WayIds.Add(Way.Id);
+	if (!WayRefOffsets.Num())
+		WayRefOffsets.Add(0);
+	WayRefs.Append(Way.Nodes);
+	WayRefOffsets.Add(WayRefs.Num());
+	AddTags(Way.Tags, WayTagOffsets, WayTags);
+}
+
+void FOSMData::AddRelation(const FOSMRelation& Relation)
+{
+	BuildLookups();
+	int32& Index = RelationIndices.FindOrAdd(Relation.Id, INDEX_NONE);
+	if (Index != INDEX_NONE)
+		return;
+	Index = RelationIds.Add(Relation.Id);
+	if (!RelationMemberOffsets.Num())
+		RelationMemberOffsets.Add(0);
+	auto AddMembers = [&](const TMap<uint64, FName>& Members, EMemberType Type)
+	{
+		for (const TPair<uint64, FName>& KV : Members)
+		{
+			RelationMembers.Add(KV.Key);
+			RelationMemberTypes.Add(Type);
+			RelationMemberRoles.Add(InternKey(KV.Value));
+		}
+	};
+	AddMembers(Relation.Nodes, Member_Node);
+	AddMembers(Relation.Ways, Member_Way);
+	AddMembers(Relation.Relations, Member_Relation);
+	RelationMemberOffsets.Add(RelationMembers.Num());
+	AddTags(Relation.Tags, RelationTagOffsets, RelationTags);
+}
+
+void FOSMData::Link()
+{
+	BuildLookups();
+	int32 NodeCount = NodeIds.Num();
+	int32 WayCount = WayIds.Num();
+	WayNodeOffsets.SetNumUninitialized(WayCount + 1);
+	WayNodeOffsets[0] = 0;
+	WayNodes.Reset(WayRefs.Num());
+	for (int32 i = 0; i < WayCount; i++)
+	{
+		for (int32 j = WayRefOffsets[i]; j < WayRefOffsets[i + 1]; j++)
+			if (const int32* Node = NodeIndices.Find(WayRefs[j]))
+				WayNodes.Add(*Node);
+		WayNodeOffsets[i + 1] = WayNodes.Num();
+	}
+	//Count then fill, LastWay keeps closed ways from being listed twice at their first node
+	TArray<int32> LastWay;
+	LastWay.Init(INDEX_NONE, NodeCount);
+	NodeWayOffsets.Init(0, NodeCount + 1);
+	for (int32 i = 0; i < WayCount; i++)
+	{
+		for (int32 j = WayNodeOffsets[i]; j < WayNodeOffsets[i + 1]; j++)
+		{
+			int32 Node = WayNodes[j];
+			if (LastWay[Node] != i)
+			{
+				LastWay[Node] = i;
+				NodeWayOffsets[Node + 1]++;
+			}
+		}
+	}
+	for (int32 i = 0; i < NodeCount; i++)
+		NodeWayOffsets[i + 1] += NodeWayOffsets[i];
+	NodeWays.SetNumUninitialized(NodeWayOffsets[NodeCount]);
+	TArray<int32> Cursors(NodeWayOffsets.GetData(), NodeCount);
+	LastWay.Init(INDEX_NONE, NodeCount);
+	for (int32 i = 0; i < WayCount; i++)
+	{
+		for (int32 j = WayNodeOffsets[i]; j < WayNodeOffsets[i + 1]; j++)
+		{
+			int32 Node = WayNodes[j];
+			if (LastWay[Node] != i)
+			{
+				LastWay[Node] = i;
+				NodeWays[Cursors[Node]++] = i;
+			}
+		}
+	}
+}
+
+void FOSMData::GetWayColumn(FName Key, TArray<int32>& Column) const
+{
+	Column.Init(INDEX_NONE, WayIds.Num());
+	int32 KeyIndex = TagKeys.Find(Key);
+	if (KeyIndex == INDEX_NONE)
+		return;
+	for (int32 i = 0; i < WayIds.Num(); i++)
+	{
+		for (int32 j = WayTagOffsets[i]; j < WayTagOffsets[i + 1]; j++)
+		{
+			if (WayTags[j].X == KeyIndex)
+			{
+				Column[i] = WayTags[j].Y;
+				break;
+			}
+		}
+	}
+}
+
+void FOSMData::GetWayInts(FName Key, TArray<int32>& Result) const
+{
+	TArray<int32> Column;
+	GetWayColumn(Key, Column);
+	Result.SetNumUninitialized(Column.Num());
+	for (int32 i = 0; i < Column.Num(); i++)
+		Result[i] = Column[i] == INDEX_NONE ? 0 : FCString::Atoi(*TagValues[Column[i]]);
+}
+
+void FOSMData::FilterWays(FName Key, const TArray<FString>& Values, TArray<bool>& Result) const
+{
+	TArray<int32> Column;
+	GetWayColumn(Key, Column);
+	//Lookup by value index shifted by one so ways without the tag read the first entry, the scan has no branches
+	TArray<bool> Table;
+	Table.Init(false, TagValues.Num() + 1);
+	for (const FString& Value : Values)
+	{
+		int32 Index = TagValues.Find(Value);
+		if (Index != INDEX_NONE)
+			Table[Index + 1] = true;
+	}
+	Result.SetNumUninitialized(Column.Num());
+	const int32* Src = Column.GetData();
+	const bool* Lookup = Table.GetData();
+	bool* Dst = Result.GetData();
+	for (int32 i = 0; i < Column.Num(); i++)
+		Dst[i] = Lookup[Src[i] + 1];
+}
+
+//Replaces list Index of an offset indexed array, later offsets are shifted
+template<typename T>
+static void ReplaceList(TArray<int32>& Offsets, TArray<T>& Values, int32 Index, const TArray<T>& List)
+{
+	int32 Start = Offsets[Index];
+	int32 Num = Offsets[Index + 1] - Start;
+	Values.RemoveAt(Start, Num, false);
+	Values.Insert(List, Start);
+	for (int32 i = Index + 1; i < Offsets.Num(); i++)
+		Offsets[i] += List.Num() - Num;
+}
+
+void FOSMData::SetWay(int32 Way, const FOSMWay& Record)
+{
+	BuildLookups();
+	ReplaceList(WayRefOffsets, WayRefs, Way, Record.Nodes);
+	TArray<FIntPoint> Tags;
+	for (const TPair<FName, FString>& KV : Record.Tags)
+		Tags.Add(FIntPoint(InternKey(KV.Key), InternValue(KV.Value)));
+	ReplaceList(WayTagOffsets, WayTags, Way, Tags);
 }
 
-void FOSMWay::AttachTo(FOSMWay* MainRoad, int NodeIndex, int RampIndex)
+FOSMWay FOSMData::GetWay(int32 Way) const
 {
-	TArray<URoadLane*> Lanes = MainRoad->Road->GetLanes(0, { ELaneType::Driving, ELaneType::Shoulder });
+	FOSMWay Result;
+	Result.Id = WayIds[Way];
+	for (int32 i = WayRefOffsets[Way]; i < WayRefOffsets[Way + 1]; i++)
+		Result.Nodes.Add(WayRefs[i]);
+	for (int32 i = WayTagOffsets[Way]; i < WayTagOffsets[Way + 1]; i++)
+		Result.Tags.Add(TagKeys[WayTags[i].X], TagValues[WayTags[i].Y]);
+	return Result;
+}
+
+void AOSMActor::AttachTo(int32 Way, int32 MainWay, int NodeIndex, int RampIndex)
+{
+	ARoadActor* Road = WayRoads[Way];
+	ARoadActor* MainRoad = WayRoads[MainWay];
+	TArray<URoadLane*> Lanes = MainRoad->GetLanes(0, { ELaneType::Driving, ELaneType::Shoulder });
 	URoadBoundary* RampBoundary = RampIndex == 0 ? Lanes[RampIndex]->LeftBoundary : Lanes[RampIndex - 1]->RightBoundary;
-	FVector2D UV = MainRoad->Road->GetUV(Road->RoadPoints[NodeIndex ? Road->RoadPoints.Num() - 1 : 0].Pos);
+	FVector2D UV = MainRoad->GetUV(Road->RoadPoints[NodeIndex ? Road->RoadPoints.Num() - 1 : 0].Pos);
 	UV.Y = RampBoundary->GetOffset(UV.X);
 	Road->AddDirPoint(NodeIndex);
-	Road->ConnectTo(MainRoad->Road, UV, NodeIndex);
+	Road->ConnectTo(MainRoad, UV, NodeIndex);
 	FVector Dir = RampBoundary->GetDir(UV.X);
 	FPlane Plane(RampBoundary->GetPos(UV.X), FVector(-Dir.Y, Dir.X, Dir.Z));
 	for (int i = 2; i < Road->RoadPoints.Num(); i++)
@@ -58,26 +278,24 @@ void FOSMWay::AttachTo(FOSMWay* MainRoad, int NodeIndex, int RampIndex)
 	}
 }
 
-void FOSMWay::Build(AOSMActor* OSM)
+void AOSMActor::BuildWay(int32 Way)
 {
+	TArrayView<const int32> Nodes = Data.GetWayNodes(Way);
 	double Dist = 0;
 	int k = 0;
-	for (int i = 1; i < Nodes.Num(); i++)
+	//Nodes between intersections follow the terrain when there is one
+	for (int i = 1; i < Nodes.Num() && !Heightfield.IsValid(); i++)
 	{
-		FOSMNode* Prev = OSM->Nodes.Find(Nodes[i - 1]);
-		FOSMNode* Node = OSM->Nodes.Find(Nodes[i]);
-		Dist += FVector2D::Distance((FVector2D&)Prev->Pos, (FVector2D&)Node->Pos);
-		if (Node->Ways.Num() > 1 || i == Nodes.Num() - 1)
+		Dist += FVector2D::Distance(FVector2D(NodePositions[Nodes[i - 1]]), FVector2D(NodePositions[Nodes[i]]));
+		if (Data.GetNodeWays(Nodes[i]).Num() > 1 || i == Nodes.Num() - 1)
 		{
 			double D = 0;
-			FOSMNode* Start = OSM->Nodes.Find(Nodes[k]);
-			FOSMNode* End = OSM->Nodes.Find(Nodes[i]);
+			double StartZ = NodePositions[Nodes[k]].Z;
+			double EndZ = NodePositions[Nodes[i]].Z;
 			for (int j = k + 1; j < i; j++)
 			{
-				Prev = OSM->Nodes.Find(Nodes[j - 1]);
-				Node = OSM->Nodes.Find(Nodes[j]);
-				D += FVector2D::Distance((FVector2D&)Prev->Pos, (FVector2D&)Node->Pos);
-				Node->Pos.Z = FMath::Lerp(Start->Pos.Z, End->Pos.Z, D / Dist);
+				D += FVector2D::Distance(FVector2D(NodePositions[Nodes[j - 1]]), FVector2D(NodePositions[Nodes[j]]));
+				NodePositions[Nodes[j]].Z = FMath::Lerp(StartZ, EndZ, D / Dist);
 			}
 			k = i;
 			Dist = 0;
@@ -85,61 +303,30 @@ void FOSMWay::Build(AOSMActor* OSM)
 	}
 
 
+	FPolyline& Curve = WayCurves[Way];
 	Curve = FPolyline();
-	for (uint64 NodeId : Nodes)
-	{
-		if (FOSMNode* Node = OSM->Nodes.Find(NodeId))
-		{
-			Curve.AddPoint(Node->Pos, 0);
-		}
-	}
-}
-
-bool FOSMWay::IsDrivable()
-{
-	static TArray<FString> Highways = { TEXT("motorway"), TEXT("trunk"), TEXT("primary"), TEXT("secondary"), TEXT("tertiary") };
-	if (FString* Tag = Tags.Find(TEXT("highway")))
-	{
-		for (FString& Highway : Highways)
-			if (Highway == *Tag || Highway + TEXT("_link") == *Tag)
-				return true;
-	}
-	return false;
+	for (int32 Node : Nodes)
+		Curve.AddPoint(NodePositions[Node], 0);
 }
 
-double FOSMWay::GetInputRadian(AOSMActor* OSM, int Index)
+double AOSMActor::GetInputRadian(int32 Way, int Index)
 {
+	TArrayView<const int32> Nodes = Data.GetWayNodes(Way);
 	int Prev = FMath::Max(0, Index - 1);
 	Index = Prev + 1;
-	FVector2D Dir = FVector2D(OSM->Nodes[Nodes[Index]].Pos) - FVector2D(OSM->Nodes[Nodes[Prev]].Pos);
+	FVector2D Dir = FVector2D(NodePositions[Nodes[Index]]) - FVector2D(NodePositions[Nodes[Prev]]);
 	return FMath::Atan2(Dir.Y, Dir.X);
 }
 
-double FOSMWay::GetOutputRadian(AOSMActor* OSM, int Index)
+double AOSMActor::GetOutputRadian(int32 Way, int Index)
 {
+	TArrayView<const int32> Nodes = Data.GetWayNodes(Way);
 	int Next = FMath::Min(Nodes.Num() - 1, Index + 1);
 	Index = Next - 1;
-	FVector2D Dir = FVector2D(OSM->Nodes[Nodes[Next]].Pos) - FVector2D(OSM->Nodes[Nodes[Index]].Pos);
+	FVector2D Dir = FVector2D(NodePositions[Nodes[Next]]) - FVector2D(NodePositions[Nodes[Index]]);
 	return FMath::Atan2(Dir.Y, Dir.X);
 }
 
-FOSMRelation::FOSMRelation(const FXmlNode* Node) :FOSMElement(Node)
-{
-	for (const FXmlNode* Child = Node->GetFirstChildNode(); Child; Child = Child->GetNextNode())
-	{
-		if (Child->GetTag() == TEXT("member"))
-		{
-			FString Type = Child->GetAttribute(TEXT("type"));
-			if (Type == TEXT("node"))
-				Nodes.Add(FCString::Strtoui64(*Child->GetAttribute(TEXT("ref")), nullptr, 16), *Child->GetAttribute(TEXT("role")));
-			else if (Type == TEXT("way"))
-				Ways.Add(FCString::Strtoui64(*Child->GetAttribute(TEXT("ref")), nullptr, 16), *Child->GetAttribute(TEXT("role")));
-			else if (Type == TEXT("relation"))
-				Relations.Add(FCString::Strtoui64(*Child->GetAttribute(TEXT("ref")), nullptr, 16), *Child->GetAttribute(TEXT("role")));
-		}
-	}
-}
-
 AOSMActor::AOSMActor(const FObjectInitializer& ObjectInitializer) : Super(ObjectInitializer)
 {
 	RootComponent = CreateDefaultSubobject<UOSMComponent>(TEXT("RootComponent"));
@@ -149,79 +336,193 @@ AOSMActor::AOSMActor(const FObjectInitializer& ObjectInitializer) : Super(Object
 	ProjectedCRS = TEXT("EPSG:32651");
 }
 
-void AOSMActor::AddNode(const FXmlNode* XmlNode)
+void AOSMActor::AddNode(FOSMNode&& Node)
 {
-	FOSMNode Node(XmlNode);
-	Nodes.Add(Node.Id, MoveTemp(Node));
+	Data.AddNode(Node);
 }
 
-void AOSMActor::AddWay(const FXmlNode* XmlNode)
+void AOSMActor::AddWay(FOSMWay&& Way)
 {
-	FOSMWay Way(XmlNode);
-	Ways.Add(Way.Id, MoveTemp(Way));
+	Data.AddWay(Way);
 }
 
-void AOSMActor::AddRelation(const FXmlNode* XmlNode)
+void AOSMActor::AddRelation(FOSMRelation&& Relation)
 {
-	FOSMRelation Relation(XmlNode);
-	Relations.Add(Relation.Id, MoveTemp(Relation));
+	Data.AddRelation(Relation);
 }
 
-void AOSMActor::AnalyzeIntersection(uint64 NodeId, double R, TArray<FOSMWay*>& Inputs, TArray<FOSMWay*>& Outputs)
+void AOSMActor::AnalyzeIntersection(int32 Node, double R, TArray<int32>& Inputs, TArray<int32>& Outputs)
 {
-	FOSMNode& Node = Nodes[NodeId];
-	TMap<FOSMWay*, double> InputDiffs;
-	TMap<FOSMWay*, double> OutputDiffs;
+	TArray<TPair<double, int32>, TInlineAllocator<8>> InputDiffs;
+	TArray<TPair<double, int32>, TInlineAllocator<8>> OutputDiffs;
 	double MaxRadians = FMath::DegreesToRadians(30);
-	for (uint64& WayId : Node.Ways)
+	for (const FOSMWaySlot& Slot : GetNodeSlots(Node))
 	{
-		FOSMWay* Way = &Ways[WayId];
-		int Index = Way->Nodes.Find(NodeId);
-		if (Index < Way->Nodes.Num() - 1)
+		if (Slot.bHasOutput)
 		{
-			double RR = Way->GetOutputRadian(this, Index);
-			double Diff = WrapRadian(RR - R);
+			double Diff = WrapRadian(Slot.OutputRadian - R);
 			if (FMath::Abs(Diff) < MaxRadians)
-			{
-				OutputDiffs.Add(Way, Diff);
-				Outputs.Add(Way);
-			}
+				OutputDiffs.Emplace(Diff, Slot.Way);
 		}
-		if (Index > 0)
+		if (Slot.bHasInput)
 		{
-			double RR = Way->GetInputRadian(this, Index);
-			double Diff = WrapRadian(RR - R);
+			double Diff = WrapRadian(Slot.InputRadian - R);
 			if (FMath::Abs(Diff) < MaxRadians)
-			{
-				InputDiffs.Add(Way, Diff);
-				Inputs.Add(Way);
-			}
+				InputDiffs.Emplace(Diff, Slot.Way);
 		}
 	}
-	Inputs.Sort([&](FOSMWay& A, FOSMWay& B)
+	InputDiffs.StableSort([](const TPair<double, int32>& A, const TPair<double, int32>& B)
 	{
-		return InputDiffs[&A] > InputDiffs[&B];
+		return A.Key > B.Key;
 	});
-	Outputs.Sort([&](FOSMWay& A, FOSMWay& B)
+	OutputDiffs.StableSort([](const TPair<double, int32>& A, const TPair<double, int32>& B)
 	{
-		return OutputDiffs[&A] < OutputDiffs[&B];
+		return A.Key < B.Key;
 	});
+	for (const TPair<double, int32>& Diff : InputDiffs)
+		Inputs.Add(Diff.Value);
+	for (const TPair<double, int32>& Diff : OutputDiffs)
+		Outputs.Add(Diff.Value);
 }
 
 void AOSMActor::Build()
 {
-	for (TPair<uint64, FOSMWay>& KV : Ways)
-		for (uint64& Node : KV.Value.Nodes)
-			Nodes[Node].Ways.AddUnique(KV.Key);
+	Data.Link();
 	USettings_OSM* Settings = GetMutableDefault<USettings_OSM>();
-	for (TPair<uint64, FOSMNode>& KV : Nodes)
+	int32 NumNodes = Data.NumNodes();
+	int32 NumWays = Data.NumWays();
+	LonlatsToEngine(Data.NodeLonlats, NodePositions);
+	if (Heightfield.IsValid())
+		Heightfield.SampleHeights(this, NodePositions);
+	Data.GetWayInts(TEXT("layer"), WayLayers);
+	for (int32 i = 0; i < NumNodes; i++)
 	{
-		KV.Value.Build(this);
-		for (uint64& Way : KV.Value.Ways)
-			KV.Value.Pos.Z += Ways[Way].GetInt(TEXT("layer")) * Settings->LayerHeight / KV.Value.Ways.Num();
+		TArrayView<const int32> Ways = Data.GetNodeWays(i);
+		for (int32 Way : Ways)
+			NodePositions[i].Z += WayLayers[Way] * Settings->LayerHeight / Ways.Num();
 	}
-	for (TPair<uint64, FOSMWay>& KV : Ways)
-		KV.Value.Build(this);
+	static TArray<FString> Highways = { TEXT("motorway"), TEXT("trunk"), TEXT("primary"), TEXT("secondary"), TEXT("tertiary"),
+		TEXT("motorway_link"), TEXT("trunk_link"), TEXT("primary_link"), TEXT("secondary_link"), TEXT("tertiary_link") };
+	Data.FilterWays(TEXT("highway"), Highways, DrivableWays);
+	WayCurves.SetNum(NumWays);
+	WayRoads.Init(nullptr, NumWays);
+	for (int32 i = 0; i < NumWays; i++)
+	{
+		BuildWay(i);
+		//Ways cut by the extract may have lost their nodes
+		if (Data.GetWayNodes(i).Num() < 2)
+			DrivableWays[i] = false;
+	}
+	BuildSlots();
+}
+
+void AOSMActor::BuildSlots()
+{
+	//Filled in the order Link lists ways at nodes, ways ascending and at the first occurrence of a node
+	int32 NumNodes = Data.NumNodes();
+	TArray<int32> Cursors;
+	Cursors.SetNumUninitialized(NumNodes);
+	for (int32 i = 0; i < NumNodes; i++)
+		Cursors[i] = Data.GetNodeWayOffset(i);
+	TArray<int32> LastWay;
+	LastWay.Init(INDEX_NONE, NumNodes);
+	NodeSlots.SetNumUninitialized(Data.GetNodeWayOffset(NumNodes));
+	for (int32 Way = 0; Way < Data.NumWays(); Way++)
+	{
+		TArrayView<const int32> Nodes = Data.GetWayNodes(Way);
+		for (int32 i = 0; i < Nodes.Num(); i++)
+		{
+			int32 Node = Nodes[i];
+			if (LastWay[Node] == Way)
+				continue;
+			LastWay[Node] = Way;
+			FOSMWaySlot& Slot = NodeSlots[Cursors[Node]++];
+			Slot.Way = Way;
+			Slot.Index = i;
+			Slot.bHasInput = i > 0;
+			Slot.bHasOutput = i < Nodes.Num() - 1;
+			Slot.InputRadian = Slot.bHasInput ? GetInputRadian(Way, i) : 0;
+			Slot.OutputRadian = Slot.bHasOutput ? GetOutputRadian(Way, i) : 0;
+		}
+	}
+}
+
+static void ProjectPatch(AOSMActor* OSM, const TArray<FVector2D>& Lonlats, TArray<FVector>& Positions, const FBox2D& Bounds, TArray<int32>& Indices, int Depth)
+{
+	auto Exact = [&](const FVector2D& Lonlat)
+	{
+		FVector Pos;
+		OSM->GeographicToEngine(FGeographicCoordinates(Lonlat.X, Lonlat.Y, 0), Pos);
+		return Pos;
+	};
+	//Patches are only worth fitting when they cover more points than the samples they take
+	static const int MaxDepth = 8;
+	static const int MinPoints = 32;
+	if (OSM->ProjectionTolerance <= 0 || Depth >= MaxDepth || Indices.Num() < MinPoints)
+	{
+		for (int32 Index : Indices)
+			Positions[Index] = Exact(Lonlats[Index]);
+		return;
+	}
+	//Biquadratic interpolation through a 3x3 grid of exact samples
+	FVector2D Size = Bounds.GetSize().ComponentMax(FVector2D(UE_DOUBLE_SMALL_NUMBER));
+	FVector Samples[9];
+	for (int j = 0; j < 3; j++)
+		for (int i = 0; i < 3; i++)
+			Samples[j * 3 + i] = Exact(Bounds.Min + Size * FVector2D(i, j) / 2);
+	auto Interpolate = [&](const FVector2D& Lonlat)
+	{
+		FVector2D T = (Lonlat - Bounds.Min) / Size;
+		double U[3] = { 2 * (T.X - 0.5) * (T.X - 1), -4 * T.X * (T.X - 1), 2 * T.X * (T.X - 0.5) };
+		double V[3] = { 2 * (T.Y - 0.5) * (T.Y - 1), -4 * T.Y * (T.Y - 1), 2 * T.Y * (T.Y - 0.5) };
+		FVector Pos = FVector::ZeroVector;
+		for (int j = 0; j < 3; j++)
+			for (int i = 0; i < 3; i++)
+				Pos += Samples[j * 3 + i] * (U[i] * V[j]);
+		return Pos;
+	};
+	//Checked halfway between the samples, where the interpolation error peaks
+	bool bFits = true;
+	for (int j = 0; j < 2 && bFits; j++)
+	{
+		for (int i = 0; i < 2 && bFits; i++)
+		{
+			FVector2D Lonlat = Bounds.Min + Size * FVector2D(i * 2 + 1, j * 2 + 1) / 4;
+			bFits = FVector::Distance(Exact(Lonlat), Interpolate(Lonlat)) <= OSM->ProjectionTolerance;
+		}
+	}
+	if (bFits)
+	{
+		ParallelFor(Indices.Num(), [&](int32 i)
+		{
+			Positions[Indices[i]] = Interpolate(Lonlats[Indices[i]]);
+		});
+		return;
+	}
+	FVector2D Center = Bounds.GetCenter();
+	TArray<int32> Quadrants[4];
+	for (int32 Index : Indices)
+		Quadrants[(Lonlats[Index].X > Center.X ? 1 : 0) + (Lonlats[Index].Y > Center.Y ? 2 : 0)].Add(Index);
+	Indices.Empty();
+	for (int i = 0; i < 4; i++)
+	{
+		FVector2D Min(i & 1 ? Center.X : Bounds.Min.X, i & 2 ? Center.Y : Bounds.Min.Y);
+		FVector2D Max(i & 1 ? Bounds.Max.X : Center.X, i & 2 ? Bounds.Max.Y : Center.Y);
+		ProjectPatch(OSM, Lonlats, Positions, FBox2D(Min, Max), Quadrants[i], Depth + 1);
+	}
+}
+
+void AOSMActor::LonlatsToEngine(const TArray<FVector2D>& Lonlats, TArray<FVector>& Positions)
+{
+	//Exact projections go through PROJ on this thread, only interpolation runs in parallel
+	Positions.SetNumUninitialized(Lonlats.Num());
+	if (!Lonlats.Num())
+		return;
+	TArray<int32> Indices;
+	Indices.SetNumUninitialized(Lonlats.Num());
+	for (int32 i = 0; i < Lonlats.Num(); i++)
+		Indices[i] = i;
+	ProjectPatch(this, Lonlats, Positions, FBox2D(Lonlats), Indices, 0);
 }
 
 void AOSMActor::CreateRoad(uint64 Id)
@@ -229,44 +530,57 @@ void AOSMActor::CreateRoad(uint64 Id)
 	ARoadScene* Scene = Cast<ARoadScene>(UGameplayStatics::GetActorOfClass(GetWorld(), ARoadScene::StaticClass()));
 	if (!Scene)
 		Scene = GetWorld()->SpawnActor<ARoadScene>();
-	CreateRoad(Scene, Id);
+	int32 Way = Data.FindWay(Id);
+	if (Way == INDEX_NONE)
+		return;
+	CreateRoad(Scene, Way);
 	Scene->Rebuild();
 }
 
-void AOSMActor::CreateRoad(ARoadScene* Scene, uint64 Id)
+void AOSMActor::CreateRoad(ARoadScene* Scene, int32 Way)
 {
 	int MaxRamps = 0;
-	FOSMWay& Way = Ways[Id];
-	if (DebugIds.Contains(Way.Id))
+	if (DebugIds.Contains(Data.WayIds[Way]))
 	{
 		int k = 0;
 	}
-	for (int i = 0; i < Way.Nodes.Num(); i++)
+	TArrayView<const int32> Nodes = Data.GetWayNodes(Way);
+	for (int i = 0; i < Nodes.Num(); i++)
 	{
-		FOSMNode& Node = Nodes[Way.Nodes[i]];
-		if (Node.Ways.Num() > 1)
+		if (Data.GetNodeWays(Nodes[i]).Num() > 1)
 		{
 			if (i > 0)
 			{
-				TArray<FOSMWay*> Inputs, Outputs;
-				AnalyzeIntersection(Way.Nodes[i], Way.GetInputRadian(this, i), Inputs, Outputs);
+				TArray<int32> Inputs, Outputs;
+				AnalyzeIntersection(Nodes[i], GetInputRadian(Way, i), Inputs, Outputs);
 				MaxRamps = FMath::Max(MaxRamps, Outputs.Num());
 			}
-			if (i < Way.Nodes.Num() - 1)
+			if (i < Nodes.Num() - 1)
 			{
-				TArray<FOSMWay*> Inputs, Outputs;
-				AnalyzeIntersection(Way.Nodes[i], Way.GetOutputRadian(this, i), Inputs, Outputs);
+				TArray<int32> Inputs, Outputs;
+				AnalyzeIntersection(Nodes[i], GetOutputRadian(Way, i), Inputs, Outputs);
 				MaxRamps = FMath::Max(MaxRamps, Inputs.Num());
 			}
 		}
 	}
 	USettings_OSM* Settings = GetMutableDefault<USettings_OSM>();
-	Way.Road = Scene->AddRoad(Settings->RoadStyle.LoadSynchronous(), 0);
-	TArray<URoadLane*> Lanes = Way.Road->GetLanes(0, { ELaneType::Driving });
+	ARoadActor* Road = WayRoads[Way] = Scene->AddRoad(Settings->RoadStyle.LoadSynchronous(), 0);
+	TArray<URoadLane*> Lanes = Road->GetLanes(0, { ELaneType::Driving });
 	for (int i = Lanes.Num(); i < MaxRamps; i++)
-		Way.Road->CopyLane(Lanes[0], 0);
-	FPolyline& Curve = Way.Curve;
+		Road->CopyLane(Lanes[0], 0);
+	FPolyline& Curve = WayCurves[Way];
 	FPolyline Resample = Curve.Resample(Settings->Resample);
+	if (Heightfield.IsValid() && Resample.Points.Num() > 2)
+	{
+		//End points keep the heights of their nodes so connected roads meet
+		double LayerHeight = WayLayers[Way] * Settings->LayerHeight;
+		TArray<FVector> Positions;
+		for (int i = 1; i < Resample.Points.Num() - 1; i++)
+			Positions.Add(Resample.Points[i].Pos - FVector(0, 0, LayerHeight));
+		Heightfield.SampleHeights(this, Positions);
+		for (int i = 1; i < Resample.Points.Num() - 1; i++)
+			Resample.Points[i].Pos.Z = Positions[i - 1].Z + LayerHeight;
+	}
 	double Dist = 0;
 	static double Tolerance = 1e-6;
 	FRoadSegment Segment = { Dist, 0, FVector2D(Resample.Points[0].Pos), Resample.GetStraightRadian(0) };
@@ -287,16 +601,16 @@ void AOSMActor::CreateRoad(ARoadScene* Scene, uint64 Id)
 		if (!FMath::IsNearlyEqual(C, C_Avg, Tolerance) || i == Resample.Points.Num() - 1)
 		{
 			Segment.StartCurv = Segment.EndCurv = C_Avg;
-			Way.Road->RoadSegments.Add(MoveTemp(Segment));
-			Way.Road->HeightSegments.Add(MoveTemp(Height));
+			Road->RoadSegments.Add(MoveTemp(Segment));
+			Road->HeightSegments.Add(MoveTemp(Height));
 			Segment = { Dist, 0, FVector2D(Resample.Points[i].Pos), Resample.GetStraightRadian(i) };
 			Height = { Dist, Resample.Points[i].Pos.Z, 0 };
 		}
 	}
 	//TODO: Add Length to HeightSegment???
-	Way.Road->HeightSegments.Add(MoveTemp(Height));
-	Way.Road->RoadPoints = Way.Road->CalcRoadPoints(0, Dist);
-	Way.Road->HeightPoints = Way.Road->CalcHeightPoints(0, Dist);
+	Road->HeightSegments.Add(MoveTemp(Height));
+	Road->RoadPoints = Road->CalcRoadPoints(0, Dist);
+	Road->HeightPoints = Road->CalcHeightPoints(0, Dist);
 //	double LayerHeight = Settings->LayerHeight * Way.GetInt(TEXT("layer"));
 //	double StartHeight = Nodes[Way.Nodes[0]].Pos.Z;
 //	double EndHeight = Nodes[Way.Nodes.Last()].Pos.Z;
@@ -304,25 +618,32 @@ void AOSMActor::CreateRoad(ARoadScene* Scene, uint64 Id)
 //	Way.Road->HeightPoints.Last().Height = EndHeight;
 //	if (!FMath::IsNearlyEqual((StartHeight + EndHeight) / 2, LayerHeight))
 //		Road->HeightPoints[Road->AddHeight(Road->Length() / 2)].Height = LayerHeight;
-	Way.Road->UpdateCurve();
+	Road->UpdateCurve();
 }
 
-void AOSMActor::LoadContent(const FString& Content)
+void AOSMActor::LoadContent(const TArray<uint8>& Content)
 {
-	FFileHelper::SaveStringToFile(Content, *(FPaths::ProjectSavedDir() / TEXT("1.osm")));
+	FOSMXmlReader Reader(this);
+	Reader.Read(Content.GetData(), Content.Num());
+	Build();
+}
 
-	FXmlFile XmlFile(Content, EConstructMethod::ConstructFromBuffer);
-	FXmlNode* RootNode = XmlFile.GetRootNode();
-	for (const FXmlNode* Child = RootNode->GetFirstChildNode(); Child; Child = Child->GetNextNode())
+bool AOSMActor::LoadContentFromFile(const FString& Path)
+{
+	if (Path.EndsWith(TEXT(".pbf")))
 	{
-		if (Child->GetTag() == TEXT("node"))
-			AddNode(Child);
-		else if (Child->GetTag() == TEXT("way"))
-			AddWay(Child);
-		else if (Child->GetTag() == TEXT("relation"))
-			AddRelation(Child);
+		FOSMPbfReader Reader(this);
+		if (!Reader.ReadFile(Path))
+			return false;
+	}
+	else
+	{
+		FOSMXmlReader Reader(this);
+		if (!Reader.ReadFile(Path))
+			return false;
 	}
 	Build();
+	return true;
 }
 #if WITH_EDITOR
 void AOSMActor::ConvertAll()
@@ -333,77 +654,80 @@ void AOSMActor::ConvertAll()
 		ARoadScene* Scene = Cast<ARoadScene>(UGameplayStatics::GetActorOfClass(GetWorld(), ARoadScene::StaticClass()));
 		if (!Scene)
 			Scene = GetWorld()->SpawnActor<ARoadScene>();
-		for (TPair<uint64, FOSMWay>& KV : Ways)
-			if (KV.Value.IsDrivable())
-				CreateRoad(Scene, KV.Key);
-		for (TPair<uint64, FOSMWay>& KV : Ways)
+		for (int32 i = 0; i < Data.NumWays(); i++)
+			if (DrivableWays[i])
+				CreateRoad(Scene, i);
+		for (int32 Way = 0; Way < Data.NumWays(); Way++)
 		{
-			FOSMWay* Way = &KV.Value;
 			if (!Settings->ConnectRoads)
 				continue;
-			if (Way->IsDrivable())
+			if (DrivableWays[Way])
 			{
-				if (DebugIds.Contains(Way->Id))
+				if (DebugIds.Contains(Data.WayIds[Way]))
 				{
 					int k = 0;
 				}
+				TArrayView<const int32> Nodes = Data.GetWayNodes(Way);
+				ARoadActor* Road = WayRoads[Way];
 				TArray<ELaneType> DrivingLaneTypes = { ELaneType::Driving, ELaneType::Shoulder };
-				if (Way->Road->ConnectedParents[0] == nullptr)
+				if (Road->ConnectedParents[0] == nullptr)
 				{
-					TArray<FOSMWay*> Inputs, Outputs;
-					AnalyzeIntersection(Way->Nodes[0], Way->GetOutputRadian(this, 0), Inputs, Outputs);
+					TArray<int32> Inputs, Outputs;
+					AnalyzeIntersection(Nodes[0], GetOutputRadian(Way, 0), Inputs, Outputs);
 					if (Inputs.Num())
 					{
-						FOSMWay* MainRoad = Inputs[0];
-						if (Way == Outputs[0] && MainRoad->Nodes.Last() == Way->Nodes[0] && MainRoad->Road->ConnectedParents[1] == nullptr)
+						int32 MainWay = Inputs[0];
+						ARoadActor* MainRoad = WayRoads[MainWay];
+						if (Way == Outputs[0] && Data.GetWayNodes(MainWay).Last() == Nodes[0] && MainRoad->ConnectedParents[1] == nullptr)
 						{
-							MainRoad->Road->AddDirPoint(1);
-							MainRoad->Road->ConnectTo(Way->Road, FVector2D(0, 0), 1);
-							Way->Road->AddDirPoint(0);
-							Way->Road->ConnectTo(MainRoad->Road, FVector2D(MainRoad->Road->Length(), 0), 0);
+							MainRoad->AddDirPoint(1);
+							MainRoad->ConnectTo(Road, FVector2D(0, 0), 1);
+							Road->AddDirPoint(0);
+							Road->ConnectTo(MainRoad, FVector2D(MainRoad->Length(), 0), 0);
 						}
 						else
 						{
 							int RampIndex = Outputs.Find(Way);
-							Way->AttachTo(MainRoad, 0, RampIndex);
+							AttachTo(Way, MainWay, 0, RampIndex);
 							/*
-							TArray<URoadLane*> Lanes = MainRoad->Road->GetLanes(0, DrivingLaneTypes);
-							FVector2D UV = MainRoad->Road->GetUV(Way->Curve.Points[0].Pos);
+							TArray<URoadLane*> Lanes = MainRoad->GetLanes(0, DrivingLaneTypes);
+							FVector2D UV = MainRoad->GetUV(WayCurves[Way].Points[0].Pos);
 							URoadBoundary* RampBoundary = RampIndex == 0 ? Lanes[RampIndex]->LeftBoundary : Lanes[RampIndex - 1]->RightBoundary;
 							UV.Y = RampBoundary->GetOffset(UV.X);
-							Way->Road->AddDirPoint(0);
-							Way->Road->ConnectTo(MainRoad->Road, UV, 0);*/
+							Road->AddDirPoint(0);
+							Road->ConnectTo(MainRoad, UV, 0);*/
 						}
-						Way->Road->UpdateCurve();
+						Road->UpdateCurve();
 					}
 				}
-				if (Way->Road->ConnectedParents[1] == nullptr)
+				if (Road->ConnectedParents[1] == nullptr)
 				{
-					TArray<FOSMWay*> Inputs, Outputs;
-					AnalyzeIntersection(Way->Nodes.Last(), Way->GetInputRadian(this, Way->Nodes.Num() - 1), Inputs, Outputs);
+					TArray<int32> Inputs, Outputs;
+					AnalyzeIntersection(Nodes.Last(), GetInputRadian(Way, Nodes.Num() - 1), Inputs, Outputs);
 					if (Outputs.Num())
 					{
-						FOSMWay* MainRoad = Outputs[0];
-						if (Way == Inputs[0] && MainRoad->Nodes[0] == Way->Nodes.Last() && MainRoad->Road->ConnectedParents[0] == nullptr)
+						int32 MainWay = Outputs[0];
+						ARoadActor* MainRoad = WayRoads[MainWay];
+						if (Way == Inputs[0] && Data.GetWayNodes(MainWay)[0] == Nodes.Last() && MainRoad->ConnectedParents[0] == nullptr)
 						{
-							Way->Road->AddDirPoint(1);
-							Way->Road->ConnectTo(MainRoad->Road, FVector2D(0, 0), 1);
-							MainRoad->Road->AddDirPoint(0);
-							MainRoad->Road->ConnectTo(Way->Road, FVector2D(Way->Road->Length(), 0), 0);
+							Road->AddDirPoint(1);
+							Road->ConnectTo(MainRoad, FVector2D(0, 0), 1);
+							MainRoad->AddDirPoint(0);
+							MainRoad->ConnectTo(Road, FVector2D(Road->Length(), 0), 0);
 						}
 						else
 						{
 							int RampIndex = Inputs.Find(Way);
-							Way->AttachTo(MainRoad, 1, RampIndex);
+							AttachTo(Way, MainWay, 1, RampIndex);
 							/*
-							TArray<URoadLane*> Lanes = MainRoad->Road->GetLanes(0, DrivingLaneTypes);
-							FVector2D UV = MainRoad->Road->GetUV(Way->Curve.Points.Last().Pos);
+							TArray<URoadLane*> Lanes = MainRoad->GetLanes(0, DrivingLaneTypes);
+							FVector2D UV = MainRoad->GetUV(WayCurves[Way].Points.Last().Pos);
 							URoadBoundary* RampBoundary = RampIndex == 0 ? Lanes[RampIndex]->LeftBoundary : Lanes[RampIndex - 1]->RightBoundary;
 							UV.Y = RampBoundary->GetOffset(UV.X);
-							Way->Road->AddDirPoint(1);
-							Way->Road->ConnectTo(MainRoad->Road, UV, 1);*/
+							Road->AddDirPoint(1);
+							Road->ConnectTo(MainRoad, UV, 1);*/
 						}
-						Way->Road->UpdateCurve();
+						Road->UpdateCurve();
 					}
 				}
 			}
@@ -423,15 +747,11 @@ void AOSMActor::LoadFile()
 			TEXT("Import OSM"),
 			TEXT(""),
 			TEXT(""),
-			TEXT("OSM File (*.osm)|*.osm"),
+			TEXT("OSM File (*.osm;*.pbf)|*.osm;*.pbf"),
 			EFileDialogFlags::None,
 			Files))
 		{
-			FString Content;
-			if (FFileHelper::LoadFileToString(Content, *Files[0]))
-			{
-				LoadContent(Content);
-			}
+			LoadContentFromFile(Files[0]);
 		}
 	}
 }
@@ -443,8 +763,7 @@ void AOSMActor::LoadTile()
 	{
 		if (bSucceeded)
 		{
-			FString Content = HttpResponse->GetContentAsString();
-			LoadContent(Content);
+			LoadContent(HttpResponse->GetContent());
 		}
 	});
 	FBox2D Bounds = GetTileBounds();
@@ -462,5 +781,14 @@ void AOSMActor::LoadTile()
 void AOSMActor::PostLoad()
 {
 	Super::PostLoad();
+	for (TPair<uint64, FOSMNode>& Pair : Nodes_DEPRECATED)
+		Data.AddNode(Pair.Value);
+	for (TPair<uint64, FOSMWay>& Pair : Ways_DEPRECATED)
+		Data.AddWay(Pair.Value);
+	for (TPair<uint64, FOSMRelation>& Pair : Relations_DEPRECATED)
+		Data.AddRelation(Pair.Value);
+	Nodes_DEPRECATED.Empty();
+	Ways_DEPRECATED.Empty();
+	Relations_DEPRECATED.Empty();
 	Build();
 }
\ No newline at end of file
@@ -0,0 +1,655 @@
+// Publisher: Fullike (https://github.com/fullike)
+// Copyright 2024. All Rights Reserved.
+
+#include "OSMReader.h"
+#include "RoadBuilder.h"
+#include "HAL/PlatformFileManager.h"
+#include "Async/ParallelFor.h"
+#include "Misc/Compression.h"
+
+bool FOSMXmlReader::FAttribute::Is(const ANSICHAR* Str) const
+{
+	return FCStringAnsi::Strlen(Str) == NameLen && !FCStringAnsi::Strncmp(Name, Str, NameLen);
+}
+
+bool FOSMXmlReader::ReadFile(const FString& Path)
+{
+	TUniquePtr<IFileHandle> File(FPlatformFileManager::Get().GetPlatformFile().OpenRead(*Path));
+	if (!File)
+	{
+		UE_LOG(LogRoadBuilder, Error, TEXT("Failed to open %s"), *Path);
+		return false;
+	}
+	const int64 ChunkSize = 4 << 20;
+	int64 Remaining = File->Size();
+	TArray<uint8> Buffer;
+	int64 Pending = 0;
+	while (Remaining > 0)
+	{
+		int64 Size = FMath::Min(ChunkSize, Remaining);
+		Buffer.SetNumUninitialized(Pending + Size, false);
+		if (!File->Read(Buffer.GetData() + Pending, Size))
+			return false;
+		Remaining -= Size;
+		int64 Consumed = Parse(Buffer.GetData(), Buffer.Num(), Remaining == 0);
+		//The unfinished tag at the end is carried over to the next chunk
+		Pending = Buffer.Num() - Consumed;
+		FMemory::Memmove(Buffer.GetData(), Buffer.GetData() + Consumed, Pending);
+	}
+	return true;
+}
+
+void FOSMXmlReader::Read(const uint8* Data, int64 Size)
+{
+	Parse(Data, Size, true);
+}
+
+int64 FOSMXmlReader::Parse(const uint8* Data, int64 Size, bool bFinal)
+{
+	const ANSICHAR* Text = (const ANSICHAR*)Data;
+	int64 Pos = 0;
+	while (true)
+	{
+		int64 Start = Pos;
+		while (Start < Size && Text[Start] != '<')
+			Start++;
+		if (Start == Size)
+			return Size;
+		if (Size - Start < 4)
+			return bFinal ? Size : Start;
+		int64 End = INDEX_NONE;
+		auto Find = [&](const ANSICHAR* Terminator, int Len)
+		{
+			for (int64 i = Start + 1; i + Len <= Size; i++)
+				if (!FCStringAnsi::Strncmp(Text + i, Terminator, Len))
+					return i + Len - 1;
+			return int64(INDEX_NONE);
+		};
+		if (!FCStringAnsi::Strncmp(Text + Start, "<!--", 4))
+			End = Find("-->", 3);
+		else if (Text[Start + 1] == '?')
+			End = Find("?>", 2);
+		else
+		{
+			//'>' may appear unescaped inside attribute values
+			ANSICHAR Quote = 0;
+			for (int64 i = Start + 1; i < Size && End == INDEX_NONE; i++)
+			{
+				ANSICHAR C = Text[i];
+				if (Quote)
+					Quote = C == Quote ? 0 : Quote;
+				else if (C == '"' || C == '\'')
+					Quote = C;
+				else if (C == '>')
+					End = i;
+			}
+			if (End != INDEX_NONE && Text[Start + 1] != '!')
+				HandleTag(Text + Start + 1, End - Start - 1);
+		}
+		if (End == INDEX_NONE)
+			return bFinal ? Size : Start;
+		Pos = End + 1;
+	}
+}
+
+void FOSMXmlReader::HandleTag(const ANSICHAR* Tag, int64 Len)
+{
+	if (Tag[0] == '/')
+	{
+		if (Current != EElement::None)
+		{
+			FAnsiStringView Name(Tag + 1, int32(Len - 1));
+			Name.TrimStartAndEndInline();
+			if (Name == "node" || Name == "way" || Name == "relation")
+				FinishElement();
+		}
+		return;
+	}
+	bool bSelfClosing = false;
+	while (Len > 0 && FCharAnsi::IsWhitespace(Tag[Len - 1]))
+		Len--;
+	if (Len > 0 && Tag[Len - 1] == '/')
+	{
+		bSelfClosing = true;
+		Len--;
+	}
+	int64 Pos = 0;
+	while (Pos < Len && !FCharAnsi::IsWhitespace(Tag[Pos]))
+		Pos++;
+	FAnsiStringView Name(Tag, int32(Pos));
+	Attributes.Reset();
+	while (Pos < Len)
+	{
+		while (Pos < Len && FCharAnsi::IsWhitespace(Tag[Pos]))
+			Pos++;
+		int64 NameStart = Pos;
+		while (Pos < Len && Tag[Pos] != '=' && !FCharAnsi::IsWhitespace(Tag[Pos]))
+			Pos++;
+		int64 NameEnd = Pos;
+		while (Pos < Len && Tag[Pos] != '"' && Tag[Pos] != '\'')
+			Pos++;
+		if (Pos >= Len)
+			break;
+		ANSICHAR Quote = Tag[Pos++];
+		int64 ValueStart = Pos;
+		while (Pos < Len && Tag[Pos] != Quote)
+			Pos++;
+		Attributes.Add({ Tag + NameStart, int(NameEnd - NameStart), Tag + ValueStart, int(Pos - ValueStart) });
+		Pos++;
+	}
+	auto Find = [&](const ANSICHAR* Key) -> const FAttribute*
+	{
+		for (const FAttribute& Attribute : Attributes)
+			if (Attribute.Is(Key))
+				return &Attribute;
+		return nullptr;
+	};
+	auto GetId = [&](const ANSICHAR* Key) -> uint64
+	{
+		const FAttribute* Attribute = Find(Key);
+		return Attribute ? ParseId(Attribute->Value) : 0;
+	};
+	if (Name == "node" || Name == "way" || Name == "relation")
+	{
+		if (Current != EElement::None)
+			FinishElement();
+		FOSMElement* Element;
+		if (Name == "node")
+		{
+			Current = EElement::Node;
+			Node = FOSMNode();
+			const FAttribute* Lon = Find("lon");
+			const FAttribute* Lat = Find("lat");
+			Node.Lonlat = FVector2D(Lon ? FCStringAnsi::Atod(Lon->Value) : 0, Lat ? FCStringAnsi::Atod(Lat->Value) : 0);
+			Element = &Node;
+		}
+		else if (Name == "way")
+		{
+			Current = EElement::Way;
+			Way = FOSMWay();
+			Element = &Way;
+		}
+		else
+		{
+			Current = EElement::Relation;
+			Relation = FOSMRelation();
+			Element = &Relation;
+		}
+		Element->Id = GetId("id");
+		if (bSelfClosing)
+			FinishElement();
+	}
+	else if (Name == "tag")
+	{
+		const FAttribute* Key = Find("k");
+		const FAttribute* Value = Find("v");
+		FOSMElement* Element = Current == EElement::Node ? (FOSMElement*)&Node : Current == EElement::Way ? (FOSMElement*)&Way : Current == EElement::Relation ? (FOSMElement*)&Relation : nullptr;
+		if (Element && Key && Value)
+			Element->Tags.Add(FName(*Decode(Key->Value, Key->ValueLen)), Decode(Value->Value, Value->ValueLen));
+	}
+	else if (Name == "nd")
+	{
+		if (Current == EElement::Way)
+			Way.Nodes.Add(GetId("ref"));
+	}
+	else if (Name == "member")
+	{
+		const FAttribute* Type = Find("type");
+		const FAttribute* Role = Find("role");
+		if (Current == EElement::Relation && Type)
+		{
+			FName RoleName = Role ? FName(*Decode(Role->Value, Role->ValueLen)) : NAME_None;
+			FAnsiStringView TypeName(Type->Value, Type->ValueLen);
+			if (TypeName == "node")
+				Relation.Nodes.Add(GetId("ref"), RoleName);
+			else if (TypeName == "way")
+				Relation.Ways.Add(GetId("ref"), RoleName);
+			else if (TypeName == "relation")
+				Relation.Relations.Add(GetId("ref"), RoleName);
+		}
+	}
+}
+
+void FOSMXmlReader::FinishElement()
+{
+	switch (Current)
+	{
+	case EElement::Node:
+		OSM->AddNode(MoveTemp(Node));
+		break;
+	case EElement::Way:
+		OSM->AddWay(MoveTemp(Way));
+		break;
+	case EElement::Relation:
+		OSM->AddRelation(MoveTemp(Relation));
+		break;
+	default:
+		break;
+	}
+	Current = EElement::None;
+}
+
+FString FOSMXmlReader::Decode(const ANSICHAR* Value, int Len)
+{
+	TArray<ANSICHAR> Result;
+	Result.Reserve(Len);
+	for (int i = 0; i < Len; i++)
+	{
+		if (Value[i] != '&')
+		{
+			Result.Add(Value[i]);
+			continue;
+		}
+		int End = i + 1;
+		while (End < Len && Value[End] != ';')
+			End++;
+		FAnsiStringView Entity(Value + i + 1, End - i - 1);
+		uint32 CodePoint = 0;
+		if (Entity == "amp")
+			CodePoint = '&';
+		else if (Entity == "lt")
+			CodePoint = '<';
+		else if (Entity == "gt")
+			CodePoint = '>';
+		else if (Entity == "quot")
+			CodePoint = '"';
+		else if (Entity == "apos")
+			CodePoint = '\'';
+		else if (Entity.StartsWith('#'))
+			CodePoint = Entity.StartsWith("#x") ? FCStringAnsi::Strtoui64(Value + i + 3, nullptr, 16) : FCStringAnsi::Strtoui64(Value + i + 2, nullptr, 10);
+		if (!CodePoint || End == Len)
+		{
+			Result.Add(Value[i]);
+			continue;
+		}
+		//Encoded back to UTF-8 so the whole value is converted once
+		if (CodePoint < 0x80)
+			Result.Add(ANSICHAR(CodePoint));
+		else if (CodePoint < 0x800)
+			Result.Append({ ANSICHAR(0xc0 | CodePoint >> 6), ANSICHAR(0x80 | (CodePoint & 0x3f)) });
+		else if (CodePoint < 0x10000)
+			Result.Append({ ANSICHAR(0xe0 | CodePoint >> 12), ANSICHAR(0x80 | (CodePoint >> 6 & 0x3f)), ANSICHAR(0x80 | (CodePoint & 0x3f)) });
+		else
+			Result.Append({ ANSICHAR(0xf0 | CodePoint >> 18), ANSICHAR(0x80 | (CodePoint >> 12 & 0x3f)), ANSICHAR(0x80 | (CodePoint >> 6 & 0x3f)), ANSICHAR(0x80 | (CodePoint & 0x3f)) });
+		i = End;
+	}
+	FUTF8ToTCHAR Converter(Result.GetData(), Result.Num());
+	return FString(Converter.Length(), Converter.Get());
+}
+
+uint64 FOSMXmlReader::ParseId(const ANSICHAR* Value)
+{
+	//Ids have always been read as hex digits, keep them so for existing DebugIds
+	return FCStringAnsi::Strtoui64(Value, nullptr, 16);
+}
+
+//Protocol buffer wire format, just what the OSM schema needs
+struct FProtoReader
+{
+	FProtoReader(const uint8* InPtr, int64 Size) :Ptr(InPtr), End(InPtr + Size) {}
+	bool Next()
+	{
+		if (Ptr >= End)
+			return false;
+		uint64 Key = Varint();
+		Field = Key >> 3;
+		WireType = Key & 7;
+		return Ptr <= End;
+	}
+	uint64 Varint()
+	{
+		uint64 Value = 0;
+		for (int Shift = 0; Ptr < End && Shift < 64; Shift += 7)
+		{
+			uint8 Byte = *Ptr++;
+			Value |= uint64(Byte & 0x7f) << Shift;
+			if (!(Byte & 0x80))
+				break;
+		}
+		return Value;
+	}
+	int64 SVarint()
+	{
+		uint64 Value = Varint();
+		return int64(Value >> 1) ^ -int64(Value & 1);
+	}
+	FProtoReader Bytes()
+	{
+		uint64 Size = FMath::Min<uint64>(Varint(), End - Ptr);
+		FProtoReader Reader(Ptr, Size);
+		Ptr += Size;
+		return Reader;
+	}
+	void Skip()
+	{
+		switch (WireType)
+		{
+		case 0: Varint(); break;
+		case 1: Ptr += 8; break;
+		case 2: Bytes(); break;
+		case 5: Ptr += 4; break;
+		default: Ptr = End; break;
+		}
+	}
+	//Repeated scalars may come packed or one per field
+	template<typename FuncType>
+	void Packed(FuncType&& Func, bool bSigned)
+	{
+		if (WireType == 2)
+		{
+			FProtoReader Reader = Bytes();
+			while (Reader.Ptr < Reader.End)
+				Func(bSigned ? Reader.SVarint() : int64(Reader.Varint()));
+		}
+		else
+			Func(bSigned ? SVarint() : int64(Varint()));
+	}
+	const uint8* Ptr;
+	const uint8* End;
+	int Field = 0;
+	int WireType = 0;
+};
+
+uint64 FOSMPbfReader::MakeId(int64 Id)
+{
+	uint64 Value = 0, Digit = 1;
+	for (uint64 Abs = Id < 0 ? uint64(-Id) : uint64(Id); Abs; Abs /= 10, Digit <<= 4)
+		Value += Abs % 10 * Digit;
+	return Id < 0 ? uint64(-int64(Value)) : Value;
+}
+
+bool FOSMPbfReader::ReadFile(const FString& Path)
+{
+	TUniquePtr<IFileHandle> File(FPlatformFileManager::Get().GetPlatformFile().OpenRead(*Path));
+	if (!File)
+	{
+		UE_LOG(LogRoadBuilder, Error, TEXT("Failed to open %s"), *Path);
+		return false;
+	}
+	const int BatchSize = FMath::Max(FPlatformMisc::NumberOfCoresIncludingHyperthreads() * 2, 1);
+	TArray<FBlock> Blocks;
+	TArray<uint8> Header;
+	while (File->Tell() < File->Size())
+	{
+		uint8 Length[4];
+		if (!File->Read(Length, 4))
+			return false;
+		Header.SetNumUninitialized(Length[0] << 24 | Length[1] << 16 | Length[2] << 8 | Length[3], false);
+		if (!File->Read(Header.GetData(), Header.Num()))
+			return false;
+		FAnsiStringView Type;
+		int64 DataSize = 0;
+		FProtoReader Reader(Header.GetData(), Header.Num());
+		while (Reader.Next())
+		{
+			if (Reader.Field == 1 && Reader.WireType == 2)
+			{
+				FProtoReader Bytes = Reader.Bytes();
+				Type = FAnsiStringView((const ANSICHAR*)Bytes.Ptr, int32(Bytes.End - Bytes.Ptr));
+			}
+			else if (Reader.Field == 3 && Reader.WireType == 0)
+				DataSize = Reader.Varint();
+			else
+				Reader.Skip();
+		}
+		//Header blocks only carry bounds and feature flags, the data of supported features is all in the data blocks
+		if (Type != "OSMData")
+		{
+			File->Seek(File->Tell() + DataSize);
+			continue;
+		}
+		FBlock& Block = Blocks.AddDefaulted_GetRef();
+		Block.Blob.SetNumUninitialized(int32(DataSize));
+		if (!File->Read(Block.Blob.GetData(), DataSize))
+			return false;
+		if (Blocks.Num() == BatchSize)
+			DecodeBatch(Blocks);
+	}
+	DecodeBatch(Blocks);
+	return true;
+}
+
+void FOSMPbfReader::DecodeBatch(TArray<FBlock>& Blocks)
+{
+	ParallelFor(Blocks.Num(), [&](int Index)
+	{
+		FBlock& Block = Blocks[Index];
+		Block.bValid = DecodeBlock(Block);
+		Block.Blob.Empty();
+	});
+	for (FBlock& Block : Blocks)
+	{
+		if (!Block.bValid)
+		{
+			UE_LOG(LogRoadBuilder, Warning, TEXT("Skipped an OSM data block which could not be decoded"));
+			continue;
+		}
+		for (FOSMNode& Node : Block.Nodes)
+			OSM->AddNode(MoveTemp(Node));
+		for (FOSMWay& Way : Block.Ways)
+			OSM->AddWay(MoveTemp(Way));
+		for (FOSMRelation& Relation : Block.Relations)
+			OSM->AddRelation(MoveTemp(Relation));
+	}
+	Blocks.Reset();
+}
+
+bool FOSMPbfReader::DecodeBlock(FBlock& Block)
+{
+	TArray<uint8> Data;
+	int64 RawSize = 0;
+	FProtoReader BlobReader(Block.Blob.GetData(), Block.Blob.Num());
+	while (BlobReader.Next())
+	{
+		if (BlobReader.Field == 1 && BlobReader.WireType == 2)
+		{
+			FProtoReader Raw = BlobReader.Bytes();
+			Data.Append(Raw.Ptr, int32(Raw.End - Raw.Ptr));
+		}
+		else if (BlobReader.Field == 2 && BlobReader.WireType == 0)
+			RawSize = BlobReader.Varint();
+		else if (BlobReader.Field == 3 && BlobReader.WireType == 2)
+		{
+			FProtoReader Compressed = BlobReader.Bytes();
+			Data.SetNumUninitialized(int32(RawSize));
+			if (!FCompression::UncompressMemory(NAME_Zlib, Data.GetData(), int32(RawSize), Compressed.Ptr, int32(Compressed.End - Compressed.Ptr)))
+				return false;
+		}
+		else if (BlobReader.WireType == 2 && BlobReader.Field > 3)
+			return false;
+		else
+			BlobReader.Skip();
+	}
+	//String table and coordinate transform have to be known before the groups are decoded
+	TArray<FString> Strings;
+	TArray<FName> Names;
+	TArray<FProtoReader> Groups;
+	int64 Granularity = 100, LatOffset = 0, LonOffset = 0;
+	FProtoReader BlockReader(Data.GetData(), Data.Num());
+	while (BlockReader.Next())
+	{
+		if (BlockReader.Field == 1 && BlockReader.WireType == 2)
+		{
+			FProtoReader Table = BlockReader.Bytes();
+			while (Table.Next())
+			{
+				if (Table.Field == 1 && Table.WireType == 2)
+				{
+					FProtoReader String = Table.Bytes();
+					FUTF8ToTCHAR Converter((const ANSICHAR*)String.Ptr, int32(String.End - String.Ptr));
+					Strings.Emplace(Converter.Length(), Converter.Get());
+				}
+				else
+					Table.Skip();
+			}
+		}
+		else if (BlockReader.Field == 2 && BlockReader.WireType == 2)
+			Groups.Add(BlockReader.Bytes());
+		else if (BlockReader.Field == 17)
+			Granularity = BlockReader.Varint();
+		else if (BlockReader.Field == 19)
+			LatOffset = BlockReader.Varint();
+		else if (BlockReader.Field == 20)
+			LonOffset = BlockReader.Varint();
+		else
+			BlockReader.Skip();
+	}
+	Names.Init(NAME_None, Strings.Num());
+	auto GetString = [&](int64 Index) -> const FString&
+	{
+		static const FString Empty;
+		return Index >= 0 && Index < Strings.Num() ? Strings[Index] : Empty;
+	};
+	auto GetName = [&](int64 Index) -> FName
+	{
+		if (Index < 0 || Index >= Names.Num())
+			return NAME_None;
+		if (Names[Index].IsNone())
+			Names[Index] = FName(*Strings[Index]);
+		return Names[Index];
+	};
+	auto ToLonlat = [&](int64 Lon, int64 Lat)
+	{
+		return FVector2D((LonOffset + Granularity * Lon) * 1e-9, (LatOffset + Granularity * Lat) * 1e-9);
+	};
+	//Keys and values of plain nodes, ways and relations are parallel arrays of string indices
+	auto ReadTags = [&](FProtoReader& Reader, TArray<int64>& Keys, TArray<int64>& Values)
+	{
+		if (Reader.Field == 2)
+			Reader.Packed([&](int64 Value) { Keys.Add(Value); }, false);
+		else if (Reader.Field == 3)
+			Reader.Packed([&](int64 Value) { Values.Add(Value); }, false);
+		else
+			return false;
+		return true;
+	};
+	auto AddTags = [&](FOSMElement& Element, const TArray<int64>& Keys, const TArray<int64>& Values)
+	{
+		for (int i = 0; i < FMath::Min(Keys.Num(), Values.Num()); i++)
+			Element.Tags.Add(GetName(Keys[i]), GetString(Values[i]));
+	};
+	TArray<int64> Keys, Values, Ids, Lats, Lons, KeyValues, Roles, Types;
+	for (FProtoReader& Group : Groups)
+	{
+		while (Group.Next())
+		{
+			FProtoReader Reader = Group.WireType == 2 ? Group.Bytes() : FProtoReader(nullptr, 0);
+			if (Group.WireType != 2)
+				Group.Skip();
+			Keys.Reset();
+			Values.Reset();
+			if (Group.Field == 1)
+			{
+				FOSMNode& Node = Block.Nodes.AddDefaulted_GetRef();
+				int64 Lat = 0, Lon = 0;
+				while (Reader.Next())
+				{
+					if (Reader.Field == 1)
+						Node.Id = MakeId(Reader.SVarint());
+					else if (Reader.Field == 8)
+						Lat = Reader.SVarint();
+					else if (Reader.Field == 9)
+						Lon = Reader.SVarint();
+					else if (!ReadTags(Reader, Keys, Values))
+						Reader.Skip();
+				}
+				Node.Lonlat = ToLonlat(Lon, Lat);
+				AddTags(Node, Keys, Values);
+			}
+			else if (Group.Field == 2)
+			{
+				//Dense nodes are delta coded columns, tags are key value pairs with a 0 after each node
+				Ids.Reset();
+				Lats.Reset();
+				Lons.Reset();
+				KeyValues.Reset();
+				while (Reader.Next())
+				{
+					if (Reader.Field == 1)
+						Reader.Packed([&](int64 Value) { Ids.Add(Value); }, true);
+					else if (Reader.Field == 8)
+						Reader.Packed([&](int64 Value) { Lats.Add(Value); }, true);
+					else if (Reader.Field == 9)
+						Reader.Packed([&](int64 Value) { Lons.Add(Value); }, true);
+					else if (Reader.Field == 10)
+						Reader.Packed([&](int64 Value) { KeyValues.Add(Value); }, false);
+					else
+						Reader.Skip();
+				}
+				if (Lats.Num() != Ids.Num() || Lons.Num() != Ids.Num())
+					return false;
+				int64 Id = 0, Lat = 0, Lon = 0;
+				int Tag = 0;
+				Block.Nodes.Reserve(Block.Nodes.Num() + Ids.Num());
+				for (int i = 0; i < Ids.Num(); i++)
+				{
+					FOSMNode& Node = Block.Nodes.AddDefaulted_GetRef();
+					Id += Ids[i];
+					Lat += Lats[i];
+					Lon += Lons[i];
+					Node.Id = MakeId(Id);
+					Node.Lonlat = ToLonlat(Lon, Lat);
+					while (Tag < KeyValues.Num() && KeyValues[Tag])
+					{
+						if (Tag + 1 < KeyValues.Num())
+							Node.Tags.Add(GetName(KeyValues[Tag]), GetString(KeyValues[Tag + 1]));
+						Tag += 2;
+					}
+					Tag++;
+				}
+			}
+			else if (Group.Field == 3)
+			{
+				FOSMWay& Way = Block.Ways.AddDefaulted_GetRef();
+				while (Reader.Next())
+				{
+					if (Reader.Field == 1)
+						Way.Id = MakeId(Reader.Varint());
+					else if (Reader.Field == 8)
+					{
+						int64 Ref = 0;
+						Reader.Packed([&](int64 Value) { Ref += Value; Way.Nodes.Add(MakeId(Ref)); }, true);
+					}
+					else if (!ReadTags(Reader, Keys, Values))
+						Reader.Skip();
+				}
+				AddTags(Way, Keys, Values);
+			}
+			else if (Group.Field == 4)
+			{
+				FOSMRelation& Relation = Block.Relations.AddDefaulted_GetRef();
+				Ids.Reset();
+				Roles.Reset();
+				Types.Reset();
+				while (Reader.Next())
+				{
+					if (Reader.Field == 1)
+						Relation.Id = MakeId(Reader.Varint());
+					else if (Reader.Field == 8)
+						Reader.Packed([&](int64 Value) { Roles.Add(Value); }, false);
+					else if (Reader.Field == 9)
+						Reader.Packed([&](int64 Value) { Ids.Add(Value); }, true);
+					else if (Reader.Field == 10)
+						Reader.Packed([&](int64 Value) { Types.Add(Value); }, false);
+					else if (!ReadTags(Reader, Keys, Values))
+						Reader.Skip();
+				}
+				AddTags(Relation, Keys, Values);
+				int64 Member = 0;
+				for (int i = 0; i < Ids.Num(); i++)
+				{
+					Member += Ids[i];
+					FName Role = i < Roles.Num() ? GetName(Roles[i]) : NAME_None;
+					int64 Type = i < Types.Num() ? Types[i] : 0;
+					if (Type == 0)
+						Relation.Nodes.Add(MakeId(Member), Role);
+					else if (Type == 1)
+						Relation.Ways.Add(MakeId(Member), Role);
+					else if (Type == 2)
+						Relation.Relations.Add(MakeId(Member), Role);
+				}
+			}
+		}
+	}
+	return true;
+}
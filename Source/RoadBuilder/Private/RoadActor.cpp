@@ -5,6 +5,8 @@
 #include "RoadScene.h"
 #include "Components/InstancedStaticMeshComponent.h"
 #include "Components/DecalComponent.h"
+#include "Serialization/MemoryWriter.h"
+#include "Serialization/ObjectAndNameAsStringProxyArchive.h"
 
 URoadStyle* URoadStyle::Create(URoadBoundary* SrcBoundary, int SrcSide, URoadBoundary* DstBoundary, int DstSide, bool SkipSidewalks, bool KeepLeftLanes, uint32 LeftLaneMarkingMask, uint32 RightLaneMarkingMask)
 {
@@ -192,11 +194,7 @@ double FConnectInfo::ConnectionSign(ARoadActor* Parent)
 
 ARoadActor::ARoadActor(const FObjectInitializer& ObjectInitializer) : Super(ObjectInitializer)
 {
-#if USE_PROC_ROAD_MESH
-	RootComponent = CreateDefaultSubobject<UProceduralMeshComponent>(TEXT("RootComponent"));
-#else
 	RootComponent = CreateDefaultSubobject<URoadMeshComponent>(TEXT("RootComponent"));
-#endif
 }
 
 URoadBoundary* ARoadActor::AddBoundary(double Offset, ULaneMarkStyle* LaneMarking, URoadProps* Props)
@@ -380,6 +378,14 @@ FVector2D ARoadActor::GetUV(const FVector& Pos)
 	return GetUV((const FVector2D&)Pos);
 }
 
+FVector2D ARoadActor::GetUVNear(const FVector2D& Pos, int& Hint)
+{
+	FVector2D UV = BaseCurve->Curve.GetUVNear(Pos, Hint);
+	if (UV.Y != MAX_dbl)
+		UV.Y += BaseCurve->GetOffset(UV.X);
+	return UV;
+}
+
 TArray<URoadLane*> ARoadActor::GetLanes(URoadBoundary* Boundary, int Side, const TArray<ELaneType>& Types)
 {
 	TArray<URoadLane*> OutLanes;
@@ -1423,20 +1429,99 @@ void ARoadActor::UpdateLanes()
 		Scene->OctreeAddRoad(this);
 }
 
-void ARoadActor::BuildMesh(const TArray<FJunctionSlot>& Slots)
+uint32 ARoadActor::CalcMeshHash(const TArray<FJunctionSlot>& Slots)
 {
-	TSet<UActorComponent*> Components = GetComponents();
-	for (UActorComponent* Component : Components)
+	TArray<uint8> Bytes;
+	FMemoryWriter Writer(Bytes);
+	FObjectAndNameAsStringProxyArchive Ar(Writer, false);
+	TSet<UObject*> Styles;
+	auto SerializeObject = [&](UObject* Object)
+	{
+		Ar << Object;
+		if (Object)
+			Object->GetClass()->SerializeBin(Ar, Object);
+	};
+	auto SerializeStyle = [&](UObject* Style)
+	{
+		bool bAlreadyInSet = false;
+		Styles.Add(Style, &bAlreadyInSet);
+		if (bAlreadyInSet)
+			Ar << Style;
+		else
+			SerializeObject(Style);
+	};
+	Ar << Smoothness;
+	for (FRoadSegment& Segment : RoadSegments)
+		FRoadSegment::StaticStruct()->SerializeBin(Ar, &Segment);
+	for (FHeightSegment& Segment : HeightSegments)
+		FHeightSegment::StaticStruct()->SerializeBin(Ar, &Segment);
+	for (URoadLane* Lane : Lanes)
+	{
+		SerializeObject(Lane);
+		for (FLaneSegment& Segment : Lane->Segments)
+			SerializeStyle(Segment.LaneShape);
+	}
+	for (URoadBoundary* Boundary : Boundaries)
+	{
+		SerializeObject(Boundary);
+		for (FBoundarySegment& Segment : Boundary->Segments)
+		{
+			SerializeStyle(Segment.LaneMarking);
+			SerializeStyle(Segment.Props);
+		}
+	}
+	for (URoadMarking* Marking : Markings)
 	{
-		if (Component->IsA<UInstancedStaticMeshComponent>() || Component->IsA<UDecalComponent>())
-			Component->DestroyComponent();
+		SerializeObject(Marking);
+		if (UMarkingCurve* Curve = Cast<UMarkingCurve>(Marking))
+		{
+			SerializeStyle(Curve->MarkStyle);
+			SerializeStyle(Curve->FillStyle);
+		}
 	}
-	ForEachAttachedActors([&](AActor* Actor)->bool
+	for (const FJunctionSlot& Slot : Slots)
 	{
-		Actor->Destroy();
-		return true;
-	});
-	FRoadActorBuilder Builder;
+		double InputDist = Slot.InputDist();
+		double OutputDist = Slot.OutputDist();
+		Ar << InputDist << OutputDist;
+	}
+	//Markings of link roads are projected onto junction mesh
+	if (AJunctionActor* Junction = GetJunction())
+		Ar << Junction->SurfaceHash;
+	ERoadMeshBackend Backend = GetScene()->MeshBackend;
+	bool bMergePropInstances = GetScene()->bMergePropInstances;
+	Ar << Backend << bMergePropInstances;
+	if (bMergePropInstances)
+		Ar << GetScene()->PropCellSize;
+	USettings_Global* Settings = GetMutableDefault<USettings_Global>();
+	bool BuildProps = Settings->BuildProps;
+	Ar << Settings->UVScale << BuildProps << Settings->CollisionMode;
+	if (Settings->CollisionMode == ERoadCollisionMode::Simplified)
+		Ar << Settings->CollisionTolerance << Settings->CollisionSegmentLength << Settings->CollisionThickness;
+	Ar << Settings->MarkingMode;
+	if (Settings->MarkingMode == ERoadMarkingMode::MaskTexture)
+		Ar << Settings->MarkingMaskTexelSize << Settings->MarkingMaskMaxSize;
+	return FCrc::MemCrc32(Bytes.GetData(), Bytes.Num());
+}
+
+void ARoadActor::BuildMesh(const TArray<FJunctionSlot>& Slots)
+{
+	uint32 Hash = CalcMeshHash(Slots);
+	if (Hash == MeshHash)
+		return;
+	MeshHash = Hash;
+	FRoadActorBuilder Builder(GetScene()->MeshBackend);
+	//Link road markings are projected onto junction surface, keep them as geometry
+	TSet<UMaterialInterface*> SurfaceMaterials;
+	if (GetMutableDefault<USettings_Global>()->MarkingMode == ERoadMarkingMode::MaskTexture && !IsLink())
+	{
+		Builder.MaskBuilder = MakeUnique<FRoadMarkingMask>(this);
+		Builder.MeshBuilder->SetMaskRoad(this);
+		for (URoadLane* Lane : Lanes)
+			for (FLaneSegment& Segment : Lane->Segments)
+				if (ULaneShape* LaneShape = Segment.GetLaneShape())
+					SurfaceMaterials.Add(LaneShape->GetSurfaceMaterial());
+	}
 	if (RoadSegments.Num())
 	{
 		TArray<URoadLane*> LeftLanes = GetLanes(1);
@@ -1448,10 +1533,23 @@ void ARoadActor::BuildMesh(const TArray<FJunctionSlot>& Slots)
 			//FPolyline::AddPoint use 1e-8 so use 1e-4 here to avoid 1 point polyline
 			if (FMath::IsNearlyEqual(R_Start, R_End, DOUBLE_KINDA_SMALL_NUMBER))
 				continue;
-			for (int j = LeftLanes.Num() - 1; j >= 0; j--)
-				LeftLanes[j]->BuildMesh(Builder, j + 1, R_Start, R_End, Length());
-			for (int j = 0; j < RightLanes.Num(); j++)
-				RightLanes[j]->BuildMesh(Builder, -j - 1, R_Start, R_End, Length());
+			//Each mask chunk samples its own texture, so surfaces are split at chunk borders
+			int FirstChunk = Builder.MaskBuilder ? Builder.MaskBuilder->GetChunk(R_Start) : 0;
+			int LastChunk = Builder.MaskBuilder ? Builder.MaskBuilder->GetChunk(R_End) : 0;
+			for (int Chunk = FirstChunk; Chunk <= LastChunk; Chunk++)
+			{
+				double C_Start = Builder.MaskBuilder ? FMath::Max(R_Start, Chunk * Builder.MaskBuilder->ChunkLength) : R_Start;
+				double C_End = Builder.MaskBuilder ? FMath::Min(R_End, (Chunk + 1) * Builder.MaskBuilder->ChunkLength) : R_End;
+				if (FMath::IsNearlyEqual(C_Start, C_End, DOUBLE_KINDA_SMALL_NUMBER))
+					continue;
+				for (UMaterialInterface* Material : SurfaceMaterials)
+					Builder.MeshBuilder->MaterialOverrides.Add(Material, Builder.MaskBuilder->GetChunkMaterial(Material, Chunk));
+				for (int j = LeftLanes.Num() - 1; j >= 0; j--)
+					LeftLanes[j]->BuildMesh(Builder, j + 1, C_Start, C_End, Length());
+				for (int j = 0; j < RightLanes.Num(); j++)
+					RightLanes[j]->BuildMesh(Builder, -j - 1, C_Start, C_End, Length());
+			}
+			Builder.MeshBuilder->MaterialOverrides.Empty();
 			for (URoadBoundary* Boundary : Boundaries)
 			{
 				for (int j = 0; j < Boundary->Segments.Num(); j++)
@@ -1463,12 +1561,17 @@ void ARoadActor::BuildMesh(const TArray<FJunctionSlot>& Slots)
 				}
 			}
 		}
+		URoadProps::Generate(Builder);
 	}
 	for (URoadMarking* Marking : Markings)
 		Marking->BuildMesh(Builder);
-	Builder.MeshBuilder.Build(GetRootComponent());
+	Builder.MeshBuilder->Build(GetRootComponent());
+	if (Builder.MaskBuilder)
+		Builder.MaskBuilder->Build(GetRootComponent());
+	GetScene()->SetPropInstances(this, Builder.InstanceBuilder);
 	Builder.InstanceBuilder.AttachToActor(this);
 	Builder.DecalBuilder.AttachToActor(this);
+	Builder.ActorBuilder.AttachToActor(this);
 }
 
 bool ARoadActor::IsLink()
@@ -1732,6 +1835,7 @@ void ARoadActor::PreEditUndo()
 void ARoadActor::PostEditUndo()
 {
 	AActor::PostEditUndo();
+	MeshHash = 0;
 	if (IsValid(this))
 	{
 		if (IsLink())
@@ -1782,6 +1886,8 @@ void ARoadActor::CreateStyle()
 void URoadMeshComponent::PostEditUndo()
 {
 	SetStaticMesh(nullptr);
+	if (ARoadActor* Road = Cast<ARoadActor>(GetOwner()))
+		Road->MeshHash = 0;
 	UStaticMeshComponent::PostEditUndo();
 }
 #endif
\ No newline at end of file
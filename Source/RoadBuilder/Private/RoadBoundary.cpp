@@ -20,6 +20,22 @@ void FBoundarySegment::ExportXodr(FXmlNode* XmlNode, double S)
 	}
 }
 
+void URoadBoundary::PostInitProperties()
+{
+	Super::PostInitProperties();
+	//Loaded and duplicated boundaries get their seed from the source afterwards
+	if (!HasAnyFlags(RF_ClassDefaultObject | RF_NeedLoad))
+		PropSeed = GetTypeHash(FGuid::NewGuid());
+}
+
+void URoadBoundary::PostLoad()
+{
+	Super::PostLoad();
+	//Saved before seeds existed, the path is stable until the seed is saved
+	if (!PropSeed)
+		PropSeed = FCrc::StrCrc32(*GetPathName());
+}
+
 int URoadBoundary::AddSegment(double Dist)
 {
 	int Index = GetSegment(Dist);
@@ -62,14 +78,17 @@ void URoadBoundary::BuildMesh(FRoadActorBuilder& Builder, double Start, double E
 {
 	SCOPE_CYCLE_COUNTER(STAT_BuildBoundary);
 	ARoadActor* Road = GetRoad();
-	FPolyline Polyline = (!Road->IsLink() && GetSide() ? CreatePolyline(End, Start) : CreatePolyline(Start, End)).Redist();
+	bool bReversed = !Road->IsLink() && GetSide();
+	FPolyline Polyline = (bReversed ? CreatePolyline(End, Start) : CreatePolyline(Start, End)).Redist();
 	if (Segments[Index].LaneMarking)
 	{
-		Segments[Index].LaneMarking->BuildMesh(Road, Builder.MeshBuilder, Polyline);
+		Segments[Index].LaneMarking->BuildBoundary(Road, Builder, Polyline, Builder.DashPhases.FindOrAdd(this), bReversed);
 	}
 	if (Segments[Index].Props)
 	{
-		Segments[Index].Props->Generate(Road, Polyline, Builder);
+		//Seeded by saved data and where the piece starts, not by names or indices that edits reshuffle
+		uint32 Seed = HashCombine(PropSeed, GetTypeHash(FMath::RoundToInt(Start)));
+		Builder.PropJobs.Add({ Segments[Index].Props, MoveTemp(Polyline), Seed });
 	}
 }
 
@@ -110,7 +110,9 @@ void URoadLane::BuildMesh(FRoadActorBuilder& Builder, int LaneId, double Start,
 		URoadLane* RightLane = Side ? LeftBoundary->LeftLane : RightBoundary->RightLane;
 		bool SkipLeft = LeftLane && (Segments[Index].LaneShape == LeftLane->Segments[LeftLane->GetSegment(C)].LaneShape);
 		bool SkipRight = RightLane && (Segments[Index].LaneShape == RightLane->Segments[RightLane->GetSegment(C)].LaneShape);
-		LaneShape->BuildMesh(Builder.MeshBuilder, LeftCurve, RightCurve, SkipLeft, SkipRight);
+		LaneShape->BuildMesh(*Builder.MeshBuilder, LeftCurve, RightCurve, SkipLeft, SkipRight);
+		if (GetMutableDefault<USettings_Global>()->CollisionMode == ERoadCollisionMode::Simplified)
+			LaneShape->BuildCollision(*Builder.MeshBuilder, LeftCurve, RightCurve);
 	}
 }
 
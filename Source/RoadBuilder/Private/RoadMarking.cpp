@@ -27,9 +27,9 @@ void UMarkingCurve::BuildMesh(FRoadActorBuilder& Builder)
 	ARoadActor* Road = GetRoad();
 	FPolyline Curve = CreatePolyline();
 	if (MarkStyle)
-		MarkStyle->BuildMesh(Road, Builder.MeshBuilder, Curve);
+		MarkStyle->Build(Road, Builder, Curve);
 	if (FillStyle && bClosedLoop)
-		FillStyle->BuildMesh(this, Builder.MeshBuilder, Curve);
+		FillStyle->BuildMesh(this, Builder.GetMarkingBuilder(), Curve);
 }
 
 void UMarkingCurve::InsertPoint(const FVector2D& Pos, int& Index)
@@ -2,17 +2,301 @@
 // Copyright 2024. All Rights Reserved.
 
 #include "RoadMesh.h"
+#include "RoadActor.h"
+#include "RoadBuilder.h"
 #include "Settings.h"
 #include "Components/DecalComponent.h"
 #include "Components/HierarchicalInstancedStaticMeshComponent.h"
 #include "Engine/StaticMesh.h"
+#include "Engine/Texture2D.h"
+#include "Materials/MaterialInstanceDynamic.h"
 #include "PhysicsEngine/BodySetup.h"
+#include "Async/ParallelFor.h"
 #ifndef M_PI
 	#define M_PI    3.14159265358979323846
 #endif
 #pragma warning(disable:4456)
 #include "../../ThirdParty/CDT/include/CDT.h"
 
+void FRoadMesh::SimplifyPoints(TFunctionRef<FVector(int)> GetPos, int Start, int End, double Tolerance, TArray<int>& OutIndices)
+{
+	FVector StartPos = GetPos(Start);
+	FVector EndPos = GetPos(End);
+	double MaxDist = 0;
+	int MaxIndex = INDEX_NONE;
+	for (int i = Start + 1; i < End; i++)
+	{
+		double Dist = FMath::PointDistToSegment(GetPos(i), StartPos, EndPos);
+		if (Dist > MaxDist)
+		{
+			MaxDist = Dist;
+			MaxIndex = i;
+		}
+	}
+	if (MaxDist > Tolerance)
+	{
+		OutIndices.Add(MaxIndex);
+		SimplifyPoints(GetPos, Start, MaxIndex, Tolerance, OutIndices);
+		SimplifyPoints(GetPos, MaxIndex, End, Tolerance, OutIndices);
+	}
+}
+
+static void SimplifyPolyline(const FPolyline& Curve, double Tolerance, TArray<double>& OutDists)
+{
+	TArray<int> Indices;
+	FRoadMesh::SimplifyPoints([&](int Index) { return Curve.Points[Index].Pos; }, 0, Curve.Points.Num() - 1, Tolerance, Indices);
+	for (int Index : Indices)
+		OutDists.Add(Curve.Points[Index].Dist);
+}
+
+//Coarse convex slabs following both curves, one slab per simplified station interval
+static void BuildCollisionHulls(const FPolyline& LeftCurve, const FPolyline& RightCurve, TArray<TArray<FVector>>& OutHulls)
+{
+	if (LeftCurve.Points.Num() < 2 || RightCurve.Points.Num() < 2)
+		return;
+	USettings_Global* Settings = GetMutableDefault<USettings_Global>();
+	double Start = LeftCurve.Points[0].Dist;
+	double End = LeftCurve.Points.Last().Dist;
+	double Sign = End > Start ? 1 : -1;
+	TArray<double> Dists = { Start, End };
+	SimplifyPolyline(LeftCurve, Settings->CollisionTolerance, Dists);
+	SimplifyPolyline(RightCurve, Settings->CollisionTolerance, Dists);
+	Dists.Sort([Sign](double A, double B) { return A * Sign < B * Sign; });
+	TArray<double> Stations = { Start };
+	for (int i = 1; i < Dists.Num(); i++)
+	{
+		double Prev = Stations.Last();
+		double Gap = (Dists[i] - Prev) * Sign;
+		if (Gap < Settings->CollisionTolerance)
+		{
+			//The end is merged into the last station so no slab is shorter than the tolerance
+			if (i == Dists.Num() - 1)
+			{
+				if (Stations.Num() > 1)
+					Stations.Last() = Dists[i];
+				else if (Gap > UE_KINDA_SMALL_NUMBER)
+					Stations.Add(Dists[i]);
+			}
+			continue;
+		}
+		int NumSegs = FMath::Max(1, FMath::CeilToInt(Gap / Settings->CollisionSegmentLength));
+		for (int j = 1; j <= NumSegs; j++)
+			Stations.Add(FMath::Lerp(Prev, Dists[i], double(j) / NumSegs));
+	}
+	auto Sample = [Sign](const FPolyline& Curve, int& Cursor, double Dist)
+	{
+		while (Cursor + 2 < Curve.Points.Num() && (Curve.Points[Cursor + 1].Dist - Dist) * Sign < 0)
+			Cursor++;
+		const FPolyPoint& P0 = Curve.Points[Cursor];
+		const FPolyPoint& P1 = Curve.Points[Cursor + 1];
+		double Alpha = FMath::IsNearlyEqual(P0.Dist, P1.Dist) ? 0 : FMath::Clamp((Dist - P0.Dist) / (P1.Dist - P0.Dist), 0.0, 1.0);
+		return FMath::Lerp(P0.Pos, P1.Pos, Alpha);
+	};
+	FVector Down(0, 0, -Settings->CollisionThickness);
+	int LeftCursor = 0, RightCursor = 0;
+	FVector PrevLeft = Sample(LeftCurve, LeftCursor, Stations[0]);
+	FVector PrevRight = Sample(RightCurve, RightCursor, Stations[0]);
+	for (int i = 1; i < Stations.Num(); i++)
+	{
+		//Zero length slabs are degenerate hulls that cooking rejects
+		if ((Stations[i] - Stations[i - 1]) * Sign < UE_KINDA_SMALL_NUMBER)
+			continue;
+		FVector Left = Sample(LeftCurve, LeftCursor, Stations[i]);
+		FVector Right = Sample(RightCurve, RightCursor, Stations[i]);
+		OutHulls.Add({ PrevLeft, Left, PrevRight, Right, PrevLeft + Down, Left + Down, PrevRight + Down, Right + Down });
+		PrevLeft = Left;
+		PrevRight = Right;
+	}
+}
+
+//Solves Z of free vertices as a discrete harmonic function (uniform weights) with fixed vertices as boundary condition,
+//using a CSR adjacency and Jacobi preconditioned conjugate gradient
+static void SolveHarmonicHeights(TArray<FVector>& Verts, const TArray<FIndex3i>& Triangles, TArray<bool>& FixedVertices)
+{
+	SCOPE_CYCLE_COUNTER(STAT_SolveHeights);
+	TArray<uint64> Edges;
+	Edges.Reserve(Triangles.Num() * 3);
+	for (const FIndex3i& Triangle : Triangles)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			uint64 A = Triangle[j], B = Triangle[(j + 1) % 3];
+			Edges.Add(A < B ? (A << 32 | B) : (B << 32 | A));
+		}
+	}
+	Edges.Sort();
+	int NumEdges = 0;
+	for (int i = 0; i < Edges.Num(); i++)
+		if (!i || Edges[i] != Edges[NumEdges - 1])
+			Edges[NumEdges++] = Edges[i];
+	Edges.SetNum(NumEdges, false);
+	TArray<int> Offsets, Neighbors;
+	Offsets.Init(0, Verts.Num() + 1);
+	for (uint64 Edge : Edges)
+	{
+		Offsets[(Edge >> 32) + 1]++;
+		Offsets[(Edge & 0xffffffff) + 1]++;
+	}
+	for (int i = 0; i < Verts.Num(); i++)
+		Offsets[i + 1] += Offsets[i];
+	Neighbors.SetNumUninitialized(Offsets.Last());
+	TArray<int> Cursors(Offsets.GetData(), Verts.Num());
+	for (uint64 Edge : Edges)
+	{
+		int A = Edge >> 32, B = Edge & 0xffffffff;
+		Neighbors[Cursors[A]++] = B;
+		Neighbors[Cursors[B]++] = A;
+	}
+	//Isolated vertices (e.g. steiner points outside the polygon) keep their height
+	TArray<int> Unknowns;
+	TArray<int> UnknownIndices;
+	UnknownIndices.Init(INDEX_NONE, Verts.Num());
+	double FixedHeight = 0;
+	int NumFixed = 0;
+	for (int i = 0; i < Verts.Num(); i++)
+	{
+		if (FixedVertices[i])
+		{
+			FixedHeight += Verts[i].Z;
+			NumFixed++;
+		}
+		else if (Offsets[i + 1] > Offsets[i])
+			UnknownIndices[i] = Unknowns.Add(i);
+	}
+	if (!Unknowns.Num() || !NumFixed)
+		return;
+	FixedHeight /= NumFixed;
+	int N = Unknowns.Num();
+	TArray<double> X, B, R, Z, P, AP;
+	X.Init(FixedHeight, N);
+	B.Init(0, N);
+	for (int i = 0; i < N; i++)
+	{
+		int Vertex = Unknowns[i];
+		for (int j = Offsets[Vertex]; j < Offsets[Vertex + 1]; j++)
+			if (UnknownIndices[Neighbors[j]] == INDEX_NONE)
+				B[i] += Verts[Neighbors[j]].Z;
+	}
+	auto Multiply = [&](const TArray<double>& In, TArray<double>& Out)
+	{
+		for (int i = 0; i < N; i++)
+		{
+			int Vertex = Unknowns[i];
+			double Sum = (Offsets[Vertex + 1] - Offsets[Vertex]) * In[i];
+			for (int j = Offsets[Vertex]; j < Offsets[Vertex + 1]; j++)
+			{
+				int Index = UnknownIndices[Neighbors[j]];
+				if (Index != INDEX_NONE)
+					Sum -= In[Index];
+			}
+			Out[i] = Sum;
+		}
+	};
+	R.SetNumUninitialized(N);
+	Z.SetNumUninitialized(N);
+	AP.SetNumUninitialized(N);
+	Multiply(X, AP);
+	double BNorm = 0, RZ = 0;
+	for (int i = 0; i < N; i++)
+	{
+		int Vertex = Unknowns[i];
+		R[i] = B[i] - AP[i];
+		Z[i] = R[i] / (Offsets[Vertex + 1] - Offsets[Vertex]);
+		RZ += R[i] * Z[i];
+		BNorm += B[i] * B[i];
+	}
+	P = Z;
+	double Tolerance = FMath::Max(BNorm, 1.0) * 1e-16;
+	for (int Iteration = 0; Iteration < N; Iteration++)
+	{
+		double RNorm = 0;
+		for (int i = 0; i < N; i++)
+			RNorm += R[i] * R[i];
+		if (RNorm < Tolerance)
+			break;
+		Multiply(P, AP);
+		double PAP = 0;
+		for (int i = 0; i < N; i++)
+			PAP += P[i] * AP[i];
+		if (PAP <= 0)
+			break;
+		double Alpha = RZ / PAP;
+		double NewRZ = 0;
+		for (int i = 0; i < N; i++)
+		{
+			int Vertex = Unknowns[i];
+			X[i] += Alpha * P[i];
+			R[i] -= Alpha * AP[i];
+			Z[i] = R[i] / (Offsets[Vertex + 1] - Offsets[Vertex]);
+			NewRZ += R[i] * Z[i];
+		}
+		double Beta = NewRZ / RZ;
+		RZ = NewRZ;
+		for (int i = 0; i < N; i++)
+			P[i] = Z[i] + Beta * P[i];
+	}
+	for (int i = 0; i < N; i++)
+		Verts[Unknowns[i]].Z = X[i];
+}
+
+//Interpolates the difference to the base heights instead, so free vertices follow the base surface and blend into the fixed ones
+static void SolveHeights(TArray<FVector>& Verts, const TArray<FIndex3i>& Triangles, TArray<bool>& FixedVertices, const FHeightSampler& BaseHeights)
+{
+	if (!BaseHeights)
+	{
+		SolveHarmonicHeights(Verts, Triangles, FixedVertices);
+		return;
+	}
+	TArray<FVector> Base = Verts;
+	for (FVector& Pos : Base)
+		Pos.Z = 0;
+	BaseHeights(Base);
+	for (int i = 0; i < Verts.Num(); i++)
+		Verts[i].Z = FixedVertices[i] ? Verts[i].Z - Base[i].Z : 0;
+	SolveHarmonicHeights(Verts, Triangles, FixedVertices);
+	for (int i = 0; i < Verts.Num(); i++)
+		Verts[i].Z += Base[i].Z;
+}
+
+TUniquePtr<FRoadMesh> FRoadMesh::Create(ERoadMeshBackend Backend)
+{
+#if !WITH_EDITOR
+	//UStaticMesh can not be built in packaged games
+	Backend = ERoadMeshBackend::Procedural;
+#endif
+	if (Backend == ERoadMeshBackend::Procedural)
+		return MakeUnique<FProcRoadMesh>();
+	return MakeUnique<FStaticRoadMesh>();
+}
+
+static UProceduralMeshComponent* FindProcComponent(USceneComponent* Component)
+{
+	for (USceneComponent* Child : Component->GetAttachChildren())
+		if (UProceduralMeshComponent* ProcComponent = Cast<UProceduralMeshComponent>(Child))
+			return ProcComponent;
+	return nullptr;
+}
+
+UPrimitiveComponent* FRoadMesh::GetMeshComponent(USceneComponent* Component)
+{
+	if (UProceduralMeshComponent* ProcComponent = FindProcComponent(Component))
+		return ProcComponent;
+	return Cast<UPrimitiveComponent>(Component);
+}
+
+FVector2D FRoadMesh::GetMaskUV(const FVector& Pos)
+{
+	if (!MaskRoad)
+		return FVector2D::ZeroVector;
+	FVector2D UV = MaskRoad->GetUVNear(FVector2D(Pos), MaskHint);
+	return UV.Y == MAX_dbl ? FVector2D::ZeroVector : UV;
+}
+
+void FRoadMesh::AddCollisionStrip(const FPolyline& LeftCurve, const FPolyline& RightCurve)
+{
+	BuildCollisionHulls(LeftCurve, RightCurve, CollisionHulls);
+}
+
 FStaticRoadMesh::FStaticRoadMesh()
 {
 	MeshDescription = MakeShareable(new FMeshDescription);
@@ -47,14 +331,35 @@ UStaticMesh* FStaticRoadMesh::CreateMesh(UObject* Outer, FName Name, EObjectFlag
 		Mesh->BuildFromMeshDescriptions(Descs, Params);
 		if (!Mesh->GetBodySetup())
 			Mesh->CreateBodySetup();
-		Mesh->GetBodySetup()->CollisionTraceFlag = CTF_UseComplexAsSimple;
+		UBodySetup* BodySetup = Mesh->GetBodySetup();
+		if (CollisionHulls.Num())
+		{
+			BodySetup->CollisionTraceFlag = CTF_UseSimpleAsComplex;
+			for (TArray<FVector>& Hull : CollisionHulls)
+			{
+				FKConvexElem& Elem = BodySetup->AggGeom.ConvexElems.AddDefaulted_GetRef();
+				Elem.VertexData = Hull;
+				Elem.UpdateElemBox();
+			}
+			BodySetup->InvalidatePhysicsData();
+			BodySetup->CreatePhysicsMeshes();
+		}
+		else
+			BodySetup->CollisionTraceFlag = CTF_UseComplexAsSimple;
 	//	Mesh->GetBodySetup()->DefaultInstance.SetCollisionProfileName(TEXT("NoCollision"));
 	}
 	return Mesh;
 }
 
+void FStaticRoadMesh::SetMaskRoad(ARoadActor* Road)
+{
+	FRoadMesh::SetMaskRoad(Road);
+	Builder->SetNumUVLayers(Road ? 2 : 1);
+}
+
 FPolygonGroupID FStaticRoadMesh::GetGroupID(UMaterialInterface* Material)
 {
+	Material = GetMaterial(Material);
 	if (!PolygonGroups.Contains(Material))
 	{
 		FPolygonGroupID Group = Builder->AppendPolygonGroup(Material ? Material->GetFName() : NAME_None);
@@ -63,154 +368,534 @@ FPolygonGroupID FStaticRoadMesh::GetGroupID(UMaterialInterface* Material)
 	return PolygonGroups[Material];
 }
 
-void FStaticRoadMesh::AddStrip(UMaterialInterface* Material, const FPolyline& LeftCurve, const FPolyline& RightCurve)
+void FStaticRoadMesh::AppendStrip(FPolygonGroupID Group, TArrayView<const FPolyPoint> LeftPoints, TArrayView<const FPolyPoint> RightPoints, double UVScale)
 {
-	SCOPE_CYCLE_COUNTER(STAT_AddStrip);
-	FPolygonGroupID Group = GetGroupID(Material);
-	TArray<FVertexID> VertexIDs;
-	VertexIDs.AddUninitialized(LeftCurve.Points.Num() + RightCurve.Points.Num());
-	for (int i = 0; i < LeftCurve.Points.Num(); i++)
-		VertexIDs[i] = Builder->AppendVertex(LeftCurve.Points[i].Pos);
-	for (int i = 0; i < RightCurve.Points.Num(); i++)
-		VertexIDs[i + LeftCurve.Points.Num()] = Builder->AppendVertex(RightCurve.Points[i].Pos);
-	TArray<FVertexInstanceID> InstanceIDs;
-	InstanceIDs.AddUninitialized((LeftCurve.Points.Num() + RightCurve.Points.Num() - 2) * 3);
-	int NumTriangles = 0;
-	double UVScale = GetMutableDefault<USettings_Global>()->UVScale;
+	TArray<FVertexID, TInlineAllocator<64>> VertexIDs;
+	VertexIDs.AddUninitialized(LeftPoints.Num() + RightPoints.Num());
+	for (int i = 0; i < LeftPoints.Num(); i++)
+		VertexIDs[i] = Builder->AppendVertex(LeftPoints[i].Pos);
+	for (int i = 0; i < RightPoints.Num(); i++)
+		VertexIDs[i + LeftPoints.Num()] = Builder->AppendVertex(RightPoints[i].Pos);
+	TArray<FVector2D, TInlineAllocator<64>> MaskUVs;
+	if (MaskRoad)
+	{
+		MaskUVs.AddUninitialized(VertexIDs.Num());
+		for (int i = 0; i < LeftPoints.Num(); i++)
+			MaskUVs[i] = GetMaskUV(LeftPoints[i].Pos);
+		for (int i = 0; i < RightPoints.Num(); i++)
+			MaskUVs[i + LeftPoints.Num()] = GetMaskUV(RightPoints[i].Pos);
+	}
 	auto AddTriangle = [&](int LeftStart, int RightStart, bool LeftSide)
 	{
-		const FVector& P0 = LeftCurve.Points[LeftStart].Pos;
-		const FVector& P1 = RightCurve.Points[RightStart].Pos;
-		const FVector& P2 = LeftSide ? LeftCurve.Points[LeftStart + 1].Pos : RightCurve.Points[RightStart + 1].Pos;
+		const FVector& P0 = LeftPoints[LeftStart].Pos;
+		const FVector& P1 = RightPoints[RightStart].Pos;
+		const FVector& P2 = LeftSide ? LeftPoints[LeftStart + 1].Pos : RightPoints[RightStart + 1].Pos;
 		FVector Cross = (P2 - P0).GetSafeNormal() ^ (P1 - P0).GetSafeNormal();
 		FVector Base = Cross.Z > 0 ? FVector::UpVector : FVector::DownVector;
-		int BaseIndex = NumTriangles * 3;
-		InstanceIDs[BaseIndex + 0] = Builder->AppendInstance(VertexIDs[LeftStart]);
-		InstanceIDs[BaseIndex + 1] = Builder->AppendInstance(VertexIDs[LeftCurve.Points.Num() + RightStart]);
-		InstanceIDs[BaseIndex + 2] = Builder->AppendInstance(VertexIDs[LeftSide ? LeftStart + 1 : LeftCurve.Points.Num() + RightStart + 1]);
-		Builder->SetInstanceNormal(InstanceIDs[BaseIndex + 0], LeftCurve.GetNormal(LeftStart, Base));
-		Builder->SetInstanceNormal(InstanceIDs[BaseIndex + 1], RightCurve.GetNormal(RightStart, Base));
-		Builder->SetInstanceNormal(InstanceIDs[BaseIndex + 2], LeftSide ? LeftCurve.GetNormal(LeftStart + 1, Base) : RightCurve.GetNormal(RightStart + 1, Base));
-		Builder->SetInstanceUV(InstanceIDs[BaseIndex + 0], FVector2D(P0) * UVScale, 0);
-		Builder->SetInstanceUV(InstanceIDs[BaseIndex + 1], FVector2D(P1) * UVScale, 0);
-		Builder->SetInstanceUV(InstanceIDs[BaseIndex + 2], FVector2D(P2) * UVScale, 0);
-		Builder->AppendTriangle(InstanceIDs[BaseIndex + 0], InstanceIDs[BaseIndex + 1], InstanceIDs[BaseIndex + 2], Group);
-		NumTriangles++;
+		FVertexInstanceID InstanceIDs[3];
+		InstanceIDs[0] = Builder->AppendInstance(VertexIDs[LeftStart]);
+		InstanceIDs[1] = Builder->AppendInstance(VertexIDs[LeftPoints.Num() + RightStart]);
+		InstanceIDs[2] = Builder->AppendInstance(VertexIDs[LeftSide ? LeftStart + 1 : LeftPoints.Num() + RightStart + 1]);
+		Builder->SetInstanceNormal(InstanceIDs[0], LeftPoints[LeftStart].GetNormal(Base));
+		Builder->SetInstanceNormal(InstanceIDs[1], RightPoints[RightStart].GetNormal(Base));
+		Builder->SetInstanceNormal(InstanceIDs[2], LeftSide ? LeftPoints[LeftStart + 1].GetNormal(Base) : RightPoints[RightStart + 1].GetNormal(Base));
+		Builder->SetInstanceUV(InstanceIDs[0], FVector2D(P0) * UVScale, 0);
+		Builder->SetInstanceUV(InstanceIDs[1], FVector2D(P1) * UVScale, 0);
+		Builder->SetInstanceUV(InstanceIDs[2], FVector2D(P2) * UVScale, 0);
+		if (MaskRoad)
+		{
+			Builder->SetInstanceUV(InstanceIDs[0], MaskUVs[LeftStart], 1);
+			Builder->SetInstanceUV(InstanceIDs[1], MaskUVs[LeftPoints.Num() + RightStart], 1);
+			Builder->SetInstanceUV(InstanceIDs[2], MaskUVs[LeftSide ? LeftStart + 1 : LeftPoints.Num() + RightStart + 1], 1);
+		}
+		Builder->AppendTriangle(InstanceIDs[0], InstanceIDs[1], InstanceIDs[2], Group);
 	};
-	BuildStrip(LeftCurve, RightCurve, AddTriangle);
+	BuildStrip(LeftPoints, RightPoints, AddTriangle);
 }
 
-void FStaticRoadMesh::AddPolygon(UMaterialInterface* SurfaceMaterial, UMaterialInterface* BackfaceMaterial, const TArray<FVector>& Points)
+void FStaticRoadMesh::AddStrip(UMaterialInterface* Material, const FPolyline& LeftCurve, const FPolyline& RightCurve)
 {
-	auto cdt = CDT::Triangulation<double>(CDT::VertexInsertionOrder::AsProvided, CDT::IntersectingConstraintEdges::Resolve, 0);
-	std::vector<CDT::V2d<double>> verts;
-	std::vector<CDT::Edge> edges;
-	CDT::TriIndUSet toErase;
-	for (int i = 0; i < Points.Num(); i++)
+	SCOPE_CYCLE_COUNTER(STAT_AddStrip);
+	AppendStrip(GetGroupID(Material), LeftCurve.Points, RightCurve.Points, GetMutableDefault<USettings_Global>()->UVScale);
+}
+
+void FStaticRoadMesh::AddStrips(UMaterialInterface* Material, const TArray<FPolyPoint>& LeftPoints, const TArray<FPolyPoint>& RightPoints, const TArray<FIntPoint>& Spans)
+{
+	SCOPE_CYCLE_COUNTER(STAT_AddStrip);
+	FPolygonGroupID Group = GetGroupID(Material);
+	double UVScale = GetMutableDefault<USettings_Global>()->UVScale;
+	for (const FIntPoint& Span : Spans)
+		AppendStrip(Group, MakeArrayView(LeftPoints.GetData() + Span.X, Span.Y), MakeArrayView(RightPoints.GetData() + Span.X, Span.Y), UVScale);
+}
+
+//Largest vertical distance of the neighbors' opposite vertices from the plane of a triangle
+static double GetHeightDeviation(const TArray<FVector>& Verts, const CDT::Triangulation<double>& cdt, int Index)
+{
+	const CDT::Triangle& Triangle = cdt.triangles[Index];
+	const FVector& A = Verts[Triangle.vertices[0]];
+	FVector Normal = (Verts[Triangle.vertices[1]] - A) ^ (Verts[Triangle.vertices[2]] - A);
+	if (FMath::IsNearlyZero(Normal.Z))
+		return 0;
+	double Deviation = 0;
+	for (CDT::TriInd Neighbor : Triangle.neighbors)
 	{
-		edges.push_back(CDT::Edge(i, (i + 1) % Points.Num()));
-		verts.push_back(CDT::V2d<double>::make(Points[i].X, Points[i].Y));
+		if (Neighbor == CDT::noNeighbor)
+			continue;
+		for (CDT::VertInd Vertex : cdt.triangles[Neighbor].vertices)
+		{
+			if (!Triangle.containsVertex(Vertex))
+			{
+				const FVector& P = Verts[Vertex];
+				double Z = A.Z - (Normal.X * (P.X - A.X) + Normal.Y * (P.Y - A.Y)) / Normal.Z;
+				Deviation = FMath::Max(Deviation, FMath::Abs(P.Z - Z));
+			}
+		}
 	}
-	cdt.insertVertices(verts);
-	cdt.insertEdges(edges);
-	cdt.refineTriangles(Points.Num() * 4, toErase);
-	cdt.eraseOuterTrianglesAndHoles();
+	return Deviation;
+}
+
+FPolygonStats FRoadMesh::AddPolygon(UMaterialInterface* SurfaceMaterial, UMaterialInterface* BackfaceMaterial, const TArray<FVector>& Points, const FPolygonRefinement& Refinement, const FHeightSampler& BaseHeights)
+{
+	const int MaxRounds = 8;
 	TArray<FVector> Verts;
 	TArray<FIndex3i> Triangles;
 	TArray<FIndex3i> InvTriangles;
-	TArray<int> TrianglesToSolve;
-	TMap<int, TArray<int>> VertexNeighbors;
-	Verts.AddUninitialized(cdt.vertices.size());
-	Triangles.AddUninitialized(cdt.triangles.size());
-	InvTriangles.AddUninitialized(cdt.triangles.size());
-	TrianglesToSolve.AddUninitialized(cdt.triangles.size());
-	for (int i = 0; i < cdt.vertices.size(); i++)
-		Verts[i] = FVector(cdt.vertices[i].x, cdt.vertices[i].y, i < Points.Num() ? Points[i].Z : 0);
-	for (int i = 0; i < cdt.triangles.size(); i++)
-	{
-		FIndex3i& Triangle = Triangles[i];
-		FIndex3i& InvTriangle = InvTriangles[i];
-		Triangle = FIndex3i(cdt.triangles[i].vertices[0], cdt.triangles[i].vertices[1], cdt.triangles[i].vertices[2]);
-		InvTriangle = FIndex3i(cdt.triangles[i].vertices[0], cdt.triangles[i].vertices[2], cdt.triangles[i].vertices[1]);
-		TrianglesToSolve[i] = i;
-		for (int j = 0; j < 3; j++)
-			for (int k = 1; k < 3; k++)
-				VertexNeighbors.FindOrAdd(Triangle[j]).AddUnique(Triangle[(j + k) % 3]);
+	//Interior points added by height deviation, they are free in the height solve
+	TArray<FVector2D> SteinerPoints;
+	for (int Round = 0; ; Round++)
+	{
+		auto cdt = CDT::Triangulation<double>(CDT::VertexInsertionOrder::AsProvided, CDT::IntersectingConstraintEdges::Resolve, 0);
+		std::vector<CDT::V2d<double>> verts;
+		std::vector<CDT::Edge> edges;
+		CDT::TriIndUSet toErase;
+		for (int i = 0; i < Points.Num(); i++)
+		{
+			edges.push_back(CDT::Edge(i, (i + 1) % Points.Num()));
+			verts.push_back(CDT::V2d<double>::make(Points[i].X, Points[i].Y));
+		}
+		for (const FVector2D& Point : SteinerPoints)
+			verts.push_back(CDT::V2d<double>::make(Point.X, Point.Y));
+		cdt.insertVertices(verts);
+		cdt.insertEdges(edges);
+		//Super triangle takes the first 3 vertices until finalized
+		auto GetBudget = [&]() { return FMath::Max(Refinement.MaxVertices - int(cdt.vertices.size() - 3 - Points.Num()), 0); };
+		if (Refinement.MinAngle > 0 && GetBudget())
+			cdt.refineTriangles(GetBudget(), toErase, CDT::RefinementCriterion::SmallestAngle, FMath::Sin(FMath::DegreesToRadians(Refinement.MinAngle)));
+		if (Refinement.MaxTriangleArea > 0 && GetBudget())
+			cdt.refineTriangles(GetBudget(), toErase, CDT::RefinementCriterion::LargestArea, Refinement.MaxTriangleArea);
+		int Budget = GetBudget();
+		cdt.eraseOuterTrianglesAndHoles();
+		TArray<bool> FixedVertices;
+		Verts.SetNumUninitialized(cdt.vertices.size());
+		Triangles.SetNumUninitialized(cdt.triangles.size());
+		InvTriangles.SetNumUninitialized(cdt.triangles.size());
+		FixedVertices.Init(false, cdt.vertices.size());
+		for (int i = 0; i < cdt.vertices.size(); i++)
+		{
+			Verts[i] = FVector(cdt.vertices[i].x, cdt.vertices[i].y, i < Points.Num() ? Points[i].Z : 0);
+			FixedVertices[i] = i < Points.Num();
+		}
+		for (int i = 0; i < cdt.triangles.size(); i++)
+		{
+			Triangles[i] = FIndex3i(cdt.triangles[i].vertices[0], cdt.triangles[i].vertices[1], cdt.triangles[i].vertices[2]);
+			InvTriangles[i] = FIndex3i(cdt.triangles[i].vertices[0], cdt.triangles[i].vertices[2], cdt.triangles[i].vertices[1]);
+		}
+		//Vertices inserted on constraint edges follow the edge linearly
+		for (std::pair<const CDT::Edge, CDT::EdgeVec>& pair : cdt.pieceToOriginals)
+		{
+			if (!pair.second.size())
+				continue;
+			CDT::Edge& edge = pair.second[0];
+			FVector& P1 = Verts[edge.v1()];
+			FVector& P2 = Verts[edge.v2()];
+			double Distance = FVector2D::Distance((FVector2D&)P1, (FVector2D&)P2);
+			auto Solve = [&](int Index)
+			{
+				if (!FixedVertices[Index])
+				{
+					FVector& P = Verts[Index];
+					P.Z = FMath::Lerp(P1.Z, P2.Z, FVector2D::Distance((FVector2D&)P, (FVector2D&)P1) / Distance);
+					FixedVertices[Index] = true;
+				}
+			};
+			Solve(pair.first.v1());
+			Solve(pair.first.v2());
+		}
+		SolveHeights(Verts, Triangles, FixedVertices, BaseHeights);
+		if (Refinement.MaxHeightDeviation <= 0 || Round == MaxRounds - 1)
+			break;
+		int NumSteinerPoints = SteinerPoints.Num();
+		for (int i = 0; i < cdt.triangles.size() && SteinerPoints.Num() - NumSteinerPoints < Budget; i++)
+		{
+			if (GetHeightDeviation(Verts, cdt, i) > Refinement.MaxHeightDeviation)
+			{
+				const FIndex3i& Triangle = Triangles[i];
+				SteinerPoints.Add(FVector2D(Verts[Triangle.A] + Verts[Triangle.B] + Verts[Triangle.C]) / 3);
+			}
+		}
+		if (SteinerPoints.Num() == NumSteinerPoints)
+			break;
 	}
-	TSet<int> BoundaryVertices;
-	TSet<int> InnerVertices;
-	for (std::pair<const CDT::Edge, CDT::EdgeVec>& pair : cdt.pieceToOriginals)
+	if (SurfaceMaterial)
+		AddTriangles(SurfaceMaterial, InvTriangles, Verts, FVector::UpVector);
+	if (BackfaceMaterial)
+		AddTriangles(BackfaceMaterial, Triangles, Verts, FVector::DownVector);
+	FPolygonStats Stats;
+	Stats.NumVertices = Verts.Num();
+	Stats.NumTriangles = Triangles.Num();
+	return Stats;
+}
+
+struct FTileVertex
+{
+	FVector Pos;
+	//Original polygon edge the segment starting here lies on, INDEX_NONE when it runs along a tile border
+	int Edge;
+	//On the original polygon boundary, so its height is given
+	bool bFixed;
+};
+
+struct FTileBuild
+{
+	FIntPoint Coord;
+	FBox2D Rect;
+	TArray<FTileVertex> Polygon;
+	//Area of the clipped polygon, the vertex cap is shared by area
+	double Area = 0;
+	//Refinement points of the first pass, inside the tile, on the polygon boundary with their height and on the tile border
+	TArray<FVector2D> Interior;
+	TArray<FVector> Boundary;
+	TArray<FVector2D> Seams;
+	TArray<FVector> Verts;
+	TArray<bool> FixedVertices;
+	TArray<FIndex3i> Triangles;
+};
+
+//Sutherland-Hodgman against one tile side, keeping points with (P[Axis] - Value) * Sign >= 0
+static void ClipTilePolygon(TArray<FTileVertex>& Polygon, const TArray<FVector>& Points, int Axis, double Value, double Sign)
+{
+	auto Inside = [&](const FVector& P) { return (P[Axis] - Value) * Sign >= 0; };
+	auto Intersect = [&](const FTileVertex& A) -> FTileVertex
 	{
-		if (!pair.second.size())
-			continue;
-		CDT::Edge& edge = pair.second[0];
-		FVector& P1 = Verts[edge.v1()];
-		FVector& P2 = Verts[edge.v2()];
-		double Distance = FVector2D::Distance((FVector2D&)P1, (FVector2D&)P2);
-		auto Solve = [&](int Index)
+		FVector P = A.Pos;
+		if (A.Edge == INDEX_NONE)
+		{
+			//Segment runs along a perpendicular tile border, so the crossing is a tile corner
+			P[Axis] = Value;
+			return { P, INDEX_NONE, false };
+		}
+		//Computed from the original edge in a fixed order so both tiles sharing the border get the same point
+		FVector P0 = Points[A.Edge];
+		FVector P1 = Points[(A.Edge + 1) % Points.Num()];
+		if (P1[Axis] < P0[Axis])
+			Swap(P0, P1);
+		P = FMath::Lerp(P0, P1, (Value - P0[Axis]) / (P1[Axis] - P0[Axis]));
+		P[Axis] = Value;
+		return { P, INDEX_NONE, true };
+	};
+	TArray<FTileVertex> Result;
+	for (int i = 0; i < Polygon.Num(); i++)
+	{
+		const FTileVertex& A = Polygon[i];
+		const FTileVertex& B = Polygon[(i + 1) % Polygon.Num()];
+		bool InsideA = Inside(A.Pos);
+		bool InsideB = Inside(B.Pos);
+		if (InsideA && InsideB)
+			Result.Add(B);
+		else if (InsideA)
+			Result.Add(Intersect(A));
+		else if (InsideB)
+		{
+			FTileVertex Vertex = Intersect(A);
+			Vertex.Edge = A.Edge;
+			Result.Add(Vertex);
+			Result.Add(B);
+		}
+	}
+	Polygon = MoveTemp(Result);
+}
+
+static bool IsOnTileBorder(const FBox2D& Rect, const FVector2D& P)
+{
+	return P.X == Rect.Min.X || P.X == Rect.Max.X || P.Y == Rect.Min.Y || P.Y == Rect.Max.Y;
+}
+
+//Triangulates the tile polygon, Fixed points keep their height and Extra points are inserted as free vertices, duplicates merged
+static void TriangulateTile(CDT::Triangulation<double>& cdt, const FTileBuild& Tile, const TArray<FVector>& Fixed, const TArray<FVector2D>& Extra, TArray<double>& Heights, TArray<bool>& FixedVertices)
+{
+	std::vector<CDT::V2d<double>> verts;
+	std::vector<CDT::Edge> edges;
+	Heights.Reset();
+	FixedVertices.Reset();
+	for (int i = 0; i < Tile.Polygon.Num(); i++)
+	{
+		const FTileVertex& Vertex = Tile.Polygon[i];
+		verts.push_back(CDT::V2d<double>::make(Vertex.Pos.X, Vertex.Pos.Y));
+		edges.push_back(CDT::Edge(i, (i + 1) % Tile.Polygon.Num()));
+		Heights.Add(Vertex.Pos.Z);
+		FixedVertices.Add(Vertex.bFixed);
+	}
+	for (const FVector& Point : Fixed)
+	{
+		verts.push_back(CDT::V2d<double>::make(Point.X, Point.Y));
+		Heights.Add(Point.Z);
+		FixedVertices.Add(true);
+	}
+	for (const FVector2D& Point : Extra)
+	{
+		verts.push_back(CDT::V2d<double>::make(Point.X, Point.Y));
+		Heights.Add(0);
+		FixedVertices.Add(false);
+	}
+	CDT::DuplicatesInfo Info = CDT::RemoveDuplicatesAndRemapEdges(verts, edges);
+	if (Info.duplicates.size())
+	{
+		TArray<double> NewHeights;
+		TArray<bool> NewFixed;
+		NewHeights.Init(0, verts.size());
+		NewFixed.Init(false, verts.size());
+		for (int i = 0; i < Heights.Num(); i++)
 		{
-			if (Index >= Points.Num() && !BoundaryVertices.Contains(Index))
+			int Index = Info.mapping[i];
+			if (FixedVertices[i] && !NewFixed[Index])
 			{
-				FVector& P = Verts[Index];
-				P.Z = FMath::Lerp(P1.Z, P2.Z, FVector2D::Distance((FVector2D&)P, (FVector2D&)P1) / Distance);
-				BoundaryVertices.Add(Index);
+				NewHeights[Index] = Heights[i];
+				NewFixed[Index] = true;
 			}
-		};
-		Solve(pair.first.v1());
-		Solve(pair.first.v2());
+		}
+		Heights = MoveTemp(NewHeights);
+		FixedVertices = MoveTemp(NewFixed);
 	}
-	while (TrianglesToSolve.Num())
+	//Clipping leaves zero length edges where the polygon touches a border
+	edges.erase(std::remove_if(edges.begin(), edges.end(), [](const CDT::Edge& Edge) { return Edge.v1() == Edge.v2(); }), edges.end());
+	cdt.insertVertices(verts);
+	cdt.insertEdges(edges);
+}
+
+TArray<FPolygonTile> FRoadMesh::TriangulateTiles(const TArray<FVector>& Points, const FPolygonRefinement& Refinement, double TileSize, const FHeightSampler& BaseHeights)
+{
+	FBox2D Bounds(ForceInit);
+	for (const FVector& Point : Points)
+		Bounds += FVector2D(Point);
+	FIntPoint Min(FMath::FloorToInt(Bounds.Min.X / TileSize), FMath::FloorToInt(Bounds.Min.Y / TileSize));
+	FIntPoint Max(FMath::FloorToInt(Bounds.Max.X / TileSize), FMath::FloorToInt(Bounds.Max.Y / TileSize));
+	TArray<FTileBuild> Tiles;
+	for (int Y = Min.Y; Y <= Max.Y; Y++)
 	{
-		auto GetVerticesToSolve = [&](FIndex3i& Triangle)->TArray<int>
+		for (int X = Min.X; X <= Max.X; X++)
 		{
-			TArray<int> Vertices;
-			for (int i = 0; i < 3; i++)
-				if (Triangle[i] >= Points.Num() && !BoundaryVertices.Contains(Triangle[i]) && !InnerVertices.Contains(Triangle[i]))
-					Vertices.Add(i);
-			return MoveTemp(Vertices);
-		};
-		for (int i = 0; i < TrianglesToSolve.Num();)
+			FTileBuild& Tile = Tiles.AddDefaulted_GetRef();
+			Tile.Coord = FIntPoint(X, Y);
+			Tile.Rect = FBox2D(FVector2D(X, Y) * TileSize, FVector2D(X + 1, Y + 1) * TileSize);
+		}
+	}
+	int Width = Max.X - Min.X + 1;
+	auto GetTile = [&](int X, int Y) -> FTileBuild*
+	{
+		return X >= Min.X && X <= Max.X && Y >= Min.Y && Y <= Max.Y ? &Tiles[(Y - Min.Y) * Width + X - Min.X] : nullptr;
+	};
+	ParallelFor(Tiles.Num(), [&](int Index)
+	{
+		FTileBuild& Tile = Tiles[Index];
+		for (int i = 0; i < Points.Num(); i++)
+			Tile.Polygon.Add({ Points[i], i, true });
+		ClipTilePolygon(Tile.Polygon, Points, 0, Tile.Rect.Min.X, 1);
+		ClipTilePolygon(Tile.Polygon, Points, 0, Tile.Rect.Max.X, -1);
+		ClipTilePolygon(Tile.Polygon, Points, 1, Tile.Rect.Min.Y, 1);
+		ClipTilePolygon(Tile.Polygon, Points, 1, Tile.Rect.Max.Y, -1);
+		if (Tile.Polygon.Num() < 3)
+		{
+			Tile.Polygon.Empty();
+			return;
+		}
+		for (int i = 0; i < Tile.Polygon.Num(); i++)
+			Tile.Area += FVector2D::CrossProduct(FVector2D(Tile.Polygon[i].Pos), FVector2D(Tile.Polygon[(i + 1) % Tile.Polygon.Num()].Pos)) / 2;
+		Tile.Area = FMath::Abs(Tile.Area);
+	});
+	double TotalArea = 0;
+	for (const FTileBuild& Tile : Tiles)
+		TotalArea += Tile.Area;
+	//First pass refines each tile on its own, refinement may split tile borders differently on both sides
+	ParallelFor(Tiles.Num(), [&](int Index)
+	{
+		FTileBuild& Tile = Tiles[Index];
+		if (!Tile.Polygon.Num())
+			return;
+		int Budget = TotalArea > 0 ? FMath::Max(int(Refinement.MaxVertices * (Tile.Area / TotalArea)), 1) : 1;
+		auto cdt = CDT::Triangulation<double>(CDT::VertexInsertionOrder::AsProvided, CDT::IntersectingConstraintEdges::Resolve, 0);
+		CDT::TriIndUSet toErase;
+		TArray<double> Heights;
+		TriangulateTile(cdt, Tile, {}, {}, Heights, Tile.FixedVertices);
+		int NumInputs = Heights.Num();
+		auto GetBudget = [&]() { return FMath::Max(Budget - int(cdt.vertices.size() - 3 - NumInputs), 0); };
+		if (Refinement.MinAngle > 0 && GetBudget())
+			cdt.refineTriangles(GetBudget(), toErase, CDT::RefinementCriterion::SmallestAngle, FMath::Sin(FMath::DegreesToRadians(Refinement.MinAngle)));
+		if (Refinement.MaxTriangleArea > 0 && GetBudget())
+			cdt.refineTriangles(GetBudget(), toErase, CDT::RefinementCriterion::LargestArea, Refinement.MaxTriangleArea);
+		cdt.eraseOuterTrianglesAndHoles();
+		TBitArray<> Used(false, cdt.vertices.size());
+		for (const CDT::Triangle& Triangle : cdt.triangles)
+			for (CDT::VertInd Vertex : Triangle.vertices)
+				Used[Vertex] = true;
+		//Points split from constraint edges lie on the polygon boundary or a tile border
+		TBitArray<> OnEdge(false, cdt.vertices.size());
+		//Those on the polygon boundary follow their original edge linearly
+		TBitArray<> OnBoundary(false, cdt.vertices.size());
+		TArray<double> BoundaryHeights;
+		BoundaryHeights.Init(0, cdt.vertices.size());
+		for (std::pair<const CDT::Edge, CDT::EdgeVec>& pair : cdt.pieceToOriginals)
 		{
-			FIndex3i& Triangle = Triangles[TrianglesToSolve[i]];
-			TArray<int> Vertices = GetVerticesToSolve(Triangle);
-			if (Vertices.Num() > 1)
-				i++;
+			OnEdge[pair.first.v1()] = true;
+			OnEdge[pair.first.v2()] = true;
+			if (!pair.second.size())
+				continue;
+			CDT::Edge& edge = pair.second[0];
+			if (!Tile.FixedVertices[edge.v1()] || !Tile.FixedVertices[edge.v2()])
+				continue;
+			FVector2D P1(cdt.vertices[edge.v1()].x, cdt.vertices[edge.v1()].y);
+			FVector2D P2(cdt.vertices[edge.v2()].x, cdt.vertices[edge.v2()].y);
+			double Distance = FVector2D::Distance(P1, P2);
+			auto Solve = [&](CDT::VertInd Index)
+			{
+				if (int(Index) >= NumInputs && !OnBoundary[Index])
+				{
+					FVector2D P(cdt.vertices[Index].x, cdt.vertices[Index].y);
+					BoundaryHeights[Index] = FMath::Lerp(Heights[edge.v1()], Heights[edge.v2()], FVector2D::Distance(P, P1) / Distance);
+					OnBoundary[Index] = true;
+				}
+			};
+			Solve(pair.first.v1());
+			Solve(pair.first.v2());
+		}
+		double Tolerance = TileSize * 1e-9;
+		for (int i = NumInputs; i < cdt.vertices.size(); i++)
+		{
+			if (!Used[i])
+				continue;
+			FVector2D Point(cdt.vertices[i].x, cdt.vertices[i].y);
+			if (!OnEdge[i])
+				Tile.Interior.Add(Point);
 			else
 			{
-				if (Vertices.Num())
+				//Snap onto the border so both sides see exactly the same coordinate
+				if (FMath::IsNearlyEqual(Point.X, Tile.Rect.Min.X, Tolerance))
+					Point.X = Tile.Rect.Min.X;
+				else if (FMath::IsNearlyEqual(Point.X, Tile.Rect.Max.X, Tolerance))
+					Point.X = Tile.Rect.Max.X;
+				else if (FMath::IsNearlyEqual(Point.Y, Tile.Rect.Min.Y, Tolerance))
+					Point.Y = Tile.Rect.Min.Y;
+				else if (FMath::IsNearlyEqual(Point.Y, Tile.Rect.Max.Y, Tolerance))
+					Point.Y = Tile.Rect.Max.Y;
+				else
 				{
-					int j = Vertices[0];
-					FVector& P0 = Verts[Triangle[j]];
-					FVector& P1 = Verts[Triangle[(j + 1) % 3]];
-					FVector& P2 = Verts[Triangle[(j + 2) % 3]];
-					double L1 = FVector2D::Distance((FVector2D&)P0, (FVector2D&)P1);
-					double L2 = FVector2D::Distance((FVector2D&)P0, (FVector2D&)P2);
-					P0.Z = FMath::Lerp(P1.Z, P2.Z, L1 / (L1 + L2));
-					InnerVertices.Add(Triangle[j]);
+					if (OnBoundary[i])
+						Tile.Boundary.Add(FVector(Point, BoundaryHeights[i]));
+					continue;
 				}
-				TrianglesToSolve.RemoveAt(i);
+				Tile.Seams.Add(Point);
 			}
 		}
-	}
-	int NumSmoothIteration = 8;
-	for (int i = 0; i < NumSmoothIteration; i++)
+	});
+	//Second pass keeps the refinement points and inserts the union of border points from both sides, without refining again
+	ParallelFor(Tiles.Num(), [&](int Index)
 	{
-		TMap<int, double> Heights;
-		for (int Index : InnerVertices)
+		FTileBuild& Tile = Tiles[Index];
+		if (!Tile.Polygon.Num())
+			return;
+		TArray<FVector2D> Extra = Tile.Interior;
+		for (int Y = Tile.Coord.Y - 1; Y <= Tile.Coord.Y + 1; Y++)
+			for (int X = Tile.Coord.X - 1; X <= Tile.Coord.X + 1; X++)
+				if (FTileBuild* Other = GetTile(X, Y))
+					for (const FVector2D& Point : Other->Seams)
+						if (IsOnTileBorder(Tile.Rect, Point) && Tile.Rect.IsInsideOrOn(Point))
+							Extra.Add(Point);
+		auto cdt = CDT::Triangulation<double>(CDT::VertexInsertionOrder::AsProvided, CDT::IntersectingConstraintEdges::Resolve, 0);
+		TArray<double> Heights;
+		TriangulateTile(cdt, Tile, Tile.Boundary, Extra, Heights, Tile.FixedVertices);
+		cdt.eraseOuterTrianglesAndHoles();
+		Tile.Verts.SetNumUninitialized(cdt.vertices.size());
+		Tile.FixedVertices.SetNum(cdt.vertices.size());
+		for (int i = 0; i < cdt.vertices.size(); i++)
+			Tile.Verts[i] = FVector(cdt.vertices[i].x, cdt.vertices[i].y, i < Heights.Num() ? Heights[i] : 0);
+		Tile.Triangles.SetNumUninitialized(cdt.triangles.size());
+		for (int i = 0; i < cdt.triangles.size(); i++)
+			Tile.Triangles[i] = FIndex3i(cdt.triangles[i].vertices[0], cdt.triangles[i].vertices[1], cdt.triangles[i].vertices[2]);
+	});
+	//Border vertices are welded by exact position, heights are solved over all tiles at once so seams stay continuous
+	TArray<FVector> Verts;
+	TArray<bool> FixedVertices;
+	TArray<FIndex3i> Triangles;
+	TArray<TArray<int>> VertexMaps;
+	TMap<FVector2D, int> BorderVertices;
+	VertexMaps.SetNum(Tiles.Num());
+	for (int t = 0; t < Tiles.Num(); t++)
+	{
+		FTileBuild& Tile = Tiles[t];
+		TArray<int>& VertexMap = VertexMaps[t];
+		VertexMap.SetNumUninitialized(Tile.Verts.Num());
+		for (int i = 0; i < Tile.Verts.Num(); i++)
 		{
-			TArray<int>& Neighbors = VertexNeighbors[Index];
-			double H = 0;
-			for (int Neighbor : Neighbors)
-				H += Verts[Neighbor].Z / Neighbors.Num();
-			Heights.Add(Index, H);
+			FVector2D Point(Tile.Verts[i]);
+			int* Welded = IsOnTileBorder(Tile.Rect, Point) ? BorderVertices.Find(Point) : nullptr;
+			if (Welded)
+			{
+				if (Tile.FixedVertices[i] && !FixedVertices[*Welded])
+				{
+					Verts[*Welded] = Tile.Verts[i];
+					FixedVertices[*Welded] = true;
+				}
+				VertexMap[i] = *Welded;
+				continue;
+			}
+			VertexMap[i] = Verts.Add(Tile.Verts[i]);
+			FixedVertices.Add(Tile.FixedVertices[i]);
+			if (IsOnTileBorder(Tile.Rect, Point))
+				BorderVertices.Add(Point, VertexMap[i]);
 		}
-		for (int Index : InnerVertices)
-			Verts[Index].Z = Heights[Index];
+		for (const FIndex3i& Triangle : Tile.Triangles)
+			Triangles.Add(FIndex3i(VertexMap[Triangle.A], VertexMap[Triangle.B], VertexMap[Triangle.C]));
 	}
+	SolveHeights(Verts, Triangles, FixedVertices, BaseHeights);
+	TArray<FPolygonTile> Result;
+	for (int t = 0; t < Tiles.Num(); t++)
+	{
+		FTileBuild& Tile = Tiles[t];
+		if (!Tile.Triangles.Num())
+			continue;
+		FPolygonTile& Output = Result.AddDefaulted_GetRef();
+		Output.Coord = Tile.Coord;
+		Output.Vertices.SetNumUninitialized(Tile.Verts.Num());
+		for (int i = 0; i < Tile.Verts.Num(); i++)
+			Output.Vertices[i] = Verts[VertexMaps[t][i]];
+		Output.Triangles = MoveTemp(Tile.Triangles);
+	}
+	return MoveTemp(Result);
+}
+
+FPolygonStats FRoadMesh::AddPolygonTile(UMaterialInterface* SurfaceMaterial, UMaterialInterface* BackfaceMaterial, const FPolygonTile& Tile)
+{
 	if (SurfaceMaterial)
-		AddTriangles(SurfaceMaterial, InvTriangles, Verts, FVector::UpVector);
+	{
+		TArray<FIndex3i> InvTriangles;
+		InvTriangles.SetNumUninitialized(Tile.Triangles.Num());
+		for (int i = 0; i < Tile.Triangles.Num(); i++)
+			InvTriangles[i] = FIndex3i(Tile.Triangles[i].A, Tile.Triangles[i].C, Tile.Triangles[i].B);
+		AddTriangles(SurfaceMaterial, InvTriangles, Tile.Vertices, FVector::UpVector);
+	}
 	if (BackfaceMaterial)
-		AddTriangles(BackfaceMaterial, Triangles, Verts, FVector::DownVector);
+		AddTriangles(BackfaceMaterial, Tile.Triangles, Tile.Vertices, FVector::DownVector);
+	FPolygonStats Stats;
+	Stats.NumVertices = Tile.Vertices.Num();
+	Stats.NumTriangles = Tile.Triangles.Num();
+	return Stats;
+}
+
+void FRoadMesh::Clear(USceneComponent* Component)
+{
+	if (UProceduralMeshComponent* ProcComponent = FindProcComponent(Component))
+		ProcComponent->DestroyComponent();
+	if (UStaticMeshComponent* MeshComponent = Cast<UStaticMeshComponent>(Component))
+		MeshComponent->SetStaticMesh(nullptr);
 }
 
 void FStaticRoadMesh::AddPolygons(UMaterialInterface* Material, const TArray<FVector>& Positions, const TArray<FVector2D>& UVs, int NumCols, int NumRows)
@@ -220,6 +905,13 @@ void FStaticRoadMesh::AddPolygons(UMaterialInterface* Material, const TArray<FVe
 	VertexIDs.AddUninitialized(Positions.Num());
 	for (int i = 0; i < Positions.Num(); i++)
 		VertexIDs[i] = Builder->AppendVertex(Positions[i]);
+	TArray<FVector2D> MaskUVs;
+	if (MaskRoad)
+	{
+		MaskUVs.AddUninitialized(Positions.Num());
+		for (int i = 0; i < Positions.Num(); i++)
+			MaskUVs[i] = GetMaskUV(Positions[i]);
+	}
 	TArray<FVertexInstanceID> InstanceIDs;
 	InstanceIDs.AddUninitialized(NumCols * NumRows * 6);
 	int Stride = NumCols + 1;
@@ -242,6 +934,8 @@ void FStaticRoadMesh::AddPolygons(UMaterialInterface* Material, const TArray<FVe
 					InstanceIDs[Index] = Builder->AppendInstance(VertexIDs[Vertex]);
 					Builder->SetInstanceNormal(InstanceIDs[Index], Normal);
 					Builder->SetInstanceUV(InstanceIDs[Index], UVs[Vertex], 0);
+					if (MaskRoad)
+						Builder->SetInstanceUV(InstanceIDs[Index], MaskUVs[Vertex], 1);
 				}
 				Builder->AppendTriangle(InstanceIDs[BaseIndex + k], InstanceIDs[BaseIndex + k + 1], InstanceIDs[BaseIndex + k + 2], Group);
 			}
@@ -256,6 +950,13 @@ void FStaticRoadMesh::AddTriangles(UMaterialInterface* Material, const TArray<FI
 	VertexIDs.AddUninitialized(Vertices.Num());
 	for (int i = 0; i < Vertices.Num(); i++)
 		VertexIDs[i] = Builder->AppendVertex(Vertices[i]);
+	TArray<FVector2D> MaskUVs;
+	if (MaskRoad)
+	{
+		MaskUVs.AddUninitialized(Vertices.Num());
+		for (int i = 0; i < Vertices.Num(); i++)
+			MaskUVs[i] = GetMaskUV(Vertices[i]);
+	}
 	TArray<FVertexInstanceID> InstanceIDs;
 	InstanceIDs.AddUninitialized(Triangles.Num()*3);
 	double UVScale = GetMutableDefault<USettings_Global>()->UVScale;
@@ -267,6 +968,8 @@ void FStaticRoadMesh::AddTriangles(UMaterialInterface* Material, const TArray<FI
 			InstanceIDs[Index] = Builder->AppendInstance(VertexIDs[Triangles[i][j]]);
 			Builder->SetInstanceNormal(InstanceIDs[Index], Normal);
 			Builder->SetInstanceUV(InstanceIDs[Index], FVector2D(Vertices[Triangles[i][j]]) * UVScale, 0);
+			if (MaskRoad)
+				Builder->SetInstanceUV(InstanceIDs[Index], MaskUVs[Triangles[i][j]], 1);
 		}
 		Builder->AppendTriangle(InstanceIDs[i * 3 + 0], InstanceIDs[i * 3 + 1], InstanceIDs[i * 3 + 2], Group);
 	}
@@ -275,116 +978,579 @@ void FStaticRoadMesh::AddTriangles(UMaterialInterface* Material, const TArray<FI
 void FStaticRoadMesh::Build(USceneComponent* Component)
 {
 	SCOPE_CYCLE_COUNTER(STAT_BuildMesh);
+	if (UProceduralMeshComponent* ProcComponent = FindProcComponent(Component))
+		ProcComponent->DestroyComponent();
 	Cast<UStaticMeshComponent>(Component)->SetStaticMesh(CreateMesh(Component->GetOwner()));
 }
 
-void FProcRoadMesh::AddStrip(UMaterialInterface* Material, const FPolyline& LeftCurve, const FPolyline& RightCurve)
+FProcMeshSection& FProcRoadMesh::GetSection(UMaterialInterface* Material)
+{
+	FProcMeshSection& Section = Sections.FindOrAdd(GetMaterial(Material));
+	Section.bEnableCollision = true;
+	return Section;
+}
+
+void FProcRoadMesh::AppendStrip(FProcMeshSection& Section, TArrayView<const FPolyPoint> LeftPoints, TArrayView<const FPolyPoint> RightPoints, double UVScale)
 {
-	SCOPE_CYCLE_COUNTER(STAT_AddStrip);
-	FProcMeshSection& Section = Sections.FindOrAdd(Material);
 	int BaseVertex = Section.ProcVertexBuffer.Num();
-	Section.ProcVertexBuffer.AddUninitialized(LeftCurve.Points.Num() + RightCurve.Points.Num());
-	double& UVScale = GetMutableDefault<USettings_Global>()->UVScale;
-	for (int i = 0; i < LeftCurve.Points.Num(); i++)
-	{
-		FProcMeshVertex& Vertex = Section.ProcVertexBuffer[BaseVertex + i];
-		Vertex.Position = LeftCurve.Points[i].Pos;
-		Vertex.Tangent = FProcMeshTangent(LeftCurve.GetDir(i), false);
-		Vertex.Normal = LeftCurve.GetNormal(i, FVector::UpVector);
-		Vertex.UV0 = LeftCurve.Points[i].Pos2D() * UVScale;
-		Section.SectionLocalBox += Vertex.Position;
-	}
-	for (int i = 0; i < RightCurve.Points.Num(); i++)
-	{
-		FProcMeshVertex& Vertex = Section.ProcVertexBuffer[BaseVertex + LeftCurve.Points.Num() + i];
-		Vertex.Position = RightCurve.Points[i].Pos;
-		Vertex.Tangent = FProcMeshTangent(RightCurve.GetDir(i), false);
-		Vertex.Normal = RightCurve.GetNormal(i, FVector::UpVector);
-		Vertex.UV0 = RightCurve.Points[i].Pos2D() * UVScale;
-		Section.SectionLocalBox += Vertex.Position;
-	}
 	int BaseIndex = Section.ProcIndexBuffer.Num();
-	Section.ProcIndexBuffer.AddUninitialized((LeftCurve.Points.Num() + RightCurve.Points.Num() - 2) * 3);
+	Section.ProcIndexBuffer.AddUninitialized((LeftPoints.Num() + RightPoints.Num() - 2) * 3);
 	int NumTriangles = 0;
+	double CrossZ = 0;
 	auto AddTriangle = [&](int LeftStart, int RightStart, bool LeftSide)
 	{
+		const FVector& P0 = LeftPoints[LeftStart].Pos;
+		const FVector& P1 = RightPoints[RightStart].Pos;
+		const FVector& P2 = LeftSide ? LeftPoints[LeftStart + 1].Pos : RightPoints[RightStart + 1].Pos;
+		CrossZ += ((P2 - P0).GetSafeNormal() ^ (P1 - P0).GetSafeNormal()).Z;
 		int Base = BaseIndex + NumTriangles * 3;
 		Section.ProcIndexBuffer[Base + 0] = BaseVertex + LeftStart;
-		Section.ProcIndexBuffer[Base + 1] = BaseVertex + LeftCurve.Points.Num() + RightStart;
-		Section.ProcIndexBuffer[Base + 2] = BaseVertex + (LeftSide ? (LeftStart + 1) : (LeftCurve.Points.Num() + RightStart + 1));
+		Section.ProcIndexBuffer[Base + 1] = BaseVertex + LeftPoints.Num() + RightStart;
+		Section.ProcIndexBuffer[Base + 2] = BaseVertex + (LeftSide ? (LeftStart + 1) : (LeftPoints.Num() + RightStart + 1));
 		NumTriangles++;
 	};
-	BuildStrip(LeftCurve, RightCurve, AddTriangle);
+	BuildStrip(LeftPoints, RightPoints, AddTriangle);
+	//Vertices are shared between triangles, so facing is decided per strip
+	FVector Base = CrossZ > 0 ? FVector::UpVector : FVector::DownVector;
+	Section.ProcVertexBuffer.AddUninitialized(LeftPoints.Num() + RightPoints.Num());
+	auto AddVertices = [&](TArrayView<const FPolyPoint> Points, int Offset)
+	{
+		for (int i = 0; i < Points.Num(); i++)
+		{
+			FProcMeshVertex& Vertex = Section.ProcVertexBuffer[Offset + i];
+			Vertex.Position = Points[i].Pos;
+			Vertex.Tangent = FProcMeshTangent(Points[i].GetDir(), false);
+			Vertex.Normal = Points[i].GetNormal(Base);
+			Vertex.Color = FColor::White;
+			Vertex.UV0 = Points[i].Pos2D() * UVScale;
+			Vertex.UV1 = GetMaskUV(Points[i].Pos);
+			Section.SectionLocalBox += Vertex.Position;
+		}
+	};
+	AddVertices(LeftPoints, BaseVertex);
+	AddVertices(RightPoints, BaseVertex + LeftPoints.Num());
 }
 
-void FProcRoadMesh::AddPolygons(UMaterialInterface* Material, const TArray<FVector>& Positions, const TArray<FVector2D>& UVs, int NumCols, int NumRows)
+void FProcRoadMesh::AddStrip(UMaterialInterface* Material, const FPolyline& LeftCurve, const FPolyline& RightCurve)
 {
+	SCOPE_CYCLE_COUNTER(STAT_AddStrip);
+	AppendStrip(GetSection(Material), LeftCurve.Points, RightCurve.Points, GetMutableDefault<USettings_Global>()->UVScale);
+}
 
+void FProcRoadMesh::AddStrips(UMaterialInterface* Material, const TArray<FPolyPoint>& LeftPoints, const TArray<FPolyPoint>& RightPoints, const TArray<FIntPoint>& Spans)
+{
+	SCOPE_CYCLE_COUNTER(STAT_AddStrip);
+	FProcMeshSection& Section = GetSection(Material);
+	double UVScale = GetMutableDefault<USettings_Global>()->UVScale;
+	int NumPoints = 0;
+	for (const FIntPoint& Span : Spans)
+		NumPoints += Span.Y;
+	Section.ProcVertexBuffer.Reserve(Section.ProcVertexBuffer.Num() + NumPoints * 2);
+	Section.ProcIndexBuffer.Reserve(Section.ProcIndexBuffer.Num() + (NumPoints - Spans.Num()) * 6);
+	for (const FIntPoint& Span : Spans)
+		AppendStrip(Section, MakeArrayView(LeftPoints.GetData() + Span.X, Span.Y), MakeArrayView(RightPoints.GetData() + Span.X, Span.Y), UVScale);
 }
 
-void FProcRoadMesh::AddTriangles(UMaterialInterface* Material, const TArray<FIndex3i>& Triangles, const TArray<FVector>& Vertices)
+void FProcRoadMesh::AddPolygons(UMaterialInterface* Material, const TArray<FVector>& Positions, const TArray<FVector2D>& UVs, int NumCols, int NumRows)
 {
-	FProcMeshSection& Section = Sections.FindOrAdd(Material);
+	FProcMeshSection& Section = GetSection(Material);
+	int BaseVertex = Section.ProcVertexBuffer.Num();
+	int BaseIndex = Section.ProcIndexBuffer.Num();
+	Section.ProcVertexBuffer.AddUninitialized(NumCols * NumRows * 6);
+	Section.ProcIndexBuffer.AddUninitialized(NumCols * NumRows * 6);
+	int Stride = NumCols + 1;
+	//Flat shaded like FStaticRoadMesh, so every triangle owns its vertices
+	for (int i = 0; i < NumRows; i++)
+	{
+		for (int j = 0; j < NumCols; j++)
+		{
+			int Indices[6] = { 0, Stride, 1, 1, Stride, Stride + 1 };
+			int QuadIndex = (i * NumCols + j) * 6;
+			int GridVertex = i * Stride + j;
+			for (int k = 0; k < 6; k += 3)
+			{
+				FVector X = (Positions[GridVertex + Indices[k + 2]] - Positions[GridVertex + Indices[k]]).GetSafeNormal();
+				FVector Y = (Positions[GridVertex + Indices[k + 1]] - Positions[GridVertex + Indices[k]]).GetSafeNormal();
+				FVector Normal = (X ^ Y).GetSafeNormal();
+				for (int l = 0; l < 3; l++)
+				{
+					int Vertex = GridVertex + Indices[k + l];
+					int Index = QuadIndex + k + l;
+					FProcMeshVertex& ProcVertex = Section.ProcVertexBuffer[BaseVertex + Index];
+					ProcVertex.Position = Positions[Vertex];
+					ProcVertex.Tangent = FProcMeshTangent(X, false);
+					ProcVertex.Normal = Normal;
+					ProcVertex.Color = FColor::White;
+					ProcVertex.UV0 = UVs[Vertex];
+					ProcVertex.UV1 = GetMaskUV(Positions[Vertex]);
+					Section.ProcIndexBuffer[BaseIndex + Index] = BaseVertex + Index;
+					Section.SectionLocalBox += ProcVertex.Position;
+				}
+			}
+		}
+	}
+}
+
+void FProcRoadMesh::AddTriangles(UMaterialInterface* Material, const TArray<FIndex3i>& Triangles, const TArray<FVector>& Vertices, const FVector& Normal)
+{
+	FProcMeshSection& Section = GetSection(Material);
 	int BaseVertex = Section.ProcVertexBuffer.Num();
 	Section.ProcVertexBuffer.AddUninitialized(Vertices.Num());
+	double UVScale = GetMutableDefault<USettings_Global>()->UVScale;
+	FVector Tangent = (FVector::RightVector ^ Normal).GetSafeNormal();
 	for (int i = 0; i < Vertices.Num(); i++)
 	{
 		FProcMeshVertex& Vertex = Section.ProcVertexBuffer[BaseVertex + i];
 		Vertex.Position = Vertices[i];
-		Vertex.Tangent = FProcMeshTangent(FVector::ForwardVector, false);
-		Vertex.Normal = FVector::UpVector;
-		Vertex.UV0 = FVector2D(Vertices[i]) * 0.01;
+		Vertex.Tangent = FProcMeshTangent(Tangent, false);
+		Vertex.Normal = Normal;
+		Vertex.Color = FColor::White;
+		Vertex.UV0 = FVector2D(Vertices[i]) * UVScale;
+		Vertex.UV1 = GetMaskUV(Vertices[i]);
 		Section.SectionLocalBox += Vertex.Position;
 	}
 	int BaseIndex = Section.ProcIndexBuffer.Num();
 	Section.ProcIndexBuffer.AddUninitialized(Triangles.Num() * 3);
 	for (int i = 0; i < Triangles.Num(); i++)
 		for (int j = 0; j < 3; j++)
-			Section.ProcIndexBuffer[BaseIndex + i*3+j] = BaseVertex + Triangles[i][j];
+			Section.ProcIndexBuffer[BaseIndex + i * 3 + j] = BaseVertex + Triangles[i][j];
+}
+
+static bool IsSameVertices(const TArray<FProcMeshVertex>& A, const TArray<FProcMeshVertex>& B)
+{
+	if (A.Num() != B.Num())
+		return false;
+	for (int i = 0; i < A.Num(); i++)
+	{
+		if (A[i].Position != B[i].Position || A[i].Normal != B[i].Normal || A[i].Tangent.TangentX != B[i].Tangent.TangentX || A[i].UV0 != B[i].UV0 || A[i].UV1 != B[i].UV1)
+			return false;
+	}
+	return true;
 }
 
 void FProcRoadMesh::Build(USceneComponent* Component)
 {
 	SCOPE_CYCLE_COUNTER(STAT_BuildMesh);
-	UProceduralMeshComponent* ProcComponent = Cast<UProceduralMeshComponent>(Component);
+	if (UStaticMeshComponent* MeshComponent = Cast<UStaticMeshComponent>(Component))
+		MeshComponent->SetStaticMesh(nullptr);
+	UProceduralMeshComponent* ProcComponent = FindProcComponent(Component);
+	if (!ProcComponent)
+	{
+		if (!Sections.Num())
+			return;
+		AActor* Actor = Component->GetOwner();
+		ProcComponent = NewObject<UProceduralMeshComponent>(Actor);
+		ProcComponent->AttachToComponent(Component, FAttachmentTransformRules::KeepRelativeTransform);
+		Actor->AddInstanceComponent(ProcComponent);
+		ProcComponent->RegisterComponent();
+	}
+	bool bUseComplexAsSimple = !CollisionHulls.Num();
+	if (ProcComponent->bUseComplexAsSimpleCollision != bUseComplexAsSimple || CollisionHulls.Num())
+	{
+		ProcComponent->bUseComplexAsSimpleCollision = bUseComplexAsSimple;
+		ProcComponent->SetCollisionConvexMeshes(CollisionHulls);
+	}
+	//Only upload sections which really changed, vertex-only changes go through UpdateMeshSection
 	int Index = 0;
-	for (auto It = Sections.CreateIterator(); It; ++It)
+	for (auto& KV : Sections)
 	{
-		It->Value.bEnableCollision = true;
-		ProcComponent->SetMaterial(Index, It->Key);
-		ProcComponent->SetProcMeshSection(Index, It->Value);
+		FProcMeshSection& Section = KV.Value;
+		Section.bEnableCollision = bUseComplexAsSimple;
+		FProcMeshSection* Existing = ProcComponent->GetProcMeshSection(Index);
+		if (!Existing || Existing->bEnableCollision != Section.bEnableCollision || Existing->ProcIndexBuffer != Section.ProcIndexBuffer || Existing->ProcVertexBuffer.Num() != Section.ProcVertexBuffer.Num())
+			ProcComponent->SetProcMeshSection(Index, Section);
+		else if (!IsSameVertices(Existing->ProcVertexBuffer, Section.ProcVertexBuffer))
+		{
+			TArray<FVector> Positions, Normals;
+			TArray<FVector2D> UVs, MaskUVs;
+			TArray<FProcMeshTangent> Tangents;
+			Positions.AddUninitialized(Section.ProcVertexBuffer.Num());
+			Normals.AddUninitialized(Section.ProcVertexBuffer.Num());
+			UVs.AddUninitialized(Section.ProcVertexBuffer.Num());
+			MaskUVs.AddUninitialized(Section.ProcVertexBuffer.Num());
+			Tangents.AddUninitialized(Section.ProcVertexBuffer.Num());
+			for (int i = 0; i < Section.ProcVertexBuffer.Num(); i++)
+			{
+				const FProcMeshVertex& Vertex = Section.ProcVertexBuffer[i];
+				Positions[i] = Vertex.Position;
+				Normals[i] = Vertex.Normal;
+				UVs[i] = Vertex.UV0;
+				MaskUVs[i] = Vertex.UV1;
+				Tangents[i] = Vertex.Tangent;
+			}
+			ProcComponent->UpdateMeshSection(Index, Positions, Normals, UVs, MaskUVs, TArray<FVector2D>(), TArray<FVector2D>(), TArray<FColor>(), Tangents);
+		}
+		if (ProcComponent->GetMaterial(Index) != KV.Key)
+			ProcComponent->SetMaterial(Index, KV.Key);
 		Index++;
 	}
+	for (int i = Index; i < ProcComponent->GetNumSections(); i++)
+		if (ProcComponent->GetProcMeshSection(i)->ProcVertexBuffer.Num())
+			ProcComponent->ClearMeshSection(i);
+}
+
+FRoadMarkingMask::FRoadMarkingMask(ARoadActor* Road)
+{
+	USettings_Global* Settings = GetMutableDefault<USettings_Global>();
+	TexelSize = Settings->MarkingMaskTexelSize;
+	MaxSize = Settings->MarkingMaskMaxSize;
+	ChunkLength = TexelSize * MaxSize;
+	MaskRoad = Road;
+}
+
+UMaterialInterface* FRoadMarkingMask::GetChunkMaterial(UMaterialInterface* Material, int Chunk)
+{
+	UMaterialInstanceDynamic*& MID = ChunkMaterials.FindOrAdd(TPair<UMaterialInterface*, int>(Material, Chunk));
+	if (!MID)
+		MID = UMaterialInstanceDynamic::Create(Material, MaskRoad);
+	return MID;
+}
+
+int FRoadMarkingMask::GetChannel(UMaterialInterface* Material)
+{
+	int Channel = Channels.Find(Material);
+	if (Channel == INDEX_NONE)
+	{
+		if (Channels.Num() == 4)
+		{
+			UE_LOG(LogRoadBuilder, Warning, TEXT("%s: marking mask has no channel left for %s"), *MaskRoad->GetName(), *GetNameSafe(Material));
+			return INDEX_NONE;
+		}
+		Channel = Channels.Add(Material);
+	}
+	return Channel;
+}
+
+void FRoadMarkingMask::AddTriangle(int Channel, const FVector2D& P0, const FVector2D& P1, const FVector2D& P2)
+{
+	if (Channel != INDEX_NONE && P0.Y != MAX_dbl && P1.Y != MAX_dbl && P2.Y != MAX_dbl)
+		Triangles.Add({ { P0, P1, P2 }, Channel });
+}
+
+void FRoadMarkingMask::AddStrip(UMaterialInterface* Material, const FPolyline& LeftCurve, const FPolyline& RightCurve)
+{
+	AppendStrip(GetChannel(Material), LeftCurve.Points, RightCurve.Points);
+}
+
+void FRoadMarkingMask::AddStrips(UMaterialInterface* Material, const TArray<FPolyPoint>& LeftPoints, const TArray<FPolyPoint>& RightPoints, const TArray<FIntPoint>& Spans)
+{
+	int Channel = GetChannel(Material);
+	for (const FIntPoint& Span : Spans)
+		AppendStrip(Channel, MakeArrayView(LeftPoints.GetData() + Span.X, Span.Y), MakeArrayView(RightPoints.GetData() + Span.X, Span.Y));
+}
+
+void FRoadMarkingMask::AppendStrip(int Channel, TArrayView<const FPolyPoint> LeftPoints, TArrayView<const FPolyPoint> RightPoints)
+{
+	TArray<FVector2D> LeftUVs, RightUVs;
+	LeftUVs.AddUninitialized(LeftPoints.Num());
+	RightUVs.AddUninitialized(RightPoints.Num());
+	for (int i = 0; i < LeftPoints.Num(); i++)
+		LeftUVs[i] = MaskRoad->GetUVNear(LeftPoints[i].Pos2D(), MaskHint);
+	for (int i = 0; i < RightPoints.Num(); i++)
+		RightUVs[i] = MaskRoad->GetUVNear(RightPoints[i].Pos2D(), MaskHint);
+	BuildStrip(LeftPoints, RightPoints, [&](int LeftStart, int RightStart, bool LeftSide)
+	{
+		AddTriangle(Channel, LeftUVs[LeftStart], RightUVs[RightStart], LeftSide ? LeftUVs[LeftStart + 1] : RightUVs[RightStart + 1]);
+	});
+}
+
+void FRoadMarkingMask::AddPolygons(UMaterialInterface* Material, const TArray<FVector>& Positions, const TArray<FVector2D>& UVs, int NumCols, int NumRows)
+{
+	int Channel = GetChannel(Material);
+	TArray<FVector2D> MaskUVs;
+	MaskUVs.AddUninitialized(Positions.Num());
+	for (int i = 0; i < Positions.Num(); i++)
+		MaskUVs[i] = MaskRoad->GetUVNear(FVector2D(Positions[i]), MaskHint);
+	int Stride = NumCols + 1;
+	for (int i = 0; i < NumRows; i++)
+	{
+		for (int j = 0; j < NumCols; j++)
+		{
+			int Base = i * Stride + j;
+			AddTriangle(Channel, MaskUVs[Base], MaskUVs[Base + Stride], MaskUVs[Base + 1]);
+			AddTriangle(Channel, MaskUVs[Base + 1], MaskUVs[Base + Stride], MaskUVs[Base + Stride + 1]);
+		}
+	}
+}
+
+void FRoadMarkingMask::AddTriangles(UMaterialInterface* Material, const TArray<FIndex3i>& InTriangles, const TArray<FVector>& Vertices, const FVector& Normal)
+{
+	int Channel = GetChannel(Material);
+	TArray<FVector2D> MaskUVs;
+	MaskUVs.AddUninitialized(Vertices.Num());
+	for (int i = 0; i < Vertices.Num(); i++)
+		MaskUVs[i] = MaskRoad->GetUVNear(FVector2D(Vertices[i]), MaskHint);
+	for (const FIndex3i& Triangle : InTriangles)
+		AddTriangle(Channel, MaskUVs[Triangle.A], MaskUVs[Triangle.B], MaskUVs[Triangle.C]);
+}
+
+//Coverage of 2x2 subsamples per texel is added to the channel, Points are in texel units
+static void RasterizeTriangle(FVector2D A, FVector2D B, FVector2D C, int Channel, int Width, int Height, TArray<FColor>& Pixels)
+{
+	double Area = (B - A) ^ (C - A);
+	if (FMath::IsNearlyZero(Area))
+		return;
+	if (Area < 0)
+		Swap(B, C);
+	int MinX = FMath::Max(FMath::FloorToInt(FMath::Min3(A.X, B.X, C.X)), 0);
+	int MinY = FMath::Max(FMath::FloorToInt(FMath::Min3(A.Y, B.Y, C.Y)), 0);
+	int MaxX = FMath::Min(FMath::CeilToInt(FMath::Max3(A.X, B.X, C.X)), Width - 1);
+	int MaxY = FMath::Min(FMath::CeilToInt(FMath::Max3(A.Y, B.Y, C.Y)), Height - 1);
+	auto Inside = [&](const FVector2D& P)
+	{
+		return ((B - A) ^ (P - A)) >= 0 && ((C - B) ^ (P - B)) >= 0 && ((A - C) ^ (P - C)) >= 0;
+	};
+	for (int y = MinY; y <= MaxY; y++)
+	{
+		for (int x = MinX; x <= MaxX; x++)
+		{
+			int Coverage = 0;
+			for (int i = 0; i < 4; i++)
+				Coverage += Inside(FVector2D(x + 0.25 + (i % 2) * 0.5, y + 0.25 + (i / 2) * 0.5));
+			if (Coverage)
+			{
+				FColor& Pixel = Pixels[y * Width + x];
+				uint8& Value = Channel == 0 ? Pixel.R : (Channel == 1 ? Pixel.G : (Channel == 2 ? Pixel.B : Pixel.A));
+				Value = FMath::Min(Value + Coverage * 64, 255);
+			}
+		}
+	}
+}
+
+//Texture is reused when possible, masks stay uncompressed without mips so 1 texel marking edges stay sharp
+static UTexture2D* UpdateMaskTexture(UTexture2D* Texture, UObject* Outer, int Width, int Height, const TArray<FColor>& Pixels)
+{
+#if WITH_EDITORONLY_DATA
+	if (!Texture)
+		Texture = NewObject<UTexture2D>(Outer);
+	Texture->Source.Init(Width, Height, 1, 1, TSF_BGRA8, (const uint8*)Pixels.GetData());
+	Texture->SRGB = false;
+	Texture->CompressionSettings = TC_VectorDisplacementmap;
+	Texture->MipGenSettings = TMGS_NoMipmaps;
+	Texture->AddressX = TA_Clamp;
+	Texture->AddressY = TA_Clamp;
+	Texture->PostEditChange();
+#else
+	//Only textures created here have CPU side mips to fill
+	if (!Texture || !Texture->HasAnyFlags(RF_Transient) || Texture->GetSizeX() != Width || Texture->GetSizeY() != Height)
+		Texture = UTexture2D::CreateTransient(Width, Height, PF_B8G8R8A8);
+	Texture->SRGB = false;
+	Texture->AddressX = TA_Clamp;
+	Texture->AddressY = TA_Clamp;
+	FTexture2DMipMap& Mip = Texture->GetPlatformData()->Mips[0];
+	FMemory::Memcpy(Mip.BulkData.Lock(LOCK_READ_WRITE), Pixels.GetData(), Pixels.Num() * Pixels.GetTypeSize());
+	Mip.BulkData.Unlock();
+	Texture->UpdateResource();
+#endif
+	return Texture;
+}
+
+void FRoadMarkingMask::Build(USceneComponent* Component)
+{
+	SCOPE_CYCLE_COUNTER(STAT_BuildMesh);
+	//One texel of empty border on both sides, texture is clamped
+	double TMin = 0, TMax = 0;
+	for (FTriangle& Triangle : Triangles)
+	{
+		for (FVector2D& Point : Triangle.Points)
+		{
+			TMin = FMath::Min(TMin, Point.Y);
+			TMax = FMath::Max(TMax, Point.Y);
+		}
+	}
+	TMin -= TexelSize;
+	TMax += TexelSize;
+	int Height = FMath::Clamp(FMath::CeilToInt((TMax - TMin) / TexelSize), 1, MaxSize);
+	double TexelHeight = (TMax - TMin) / Height;
+	TMap<int, TArray<int>> ChunkTriangles;
+	for (auto& KV : ChunkMaterials)
+		ChunkTriangles.FindOrAdd(KV.Key.Value);
+	for (int i = 0; i < Triangles.Num(); i++)
+	{
+		FTriangle& Triangle = Triangles[i];
+		double SMin = FMath::Min3(Triangle.Points[0].X, Triangle.Points[1].X, Triangle.Points[2].X);
+		double SMax = FMath::Max3(Triangle.Points[0].X, Triangle.Points[1].X, Triangle.Points[2].X);
+		for (int Chunk = GetChunk(SMin); Chunk <= GetChunk(SMax); Chunk++)
+			if (TArray<int>* Indices = ChunkTriangles.Find(Chunk))
+				Indices->Add(i);
+	}
+	for (auto& KV : ChunkTriangles)
+	{
+		double S0 = KV.Key * ChunkLength;
+		int Width = FMath::Clamp(FMath::CeilToInt((MaskRoad->Length() - S0) / TexelSize), 1, MaxSize);
+		TArray<FColor> Pixels;
+		Pixels.Init(FColor(0, 0, 0, 0), Width * Height);
+		auto ToTexel = [&](const FVector2D& Point)
+		{
+			return FVector2D((Point.X - S0) / TexelSize, (Point.Y - TMin) / TexelHeight);
+		};
+		for (int Index : KV.Value)
+		{
+			FTriangle& Triangle = Triangles[Index];
+			RasterizeTriangle(ToTexel(Triangle.Points[0]), ToTexel(Triangle.Points[1]), ToTexel(Triangle.Points[2]), Triangle.Channel, Width, Height, Pixels);
+		}
+		if (MaskRoad->MaskTextures.Num() <= KV.Key)
+			MaskRoad->MaskTextures.SetNum(KV.Key + 1);
+		UTexture2D* Texture = MaskRoad->MaskTextures[KV.Key] = UpdateMaskTexture(MaskRoad->MaskTextures[KV.Key], MaskRoad, Width, Height, Pixels);
+		//Surface material maps UV1 (s, t) to mask UV as (UV1 - Range.RG) * Range.BA
+		FLinearColor Range(S0, TMin, 1.0 / (Width * TexelSize), 1.0 / (Height * TexelHeight));
+		for (auto& Material : ChunkMaterials)
+		{
+			if (Material.Key.Value != KV.Key)
+				continue;
+			UMaterialInstanceDynamic* MID = Material.Value;
+			MID->SetTextureParameterValue(TEXT("MarkingMask"), Texture);
+			MID->SetVectorParameterValue(TEXT("MarkingMaskRange"), Range);
+			for (int i = 0; i < Channels.Num(); i++)
+			{
+				FLinearColor Color = FLinearColor::White;
+				if (Channels[i])
+					Channels[i]->GetVectorParameterValue(FHashedMaterialParameterInfo(TEXT("Color")), Color);
+				MID->SetVectorParameterValue(*FString::Printf(TEXT("MarkingColor%d"), i), Color);
+			}
+		}
+	}
+	//Chunks past the end of a shortened road
+	int NumChunks = GetChunk(MaskRoad->Length()) + 1;
+	if (MaskRoad->MaskTextures.Num() > NumChunks)
+		MaskRoad->MaskTextures.SetNum(NumChunks);
+}
+
+void FInstanceBuilder::SetupComponent(UInstancedStaticMeshComponent* Component, double CullDistance, bool bDensityScaling)
+{
+	//Fade over the last fifth of cull distance
+	if (CullDistance > 0)
+		Component->SetCullDistances(CullDistance * 0.8, CullDistance);
+	else
+		Component->SetCullDistances(0, 0);
+	if (UHierarchicalInstancedStaticMeshComponent* HISM = Cast<UHierarchicalInstancedStaticMeshComponent>(Component))
+		HISM->bEnableDensityScaling = bDensityScaling;
 }
 
 void FInstanceBuilder::AttachToActor(AActor* Actor)
 {
-	for (auto KV : Instances)
+	//Existing components are reused by mesh, material and type so unchanged instances are left alone
+	typedef TTuple<UStaticMesh*, UMaterialInterface*, bool> FComponentKey;
+	TMap<FComponentKey, UInstancedStaticMeshComponent*> Existing;
+	TArray<UInstancedStaticMeshComponent*> Components;
+	Actor->GetComponents(Components);
+	for (UInstancedStaticMeshComponent* Component : Components)
+	{
+		UMaterialInterface* Material = Component->OverrideMaterials.Num() ? Component->OverrideMaterials[0] : nullptr;
+		FComponentKey Key(Component->GetStaticMesh(), Material, !Component->IsA<UHierarchicalInstancedStaticMeshComponent>());
+		if (Existing.Contains(Key))
+		{
+			Actor->RemoveInstanceComponent(Component);
+			Component->DestroyComponent();
+		}
+		else
+			Existing.Add(Key, Component);
+	}
+	for (auto& KV : Instances)
 	{
-		UInstancedStaticMeshComponent* Component = KV.Value.bForceISM ? NewObject<UInstancedStaticMeshComponent>(Actor) : NewObject<UHierarchicalInstancedStaticMeshComponent>(Actor);
+		TArray<FTransform>& Transforms = KV.Value.Instances;
+		UInstancedStaticMeshComponent* Component = nullptr;
+		if (Existing.RemoveAndCopyValue(FComponentKey(KV.Key.Key, KV.Key.Value, KV.Value.bForceISM), Component))
+		{
+			SetupComponent(Component, KV.Value.CullDistance, KV.Value.bDensityScaling);
+			int NumOld = Component->GetInstanceCount();
+			int NumCommon = FMath::Min(NumOld, Transforms.Num());
+			int FirstChanged = NumCommon, LastChanged = -1;
+			for (int i = 0; i < NumCommon; i++)
+			{
+				FTransform Trans;
+				Component->GetInstanceTransform(i, Trans);
+				if (!Trans.Equals(Transforms[i], KINDA_SMALL_NUMBER))
+				{
+					FirstChanged = FMath::Min(FirstChanged, i);
+					LastChanged = i;
+				}
+			}
+			if (FirstChanged <= LastChanged)
+				Component->BatchUpdateInstancesTransforms(FirstChanged, TArray<FTransform>(Transforms.GetData() + FirstChanged, LastChanged - FirstChanged + 1), false, true, true);
+			if (Transforms.Num() > NumOld)
+				Component->AddInstances(TArray<FTransform>(Transforms.GetData() + NumOld, Transforms.Num() - NumOld), false);
+			else if (Transforms.Num() < NumOld)
+			{
+				TArray<int32> Removed;
+				for (int i = NumOld - 1; i >= Transforms.Num(); i--)
+					Removed.Add(i);
+				Component->RemoveInstances(Removed);
+			}
+			continue;
+		}
+		Component = KV.Value.bForceISM ? NewObject<UInstancedStaticMeshComponent>(Actor) : NewObject<UHierarchicalInstancedStaticMeshComponent>(Actor);
 		Component->SetReceivesDecals(false);
-		Component->SetStaticMesh(KV.Key);
-		Component->SetCullDistances(0, 0);
-		for (FTransform& Instance : KV.Value.Instances)
-			Component->AddInstance(Instance);
+		Component->SetStaticMesh(KV.Key.Key);
+		if (KV.Key.Value)
+			Component->SetMaterial(0, KV.Key.Value);
+		SetupComponent(Component, KV.Value.CullDistance, KV.Value.bDensityScaling);
+		Component->AddInstances(Transforms, false);
 		Component->AttachToComponent(Actor->GetRootComponent(), FAttachmentTransformRules::KeepRelativeTransform);
 		Actor->AddInstanceComponent(Component);
 		Component->RegisterComponent();
 	}
+	for (auto& KV : Existing)
+	{
+		Actor->RemoveInstanceComponent(KV.Value);
+		KV.Value->DestroyComponent();
+	}
 }
 
 void FDecalBuilder::AttachToActor(AActor* Actor)
 {
+	//Existing decals are repositioned, only the difference is created or destroyed
+	TMap<UMaterialInterface*, TArray<UDecalComponent*>> Pool;
+	TArray<UDecalComponent*> Components;
+	Actor->GetComponents(Components);
+	for (UDecalComponent* Component : Components)
+		Pool.FindOrAdd(Component->GetDecalMaterial()).Add(Component);
 	FTransform LocalRot(FRotator(-90, 0, 0));
 	for (FDecal& Decal : Decals)
 	{
-		UDecalComponent* Component = NewObject<UDecalComponent>(Actor);
+		TArray<UDecalComponent*>* Reusable = Pool.Find(Decal.Material);
+		UDecalComponent* Component = Reusable && Reusable->Num() ? Reusable->Pop(false) : nullptr;
+		if (!Component)
+		{
+			Component = NewObject<UDecalComponent>(Actor);
+			Component->SetDecalMaterial(Decal.Material);
+			Component->AttachToComponent(Actor->GetRootComponent(), FAttachmentTransformRules::KeepRelativeTransform);
+			Actor->AddInstanceComponent(Component);
+			Component->RegisterComponent();
+		}
 		Component->SetRelativeTransform(LocalRot * Decal.Trans);
-		Component->SetDecalMaterial(Decal.Material);
 		Component->DecalSize = FVector(Decal.Size.X / 2, Decal.Size.Y, Decal.Size.X);
 	//  Component->SetFadeScreenSize(0.05);
-		Component->AttachToComponent(Actor->GetRootComponent(), FAttachmentTransformRules::KeepRelativeTransform);
-		Actor->AddInstanceComponent(Component);
-		Component->RegisterComponent();
+		Component->MarkRenderStateDirty();
+	}
+	for (auto& KV : Pool)
+	{
+		for (UDecalComponent* Component : KV.Value)
+		{
+			Actor->RemoveInstanceComponent(Component);
+			Component->DestroyComponent();
+		}
+	}
+}
+
+void FActorBuilder::AttachToActor(AActor* Actor)
+{
+	//Attached actors are pooled by class and moved into place, only the difference is spawned or destroyed
+	TMap<UClass*, TArray<AActor*>> Pool;
+	Actor->ForEachAttachedActors([&](AActor* Attached)->bool
+	{
+		Pool.FindOrAdd(Attached->GetClass()).Add(Attached);
+		return true;
+	});
+	for (FActor& Item : Actors)
+	{
+		TArray<AActor*>* Reusable = Pool.Find(Item.Class);
+		if (Reusable && Reusable->Num())
+			Reusable->Pop(false)->SetActorTransform(Item.Trans);
+		else if (AActor* Spawned = Actor->GetWorld()->SpawnActor<AActor>(Item.Class, Item.Trans))
+			Spawned->AttachToActor(Actor, FAttachmentTransformRules::KeepWorldTransform);
 	}
+	for (auto& KV : Pool)
+		for (AActor* Attached : KV.Value)
+			Attached->Destroy();
 }
\ No newline at end of file
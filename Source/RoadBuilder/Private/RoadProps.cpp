@@ -7,28 +7,43 @@
 #include "Engine/StaticMesh.h"
 #include "Engine/World.h"
 #include "Kismet/GameplayStatics.h"
+#include "Async/ParallelFor.h"
 
-void URoadProps::Generate(ARoadActor* Road, const FPolyline& Baseline, FRoadActorBuilder& Builder)
+double FRoadProp::GetCullDistance(UStaticMesh* Mesh, const FTransform& Trans) const
 {
-	for (FRoadProp& Prop : Props)
+	//Screen size of bounds is about Radius / Distance at 90 degrees FOV
+	return CullScreenSize > 0 ? Mesh->GetBounds().SphereRadius * Trans.GetMaximumAxisScale() / CullScreenSize : 0;
+}
+
+void URoadProps::Place(const FPolyline& Baseline, uint32 Seed, TArray<FPlacement>& Placements) const
+{
+	//Rules with the same lateral offset share one table
+	TMap<double, FArcLengthTable> Tables;
+	for (int PropIndex = 0; PropIndex < Props.Num(); PropIndex++)
 	{
+		const FRoadProp& Prop = Props[PropIndex];
+		//Each rule draws from its own stream, so editing one rule leaves the others in place
+		uint32 PropSeed = HashCombine(Seed, GetTypeHash(PropIndex));
+		FRandomStream Stream(PropSeed);
 		float Start = Prop.Start;
 		float End = Prop.End;
 		if (Prop.Spacing > 0)
 		{
-			FPolyline Line_Resample = Baseline.Resample(Prop.Spacing);
-			FPolyline Line_Offset = Line_Resample.Offset(FVector2D(Prop.Offset.Y, 0));
-			FPolyline Line = Line_Offset.Resample(Prop.Spacing);
-			float Length = Line.Points.Last().Dist;
-			int StartIndex = Line.GetPoint(Start * Length);
-			int EndIndex = FMath::Min(Line.GetPoint(End * Length), Line.Points.Num() - 2);
+			const FArcLengthTable* Table = Tables.Find(Prop.Offset.Y);
+			if (!Table)
+				Table = &Tables.Add(Prop.Offset.Y, FArcLengthTable(Baseline, Prop.Offset.Y));
+			double Length = Table->Length();
+			int NumSegs = FMath::Max(1, FMath::RoundToInt(Length / Prop.Spacing));
+			double Step = Length / NumSegs;
+			int StartIndex = FMath::Clamp(FMath::FloorToInt(Start * Length / Step), 0, NumSegs - 1);
+			int EndIndex = FMath::Clamp(FMath::FloorToInt(End * Length / Step), 0, NumSegs - 1);
 			for (int i = StartIndex; i <= EndIndex; i++)
 			{
 				int Index = (i % Prop.Of - Prop.Base + Prop.Of) % Prop.Of;
 				if (Index >= Prop.Select)
 					continue;
-				FVector Pos0 = Line.Points[i].Pos;
-				FVector Pos1 = Line.Points[i + 1].Pos;
+				FVector Pos0 = Table->Sample(i * Step).Pos;
+				FVector Pos1 = Table->Sample((i + 1) * Step).Pos;
 				FVector N = Pos1 - Pos0;
 				float Size = N.Size();
 				N /= Size;
@@ -36,28 +51,51 @@ void URoadProps::Generate(ARoadActor* Road, const FPolyline& Baseline, FRoadActo
 				FVector Up(0, 0, 1);
 				FVector Right = (Up ^ N).GetSafeNormal();
 				Up = (N ^ Right).GetSafeNormal();
-				FVector RandomOffset = FVector(Builder.Stream.FRand() - 0.5f, Builder.Stream.FRand() - 0.5f, Builder.Stream.FRand() - 0.5f) * Prop.RandomOffset;
+				FVector RandomOffset = FVector(Stream.FRand() - 0.5f, Stream.FRand() - 0.5f, Stream.FRand() - 0.5f) * Prop.RandomOffset;
 				FVector NewP = Pos0 + N * ((Prop.Offset.X + RandomOffset.X) * Scale.X) + Right * RandomOffset.Y + Up * (Prop.Offset.Z + RandomOffset.Z);
-				FTransform Trans(FQuat(N.Rotation()) * FQuat(Prop.GetRotation(Builder.Stream)), NewP, Prop.GetScale(Builder.Stream) * Scale);
-				UObject* Asset = Prop.GetAsset(Builder.Stream);
-				if (UStaticMesh* Mesh = Cast<UStaticMesh>(Asset))
-				{
-					Builder.InstanceBuilder.AddInstance(Mesh, Trans);
-				}
-				else if (UBlueprint* BP = Cast<UBlueprint>(Asset))
-				{
-					AActor* Actor = GetWorld()->SpawnActor<AActor>(BP->GeneratedClass);
-					Actor->SetActorTransform(Trans);
-					Actor->AttachToActor(Road, FAttachmentTransformRules::KeepWorldTransform);
-				}
-				else if (UMaterialInterface* Material = Cast<UMaterialInterface>(Asset))
-				{
-					Builder.DecalBuilder.AddDecal(Material, Trans, FVector2D(256, 256));
-				}
+				FTransform Trans(FQuat(N.Rotation()) * FQuat(Prop.GetRotation(Stream)), NewP, Prop.GetScale(Stream) * Scale);
+				Placements.Add({ PropIndex, Prop.GetAsset(Stream), Trans });
 			}
 		}
 	}
 }
+
+void URoadProps::Commit(const TArray<FPlacement>& Placements, FRoadActorBuilder& Builder) const
+{
+	for (const FPlacement& Placement : Placements)
+	{
+		const FRoadProp& Prop = Props[Placement.PropIndex];
+		const FTransform& Trans = Placement.Trans;
+		if (UStaticMesh* Mesh = Cast<UStaticMesh>(Placement.Asset))
+		{
+			FInstanceBuilder::FInstances& Instances = Builder.InstanceBuilder.AddInstance(Mesh, Trans);
+			Instances.AddCullDistance(Prop.GetCullDistance(Mesh, Trans));
+			Instances.bDensityScaling |= Prop.bDensityScaling;
+		}
+		else if (UBlueprint* BP = Cast<UBlueprint>(Placement.Asset))
+		{
+			Builder.ActorBuilder.AddActor(BP->GeneratedClass, Trans);
+		}
+		else if (UMaterialInterface* Material = Cast<UMaterialInterface>(Placement.Asset))
+		{
+			Builder.DecalBuilder.AddDecal(Material, Trans, FVector2D(256, 256));
+		}
+	}
+}
+
+void URoadProps::Generate(FRoadActorBuilder& Builder)
+{
+	TArray<FRoadActorBuilder::FPropJob>& Jobs = Builder.PropJobs;
+	TArray<TArray<FPlacement>> Placements;
+	Placements.SetNum(Jobs.Num());
+	ParallelFor(Jobs.Num(), [&](int Index)
+	{
+		Jobs[Index].Props->Place(Jobs[Index].Baseline, Jobs[Index].Seed, Placements[Index]);
+	});
+	for (int Index = 0; Index < Jobs.Num(); Index++)
+		Jobs[Index].Props->Commit(Placements[Index], Builder);
+	Jobs.Empty();
+}
 #if WITH_EDITOR
 void URoadProps::PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent)
 {
@@ -3,6 +3,7 @@
 
 #include "RoadScene.h"
 #include "XmlFile.h"
+#include "Components/HierarchicalInstancedStaticMeshComponent.h"
 #include "Engine/Level.h"
 #include "Engine/World.h"
 
@@ -16,6 +17,11 @@ void FJunctionLink::Destroy()
 {
 	if (Road)
 	{
+		if (ARoadScene* Scene = Road->GetScene())
+		{
+			Scene->RemovePropInstances(Road);
+			Scene->UpdatePropCells();
+		}
 		Road->DeleteAllMarkings();
 		Road->Destroy();
 		Road = nullptr;
@@ -124,11 +130,7 @@ void FJunctionSlot::Combine(FJunctionSlot& Other)
 
 AJunctionActor::AJunctionActor(const FObjectInitializer& ObjectInitializer) : Super(ObjectInitializer)
 {
-#if USE_PROC_ROAD_MESH
-	RootComponent = CreateDefaultSubobject<UProceduralMeshComponent>(TEXT("RootComponent"));
-#else
 	RootComponent = CreateDefaultSubobject<URoadMeshComponent>(TEXT("RootComponent"));
-#endif
 }
 
 void AJunctionActor::AddRoad(ARoadActor* Road, double Dist)
@@ -428,7 +430,7 @@ void AJunctionActor::Build()
 		}
 	}
 	BuildGoreMarkings();
-	FRoadMesh Builder;
+	TUniquePtr<FRoadMesh> Builder = FRoadMesh::Create(GetScene()->MeshBackend);
 	TArray<FVector> Points;
 	TArray<FVector> CornerPoints;
 	TMap<ULaneShape*, int> Shapes;
@@ -455,8 +457,11 @@ void AJunctionActor::Build()
 	{
 		Shapes.ValueSort([](int A, int B)->bool {return A > B; });
 		ULaneShape* Shape = TMap<ULaneShape*, int>::TIterator(Shapes)->Key;
-		Builder.AddPolygon(Shape->GetSurfaceMaterial(), Shape->GetBackfaceMaterial(), Points);
-		Builder.Build(GetRootComponent());
+		MeshStats = Builder->AddPolygon(Shape->GetSurfaceMaterial(), Shape->GetBackfaceMaterial(), Points, Refinement);
+		Builder->Build(GetRootComponent());
+		SurfaceHash = HashCombine(FCrc::MemCrc32(Points.GetData(), Points.Num() * Points.GetTypeSize()), GetTypeHash(GetScene()->MeshBackend));
+		SurfaceHash = HashCombine(SurfaceHash, HashCombine(GetTypeHash(Refinement.MinAngle), GetTypeHash(Refinement.MaxTriangleArea)));
+		SurfaceHash = HashCombine(SurfaceHash, HashCombine(GetTypeHash(Refinement.MaxHeightDeviation), GetTypeHash(Refinement.MaxVertices)));
 		//Markings depend on junction Mesh so build later
 		for (FJunctionGate& Gate : Gates)
 		{
@@ -561,10 +566,15 @@ bool AJunctionActor::Contains(ARoadActor* Road, double Dist)
 }
 
 void AJunctionActor::FixHeight(FPolyline& Polyline)
+{
+	FixHeight(Polyline.Points);
+}
+
+void AJunctionActor::FixHeight(TArray<FPolyPoint>& Points)
 {
 	FVector Delta(0, 0, 10000);
-	UStaticMeshComponent* MC = Cast<UStaticMeshComponent>(RootComponent);
-	for (FPolyPoint& Point : Polyline.Points)
+	UPrimitiveComponent* MC = FRoadMesh::GetMeshComponent(RootComponent);
+	for (FPolyPoint& Point : Points)
 	{
 		FHitResult Hit;
 		if (MC->LineTraceComponent(Hit, Point.Pos + Delta, Point.Pos - Delta, FCollisionQueryParams()))
@@ -575,7 +585,7 @@ void AJunctionActor::FixHeight(FPolyline& Polyline)
 void AJunctionActor::FixHeight(TArray<FVector>& Points)
 {
 	FVector Delta(0, 0, 10000);
-	UStaticMeshComponent* MC = Cast<UStaticMeshComponent>(RootComponent);
+	UPrimitiveComponent* MC = FRoadMesh::GetMeshComponent(RootComponent);
 	for (FVector& Point : Points)
 	{
 		FHitResult Hit;
@@ -1097,16 +1107,55 @@ void ARoadScene::Rebuild()
 		Junction->Build();
 	for (ARoadActor* Road : Roads)
 		Road->BuildMesh(RoadSlots[Road]);
+	UpdatePropCells();
 	GenerateGrounds(RoadSlots);
 	for (AGroundActor* Ground : Grounds)
 	{
 		Ground->BuildMesh(RoadSlots);
 	}
+	if (bGeneratePCGSplines)
+		UpdatePCGSplines(RoadSlots);
+}
+
+void ARoadScene::GeneratePCGSplines()
+{
+	TMap<ARoadActor*, TArray<FJunctionSlot>> RoadSlots = GetAllJunctionSlots();
+	UpdatePCGSplines(RoadSlots);
+}
+
+void ARoadScene::UpdatePCGSplines(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadSlots)
+{
+	for (AGroundActor* Ground : Grounds)
+		if (Ground->bClosedLoop)
+			Ground->UpdatePCGSpline(RoadSlots);
+}
+
+//Road points of a loop in order, closed loops start from their smallest point, manual points are left out
+static uint32 GetLoopSignature(const TArray<FGroundPoint>& Points, bool bClosedLoop)
+{
+	TArray<const FGroundPoint*> RoadPoints;
+	for (const FGroundPoint& Point : Points)
+		if (Point.Road)
+			RoadPoints.Add(&Point);
+	auto Less = [](const FGroundPoint& A, const FGroundPoint& B)
+	{
+		if (A.Road != B.Road)
+			return UPTRINT(A.Road) < UPTRINT(B.Road);
+		return (A.Side << 16 | A.Index) < (B.Side << 16 | B.Index);
+	};
+	int Start = 0;
+	if (bClosedLoop)
+		for (int i = 1; i < RoadPoints.Num(); i++)
+			if (Less(*RoadPoints[i], *RoadPoints[Start]))
+				Start = i;
+	uint32 Hash = GetTypeHash(RoadPoints.Num());
+	for (int i = 0; i < RoadPoints.Num(); i++)
+		Hash = HashCombine(Hash, GetTypeHash(*RoadPoints[(Start + i) % RoadPoints.Num()]));
+	return Hash;
 }
 
 void ARoadScene::GenerateGrounds(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadSlots)
 {
-	TSet<FGroundPoint> VisitedGroundPoints;
 	TMap<ARoadActor*, int> PrevSlots;
 	//Check slot count match
 	for (AGroundActor* Ground : Grounds)
@@ -1147,6 +1196,18 @@ void ARoadScene::GenerateGrounds(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadS
 			i++;
 		}
 	}
+	//Ground points are nodes of a planar graph, each links to its neighbours along road borders and around junction corners
+	TArray<FGroundPoint> Nodes;
+	TArray<int> PrevIds, NextIds, Seeds;
+	TMap<FGroundPoint, int> NodeIds;
+	auto GetNode = [&](const FGroundPoint& Point)
+	{
+		if (int* Id = NodeIds.Find(Point))
+			return *Id;
+		PrevIds.Add(INDEX_NONE);
+		NextIds.Add(INDEX_NONE);
+		return NodeIds.Add(Point, Nodes.Add(Point));
+	};
 	for (ARoadActor* Road : Roads)
 	{
 		if (!Road->bHasGround || FMath::IsNearlyZero(Road->Length()))
@@ -1162,35 +1223,65 @@ void ARoadScene::GenerateGrounds(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadS
 						continue;
 				}
 				for (int j = 0; j < 2; j++)
-				{
-					FGroundPoint Point = { Road, Side, i*2+j };
-					if (VisitedGroundPoints.Contains(Point))
-						continue;
-					TArray<FGroundPoint> Points = { Point };
-					VisitedGroundPoints.Add(Point);
-					while (true)
-					{
-						FGroundPoint Prev = Points[0].PrevPoint(RoadSlots);
-						if (!Prev.Road || VisitedGroundPoints.Contains(Prev))
-							break;
-						Points.Insert(Prev, 0);
-						VisitedGroundPoints.Add(Prev);
-					}
-					while (true)
-					{
-						FGroundPoint Next = Points.Last().NextPoint(RoadSlots);
-						if (!Next.Road || VisitedGroundPoints.Contains(Next))
-							break;
-						Points.Add(Next);
-						VisitedGroundPoints.Add(Next);
-					}
-					AGroundActor* Ground = AddGround(RoadSlots, Points);
-					if (Points.Last().NextPoint(RoadSlots) == Points[0])
-						Ground->bClosedLoop = true;
-				}
+					Seeds.Add(GetNode({ Road, Side, i * 2 + j }));
 			}
 		}
 	}
+	//Nodes reached through junctions are appended and linked in the same pass
+	for (int Id = 0; Id < Nodes.Num(); Id++)
+	{
+		FGroundPoint Prev = Nodes[Id].PrevPoint(RoadSlots);
+		if (Prev.Road)
+			PrevIds[Id] = GetNode(Prev);
+		FGroundPoint Next = Nodes[Id].NextPoint(RoadSlots);
+		if (Next.Road)
+			NextIds[Id] = GetNode(Next);
+	}
+	//Existing grounds are matched by signature, Contains is only the fallback for joined or edited grounds
+	TMap<uint32, AGroundActor*> Signatures;
+	for (AGroundActor* Ground : Grounds)
+		Signatures.Add(GetLoopSignature(Ground->Points, Ground->bClosedLoop), Ground);
+	TBitArray<> Visited(false, Nodes.Num());
+	TArray<int> Head, Tail;
+	for (int Seed : Seeds)
+	{
+		if (Visited[Seed])
+			continue;
+		Visited[Seed] = true;
+		Head.Reset();
+		Tail.Reset();
+		for (int Id = PrevIds[Seed]; Id != INDEX_NONE && !Visited[Id]; Id = PrevIds[Id])
+		{
+			Head.Add(Id);
+			Visited[Id] = true;
+		}
+		for (int Id = NextIds[Seed]; Id != INDEX_NONE && !Visited[Id]; Id = NextIds[Id])
+		{
+			Tail.Add(Id);
+			Visited[Id] = true;
+		}
+		TArray<FGroundPoint> Points;
+		Points.Reserve(Head.Num() + 1 + Tail.Num());
+		for (int i = Head.Num() - 1; i >= 0; i--)
+			Points.Add(Nodes[Head[i]]);
+		Points.Add(Nodes[Seed]);
+		for (int Id : Tail)
+			Points.Add(Nodes[Id]);
+		int First = Head.Num() ? Head.Last() : Seed;
+		int Last = Tail.Num() ? Tail.Last() : Seed;
+		bool bClosedLoop = NextIds[Last] == First;
+		AGroundActor** Found = Signatures.Find(GetLoopSignature(Points, bClosedLoop));
+		AGroundActor* Ground;
+		if (Found && (*Found)->IsExpired() && (*Found)->Contains(RoadSlots, Points))
+		{
+			Ground = *Found;
+			Ground->Renew();
+		}
+		else
+			Ground = AddGround(RoadSlots, Points);
+		if (bClosedLoop)
+			Ground->bClosedLoop = true;
+	}
 	for (int i = 0; i < Grounds.Num();)
 	{
 		AGroundActor* Ground = Grounds[i];
@@ -1236,19 +1327,183 @@ void ARoadScene::OctreeRemoveRoad(ARoadActor* Road)
 void ARoadScene::DestroyRoad(ARoadActor* Road)
 {
 	OctreeRemoveRoad(Road);
+	RemovePropInstances(Road);
+	UpdatePropCells();
 	Road->DeleteAllMarkings();
 	Road->DisconnectAll();
 	Road->Destroy();
 	Roads.Remove(Road);
 }
 
+void ARoadScene::SetPropInstances(ARoadActor* Road, FInstanceBuilder& Builder)
+{
+	RemovePropInstances(Road);
+	if (!bMergePropInstances)
+		return;
+	FTransform RoadToScene = Road->GetActorTransform().GetRelativeTransform(GetActorTransform());
+	TSet<int>& Cells = RoadPropCells.FindOrAdd(Road);
+	for (auto It = Builder.Instances.CreateIterator(); It; ++It)
+	{
+		//Forced ISM instances need per instance control and stay on the road
+		if (It->Value.bForceISM)
+			continue;
+		for (const FTransform& Instance : It->Value.Instances)
+		{
+			FTransform Trans = Instance * RoadToScene;
+			FVector Pos = Trans.GetLocation();
+			FIntPoint Coord(FMath::FloorToInt(Pos.X / PropCellSize), FMath::FloorToInt(Pos.Y / PropCellSize));
+			FPropCell::FKey Key(It->Key.Key, It->Key.Value, Coord);
+			int* Index = PropCellIndices.Find(Key);
+			if (!Index)
+			{
+				FPropCell& Cell = PropCells.AddDefaulted_GetRef();
+				Cell.Mesh = It->Key.Key;
+				Cell.Material = It->Key.Value;
+				Cell.Coord = Coord;
+				Index = &PropCellIndices.Add(Key, PropCells.Num() - 1);
+			}
+			FPropRoadInstances& RoadInstances = PropCells[*Index].Roads.FindOrAdd(Road);
+			RoadInstances.Transforms.Add(Trans);
+			RoadInstances.CullDistance = It->Value.CullDistance;
+			RoadInstances.bDensityScaling = It->Value.bDensityScaling;
+			Cells.Add(*Index);
+			DirtyPropCells.FindOrAdd(*Index).Add(Road);
+		}
+		It.RemoveCurrent();
+	}
+}
+
+void ARoadScene::RemovePropInstances(ARoadActor* Road)
+{
+	TSet<int> Cells;
+	if (RoadPropCells.RemoveAndCopyValue(Road, Cells))
+	{
+		for (int Index : Cells)
+		{
+			PropCells[Index].Roads.Remove(Road);
+			DirtyPropCells.FindOrAdd(Index).Add(Road);
+		}
+	}
+}
+
+void ARoadScene::UpdatePropCells()
+{
+	for (auto& Dirty : DirtyPropCells)
+	{
+		FPropCell& Cell = PropCells[Dirty.Key];
+		TSet<ARoadActor*>& ChangedRoads = Dirty.Value;
+		double CullDistance = -1;
+		bool bDensityScaling = false;
+		int NumInstances = 0;
+		for (auto It = Cell.Roads.CreateIterator(); It; ++It)
+		{
+			if (IsValid(It->Key))
+			{
+				NumInstances += It->Value.Transforms.Num();
+				CullDistance = FInstanceBuilder::FInstances::MergeCullDistance(CullDistance, It->Value.CullDistance);
+				bDensityScaling |= It->Value.bDensityScaling;
+			}
+			else
+			{
+				ChangedRoads.Add(It->Key);
+				It.RemoveCurrent();
+			}
+		}
+		//Empty cells keep their slot so indices stay valid, only the component goes away
+		if (!NumInstances)
+		{
+			if (Cell.Component)
+			{
+				RemoveInstanceComponent(Cell.Component);
+				Cell.Component->DestroyComponent();
+				Cell.Component = nullptr;
+			}
+			Cell.Owners.Empty();
+			continue;
+		}
+		if (!Cell.Component)
+		{
+			Cell.Component = NewObject<UHierarchicalInstancedStaticMeshComponent>(this);
+			Cell.Component->SetReceivesDecals(false);
+			Cell.Component->SetStaticMesh(Cell.Mesh);
+			if (Cell.Material)
+				Cell.Component->SetMaterial(0, Cell.Material);
+			Cell.Component->AttachToComponent(GetRootComponent(), FAttachmentTransformRules::KeepRelativeTransform);
+			AddInstanceComponent(Cell.Component);
+			Cell.Component->RegisterComponent();
+			Cell.Owners.Empty();
+		}
+		FInstanceBuilder::SetupComponent(Cell.Component, CullDistance, bDensityScaling);
+		if (Cell.Component->GetInstanceCount() != Cell.Owners.Num())
+		{
+			//Owners out of sync with the component, start over with all roads
+			Cell.Component->ClearInstances();
+			Cell.Owners.Empty();
+			ChangedRoads.Empty();
+			for (auto& KV : Cell.Roads)
+				ChangedRoads.Add(KV.Key);
+		}
+		//Instances of changed roads are removed by moving the last instance into their slot, so removal never depends on how the component reorders
+		bool bMoved = false;
+		for (int i = Cell.Owners.Num() - 1; i >= 0; i--)
+		{
+			if (IsValid(Cell.Owners[i]) && !ChangedRoads.Contains(Cell.Owners[i]))
+				continue;
+			int Last = Cell.Owners.Num() - 1;
+			if (i != Last)
+			{
+				FTransform Trans;
+				Cell.Component->GetInstanceTransform(Last, Trans);
+				Cell.Component->UpdateInstanceTransform(i, Trans, false, false, true);
+				Cell.Owners[i] = Cell.Owners[Last];
+				bMoved = true;
+			}
+			Cell.Component->RemoveInstance(Last);
+			Cell.Owners.Pop(false);
+		}
+		for (ARoadActor* Road : ChangedRoads)
+		{
+			if (FPropRoadInstances* RoadInstances = IsValid(Road) ? Cell.Roads.Find(Road) : nullptr)
+			{
+				Cell.Component->AddInstances(RoadInstances->Transforms, false);
+				for (int i = 0; i < RoadInstances->Transforms.Num(); i++)
+					Cell.Owners.Add(Road);
+			}
+		}
+		if (bMoved)
+			Cell.Component->MarkRenderStateDirty();
+	}
+	DirtyPropCells.Empty();
+}
+
+void ARoadScene::UpdatePropCellIndices()
+{
+	//Lookup tables are transient, rebuilt whenever PropCells is restored from serialized data
+	PropCellIndices.Empty(PropCells.Num());
+	RoadPropCells.Empty();
+	for (int i = 0; i < PropCells.Num(); i++)
+	{
+		PropCellIndices.Add(PropCells[i].GetKey(), i);
+		for (auto& KV : PropCells[i].Roads)
+			RoadPropCells.FindOrAdd(KV.Key).Add(i);
+	}
+}
+
 void ARoadScene::PostLoad()
 {
 	AActor::PostLoad();
 	for (ARoadActor* Road : Roads)
 		OctreeAddRoad(Road);
+	UpdatePropCellIndices();
 }
 #if WITH_EDITOR
+void ARoadScene::PostEditUndo()
+{
+	AActor::PostEditUndo();
+	UpdatePropCellIndices();
+	DirtyPropCells.Empty();
+}
+
 #include "DesktopPlatformModule.h"
 void ARoadScene::ExportXodr()
 {
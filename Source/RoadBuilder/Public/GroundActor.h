@@ -4,6 +4,7 @@
 #pragma once
 #include "CoreMinimal.h"
 #include "RoadActor.h"
+#include "Heightfield.h"
 #include "PCGGraph.h"
 #include "PCGComponent.h"
 #include "GroundActor.generated.h"
@@ -52,12 +53,16 @@ public:
 	void Destroy();
 	void Join(AGroundActor* Other, int& Index);
 	void BuildMesh(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadSlots);
+	void BuildTiles(const TArray<FVector>& Vertices);
+	void SetTileComponents(int Num);
+	FHeightSampler GetBaseHeights();
 	bool Contains(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadSlots, const TArray<FGroundPoint>& OtherPoints);
 	ARoadScene* GetScene();
 	TArray<FVector> GetVertices(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadSlots);
 	
 	UFUNCTION(CallInEditor, Category = Ground)
 	void CreatePCGSpline();
+	void UpdatePCGSpline(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadSlots);
 #if WITH_EDITOR
 	virtual void PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent);
 #endif
@@ -80,6 +85,27 @@ public:
 	UPROPERTY(EditAnywhere, Category = Ground)
 	UMaterialInterface* Material;
 
+	UPROPERTY(EditAnywhere, Category = Ground)
+	FPolygonRefinement Refinement;
+
+	//Interior heights follow this terrain and blend into the road borders
+	UPROPERTY(EditAnywhere, Category = Ground)
+	FHeightfieldSource Heightfield;
+
+	//Maximum distance (cm) between the sampled border and the exact curves, also used to drop collinear vertices, 0 keeps every vertex
+	UPROPERTY(EditAnywhere, Category = Ground, meta = (ClampMin = 0))
+	double BorderTolerance = 2;
+
+	//Splits the ground into a grid of separately built meshes, 0 builds a single mesh
+	UPROPERTY(EditAnywhere, Category = Ground, meta = (ClampMin = 0))
+	double TileSize = 0;
+
+	UPROPERTY(VisibleAnywhere, Transient, Category = Ground)
+	FPolygonStats MeshStats;
+
+	UPROPERTY()
+	TArray<URoadMeshComponent*> TileComponents;
+
 	UPROPERTY()
 	TArray<FVector> ManualPoints;
 
@@ -0,0 +1,78 @@
+// Publisher: Fullike (https://github.com/fullike)
+// Copyright 2024. All Rights Reserved.
+
+#pragma once
+#include "CoreMinimal.h"
+#include "Heightfield.generated.h"
+
+class AGeoReferencingSystem;
+class IMappedFileHandle;
+class IMappedFileRegion;
+
+//Elevation raster accessed through a memory mapped file, pages are only touched where samples are taken so large DEMs are never fully loaded.
+//ESRI ASCII grids are converted once into a tiled binary cache under Saved, uncompressed GeoTIFFs (strips or tiles) are mapped directly.
+class ROADBUILDER_API FHeightfield
+{
+public:
+	~FHeightfield();
+	static TSharedPtr<FHeightfield> Load(const FString& Path);
+	//Bilinear elevation at projected coordinates, false where the raster has no data
+	bool GetHeight(const FVector2D& Pos, double& Height) const;
+	void GetHeights(const TArray<FVector2D>& Positions, TArray<double>& Heights, TBitArray<>& Valid) const;
+private:
+	enum class ESampleFormat : uint8
+	{
+		Int16,
+		UInt16,
+		Int32,
+		UInt32,
+		Float32,
+		Float64,
+	};
+	bool LoadAsciiGrid(const FString& Path);
+	bool LoadGeoTiff(const FString& Path);
+	bool MapFile(const FString& Path);
+	bool GetSample(int X, int Y, double& Value) const;
+
+	TUniquePtr<IMappedFileHandle> FileHandle;
+	TUniquePtr<IMappedFileRegion> FileRegion;
+	const uint8* Data = nullptr;
+	int64 DataSize = 0;
+	int NumCols = 0;
+	int NumRows = 0;
+	//Strips are handled as tiles spanning the whole width
+	int TileWidth = 0;
+	int TileHeight = 0;
+	int TilesAcross = 0;
+	TArray<uint64> TileOffsets;
+	ESampleFormat Format = ESampleFormat::Float32;
+	int SampleSize = 4;
+	int PixelStride = 4;
+	bool bSwapBytes = false;
+	//Projected coordinates of the top left corner of pixel (0, 0), rows go southwards
+	FVector2D Origin = FVector2D::ZeroVector;
+	FVector2D CellSize = FVector2D::UnitVector;
+	double NoData = 0;
+	bool bHasNoData = false;
+};
+
+USTRUCT()
+struct ROADBUILDER_API FHeightfieldSource
+{
+	GENERATED_USTRUCT_BODY()
+	bool IsValid() const { return !File.FilePath.IsEmpty(); }
+	//Replaces Z of engine space positions with the elevation in the raster, positions without data keep their Z.
+	//The raster is expected in the projected CRS of the georeferencing system, in meters
+	bool SampleHeights(AGeoReferencingSystem* GeoReferencing, TArray<FVector>& Positions) const;
+
+	UPROPERTY(EditAnywhere, Category = Heightfield, meta = (FilePathFilter = "DEM (*.asc;*.tif;*.tiff)|*.asc;*.tif;*.tiff"))
+	FFilePath File;
+
+	//Added to sampled elevations (cm)
+	UPROPERTY(EditAnywhere, Category = Heightfield)
+	double HeightOffset = 0;
+private:
+	//Keeps the mapping alive between builds, reloaded when File changes
+	mutable TSharedPtr<FHeightfield> Loaded;
+	mutable FString LoadedPath;
+};
@@ -25,6 +25,10 @@ class ROADBUILDER_API UBaseMarkStyle : public UObject
 	GENERATED_BODY()
 public:
 	virtual void BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPolyline& Curve) {}
+	virtual void Build(UObject* Caller, FRoadActorBuilder& Builder, const FPolyline& Curve)
+	{
+		BuildMesh(Caller, Builder.GetMarkingBuilder(), Curve);
+	}
 	UPROPERTY(EditAnywhere, Category = Style)
 	UMaterialInterface* Material = nullptr;
 };
@@ -35,6 +39,10 @@ class ROADBUILDER_API ULaneMarkStyle : public UBaseMarkStyle
 	GENERATED_BODY()
 public:
 	virtual void BuildMesh(UObject* Caller, FRoadMesh& Builder, const FPolyline& Curve);
+	virtual void Build(UObject* Caller, FRoadActorBuilder& Builder, const FPolyline& Curve);
+	//Phase is the arc length of the boundary built before Curve so dashes continue across pieces, reversed curves run back towards that part
+	void BuildBoundary(UObject* Caller, FRoadActorBuilder& Builder, const FPolyline& Curve, double& Phase, bool bReversed);
+	void BuildMarks(UObject* Caller, FRoadMesh& Builder, FInstanceBuilder* InstanceBuilder, const FPolyline& Curve, double& Phase, bool bReversed);
 	FString GetXodrType()
 	{
 		if (MarkType == ELaneMarkType::Dash) return TEXT("broken");
@@ -69,6 +77,18 @@ public:
 
 	UPROPERTY(EditAnywhere, Category = Style)
 	double DashSpacing = 150.f;
+
+	//Emit nearly straight dashes as instances of DashMesh instead of road mesh triangles
+	UPROPERTY(EditAnywhere, Category = Instancing)
+	bool bInstancedDashes = false;
+
+	//Flat mesh centered in XY plane, scaled to dash length along X and width along Y
+	UPROPERTY(EditAnywhere, Category = Instancing, meta = (EditCondition = "bInstancedDashes"))
+	TSoftObjectPtr<UStaticMesh> DashMesh = TSoftObjectPtr<UStaticMesh>(FSoftObjectPath(TEXT("/Engine/BasicShapes/Plane.Plane")));
+
+	//Dashes bending more than this (1 / radius) are built as strips
+	UPROPERTY(EditAnywhere, Category = Instancing, meta = (EditCondition = "bInstancedDashes"))
+	double MaxDashCurvature = 0.0001;
 };
 
 UCLASS()
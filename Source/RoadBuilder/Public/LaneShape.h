@@ -45,6 +45,7 @@ public:
 	UMaterialInterface* GetSurfaceMaterial();
 	UMaterialInterface* GetBackfaceMaterial();
 	void BuildMesh(FRoadMesh& Builder, const FPolyline& LeftCurve, const FPolyline& RightCurve, bool SkipLeftBorder, bool SkipRightBorder);
+	void BuildCollision(FRoadMesh& Builder, const FPolyline& LeftCurve, const FPolyline& RightCurve);
 
 	UPROPERTY(EditAnywhere, Category = Shape)
 	TArray<FLaneCrossSection> CrossSections;
@@ -5,6 +5,7 @@
 #include "CoreMinimal.h"
 #include "GeoReferencingSystem.h"
 #include "RoadCurve.h"
+#include "Heightfield.h"
 #include "OSMActor.generated.h"
 
 class AOSMActor;
@@ -17,7 +18,6 @@ struct ROADBUILDER_API FOSMElement
 public:
 	GENERATED_USTRUCT_BODY()
 	FOSMElement() {}
-	FOSMElement(const FXmlNode* Node);
 	/*
 	FString GetStr(const TCHAR* Key)const
 	{
@@ -48,19 +48,16 @@ public:
 	TMap<FName, FString> Tags;
 };
 
+//Element records are only used while reading and for the properties dialog, the actor keeps them in FOSMData
 USTRUCT()
 struct ROADBUILDER_API FOSMNode :public FOSMElement
 {
 public:
 	GENERATED_USTRUCT_BODY()
 	FOSMNode() {}
-	FOSMNode(const FXmlNode* Node);
-	void Build(AOSMActor* OSM);
 	
 	UPROPERTY(EditAnywhere, Category = Node)
 	FVector2D Lonlat;
-	FVector Pos;
-	TArray<uint64> Ways;
 };
 
 USTRUCT()
@@ -69,16 +66,8 @@ struct ROADBUILDER_API FOSMWay :public FOSMElement
 public:
 	GENERATED_USTRUCT_BODY()
 	FOSMWay() {}
-	FOSMWay(const FXmlNode* Node);
-	void AttachTo(FOSMWay* MainRoad, int NodeIndex, int RampIndex);
-	void Build(AOSMActor* OSM);
-	bool IsDrivable();
-	double GetInputRadian(AOSMActor* OSM, int Index);
-	double GetOutputRadian(AOSMActor* OSM, int Index);
 	UPROPERTY(EditAnywhere, Category = Way)
 	TArray<uint64> Nodes;
-	FPolyline Curve;
-	ARoadActor* Road = nullptr;
 };
 
 USTRUCT()
@@ -87,7 +76,6 @@ struct ROADBUILDER_API FOSMRelation :public FOSMElement
 public:
 	GENERATED_USTRUCT_BODY()
 	FOSMRelation() {}
-	FOSMRelation(const FXmlNode* Node);
 
 	UPROPERTY(EditAnywhere, Category = Relation)
 	TMap<uint64, FName> Nodes;
@@ -99,19 +87,148 @@ public:
 	TMap<uint64, FName> Relations;
 };
 
+//Elements stored as flat arrays, element i of a kind is described by entry i of its arrays.
+//Variable length lists use offset arrays holding Num + 1 entries, the list of element i is [Offsets[i], Offsets[i + 1]).
+//Tag keys and values are interned, a tag is the pair of indices (Key, Value) into TagKeys and TagValues
+USTRUCT()
+struct ROADBUILDER_API FOSMData
+{
+	GENERATED_USTRUCT_BODY()
+	enum EMemberType : uint8
+	{
+		Member_Node,
+		Member_Way,
+		Member_Relation,
+	};
+	//Elements with an id that is already stored are ignored
+	void AddNode(const FOSMNode& Node);
+	void AddWay(const FOSMWay& Way);
+	void AddRelation(const FOSMRelation& Relation);
+	//Rebuilds lookups and adjacency, must be called after loading or adding elements
+	void Link();
+	int32 FindNode(uint64 Id) const { const int32* Index = NodeIndices.Find(Id); return Index ? *Index : INDEX_NONE; }
+	int32 FindWay(uint64 Id) const { const int32* Index = WayIndices.Find(Id); return Index ? *Index : INDEX_NONE; }
+	int32 NumNodes() const { return NodeIds.Num(); }
+	int32 NumWays() const { return WayIds.Num(); }
+	//Indices of the nodes of a way, references to nodes that were not loaded are left out
+	TArrayView<const int32> GetWayNodes(int32 Way) const { return MakeArrayView(WayNodes.GetData() + WayNodeOffsets[Way], WayNodeOffsets[Way + 1] - WayNodeOffsets[Way]); }
+	//Indices of the ways passing a node, each way once, in increasing order
+	TArrayView<const int32> GetNodeWays(int32 Node) const { return MakeArrayView(NodeWays.GetData() + NodeWayOffsets[Node], NodeWayOffsets[Node + 1] - NodeWayOffsets[Node]); }
+	int32 GetNodeWayOffset(int32 Node) const { return NodeWayOffsets[Node]; }
+	//Index into TagValues of the tag Key of each way, INDEX_NONE where a way doesn't have it
+	void GetWayColumn(FName Key, TArray<int32>& Column) const;
+	void GetWayInts(FName Key, TArray<int32>& Result) const;
+	//Flags ways whose tag Key has one of Values
+	void FilterWays(FName Key, const TArray<FString>& Values, TArray<bool>& Result) const;
+	FOSMWay GetWay(int32 Way) const;
+	//Replaces node refs and tags of a way, its id is kept. Link must be called afterwards
+	void SetWay(int32 Way, const FOSMWay& Record);
+
+	UPROPERTY()
+	TArray<FName> TagKeys;
+
+	UPROPERTY()
+	TArray<FString> TagValues;
+
+	UPROPERTY()
+	TArray<uint64> NodeIds;
+
+	UPROPERTY()
+	TArray<FVector2D> NodeLonlats;
+
+	UPROPERTY()
+	TArray<int32> NodeTagOffsets;
+
+	UPROPERTY()
+	TArray<FIntPoint> NodeTags;
+
+	UPROPERTY()
+	TArray<uint64> WayIds;
+
+	UPROPERTY()
+	TArray<int32> WayRefOffsets;
+
+	//Node ids as read, resolved into WayNodes by Link
+	UPROPERTY()
+	TArray<uint64> WayRefs;
+
+	UPROPERTY()
+	TArray<int32> WayTagOffsets;
+
+	UPROPERTY()
+	TArray<FIntPoint> WayTags;
+
+	UPROPERTY()
+	TArray<uint64> RelationIds;
+
+	UPROPERTY()
+	TArray<int32> RelationMemberOffsets;
+
+	UPROPERTY()
+	TArray<uint64> RelationMembers;
+
+	UPROPERTY()
+	TArray<uint8> RelationMemberTypes;
+
+	//Index into TagKeys
+	UPROPERTY()
+	TArray<int32> RelationMemberRoles;
+
+	UPROPERTY()
+	TArray<int32> RelationTagOffsets;
+
+	UPROPERTY()
+	TArray<FIntPoint> RelationTags;
+private:
+	int32 InternKey(FName Key);
+	int32 InternValue(const FString& Value);
+	void AddTags(const TMap<FName, FString>& Tags, TArray<int32>& Offsets, TArray<FIntPoint>& Dest);
+	void BuildLookups();
+
+	TMap<FName, int32> KeyIndices;
+	TMap<FString, int32> ValueIndices;
+	TMap<uint64, int32> NodeIndices;
+	TMap<uint64, int32> WayIndices;
+	TMap<uint64, int32> RelationIndices;
+	TArray<int32> WayNodeOffsets;
+	TArray<int32> WayNodes;
+	TArray<int32> NodeWayOffsets;
+	TArray<int32> NodeWays;
+};
+
+//A way passing a node, Index is the first position of the node in the way
+struct FOSMWaySlot
+{
+	int32 Way;
+	int32 Index;
+	double InputRadian;
+	double OutputRadian;
+	bool bHasInput;
+	bool bHasOutput;
+};
+
 UCLASS()
 class ROADBUILDER_API AOSMActor : public AGeoReferencingSystem
 {
 	GENERATED_UCLASS_BODY()
 public:
-	void AddNode(const FXmlNode* XmlNode);
-	void AddWay(const FXmlNode* XmlNode);
-	void AddRelation(const FXmlNode* XmlNode);
-	void AnalyzeIntersection(uint64 NodeId, double R, TArray<FOSMWay*>& Inputs, TArray<FOSMWay*>& Outputs);
+	void AddNode(FOSMNode&& Node);
+	void AddWay(FOSMWay&& Way);
+	void AddRelation(FOSMRelation&& Relation);
+	void AnalyzeIntersection(int32 Node, double R, TArray<int32>& Inputs, TArray<int32>& Outputs);
+	void AttachTo(int32 Way, int32 MainWay, int NodeIndex, int RampIndex);
 	void Build();
+	void BuildWay(int32 Way);
+	void BuildSlots();
+	TArrayView<const FOSMWaySlot> GetNodeSlots(int32 Node) const { return MakeArrayView(NodeSlots.GetData() + Data.GetNodeWayOffset(Node), Data.GetNodeWays(Node).Num()); }
+	double GetInputRadian(int32 Way, int Index);
+	double GetOutputRadian(int32 Way, int Index);
+	//Projects many points at once, areas where a quadratic patch through exactly projected samples stays within ProjectionTolerance are interpolated in parallel
+	void LonlatsToEngine(const TArray<FVector2D>& Lonlats, TArray<FVector>& Positions);
 	void CreateRoad(uint64 Id);
-	void CreateRoad(ARoadScene* Scene, uint64 Id);
-	void LoadContent(const FString& Content);
+	void CreateRoad(ARoadScene* Scene, int32 Way);
+	void LoadContent(const TArray<uint8>& Content);
+	bool LoadContentFromFile(const FString& Path);
 	FBox2D GetTileBounds()
 	{
 		double Half = TileSize / 2;
@@ -135,17 +252,38 @@ public:
 	UPROPERTY(EditAnywhere, Category = OSM)
 	double TileSize = 51200;
 
+	//Elevation of nodes and road heights, roads are flat apart from layers without it
 	UPROPERTY(EditAnywhere, Category = OSM)
-	TMap<uint64, FOSMNode> Nodes;
+	FHeightfieldSource Heightfield;
 
+	//Max error of interpolated node positions (cm), nodes are projected one by one when 0
 	UPROPERTY(EditAnywhere, Category = OSM)
-	TMap<uint64, FOSMWay> Ways;
+	double ProjectionTolerance = 1;
 
-	UPROPERTY(EditAnywhere, Category = OSM)
-	TMap<uint64, FOSMRelation> Relations;
+	UPROPERTY()
+	FOSMData Data;
+
+	//Element maps of levels saved before FOSMData, moved into Data on load
+	UPROPERTY()
+	TMap<uint64, FOSMNode> Nodes_DEPRECATED;
+
+	UPROPERTY()
+	TMap<uint64, FOSMWay> Ways_DEPRECATED;
+
+	UPROPERTY()
+	TMap<uint64, FOSMRelation> Relations_DEPRECATED;
 
 	UPROPERTY(EditAnywhere, Category = OSM)
 	TArray<uint64> DebugIds;
+
+	//Built from Data, indexed like its nodes and ways
+	TArray<FVector> NodePositions;
+	TArray<FPolyline> WayCurves;
+	TArray<ARoadActor*> WayRoads;
+	TArray<bool> DrivableWays;
+	TArray<int32> WayLayers;
+	//Parallel to the node->ways lists of Data
+	TArray<FOSMWaySlot> NodeSlots;
 };
 
 UCLASS()
@@ -0,0 +1,68 @@
+// Publisher: Fullike (https://github.com/fullike)
+// Copyright 2024. All Rights Reserved.
+
+#pragma once
+#include "CoreMinimal.h"
+#include "OSMActor.h"
+
+//Streaming reader of .osm XML, elements are added to the actor as soon as their closing tag is seen.
+//Only the current chunk and one unfinished tag are kept in memory, there is no DOM.
+class ROADBUILDER_API FOSMXmlReader
+{
+public:
+	FOSMXmlReader(AOSMActor* InOSM) :OSM(InOSM) {}
+	bool ReadFile(const FString& Path);
+	void Read(const uint8* Data, int64 Size);
+private:
+	struct FAttribute
+	{
+		const ANSICHAR* Name;
+		int NameLen;
+		const ANSICHAR* Value;
+		int ValueLen;
+		bool Is(const ANSICHAR* Str) const;
+	};
+	enum class EElement : uint8
+	{
+		None,
+		Node,
+		Way,
+		Relation,
+	};
+	//Parses all complete tags, returns the number of bytes consumed
+	int64 Parse(const uint8* Data, int64 Size, bool bFinal);
+	void HandleTag(const ANSICHAR* Tag, int64 Len);
+	void FinishElement();
+	static FString Decode(const ANSICHAR* Value, int Len);
+	static uint64 ParseId(const ANSICHAR* Value);
+
+	AOSMActor* OSM;
+	EElement Current = EElement::None;
+	FOSMNode Node;
+	FOSMWay Way;
+	FOSMRelation Relation;
+	TArray<FAttribute> Attributes;
+};
+
+//Reader of .osm.pbf extracts, blobs are read in batches and decoded on all cores, then added to the actor in file order
+class ROADBUILDER_API FOSMPbfReader
+{
+public:
+	FOSMPbfReader(AOSMActor* InOSM) :OSM(InOSM) {}
+	bool ReadFile(const FString& Path);
+	//Numeric ids are mapped to the keys the XML reader produces
+	static uint64 MakeId(int64 Id);
+private:
+	struct FBlock
+	{
+		TArray<uint8> Blob;
+		TArray<FOSMNode> Nodes;
+		TArray<FOSMWay> Ways;
+		TArray<FOSMRelation> Relations;
+		bool bValid = false;
+	};
+	void DecodeBatch(TArray<FBlock>& Blocks);
+	static bool DecodeBlock(FBlock& Block);
+
+	AOSMActor* OSM;
+};
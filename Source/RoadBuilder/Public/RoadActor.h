@@ -204,6 +204,7 @@ public:
 	URoadLane* GetLane(const FVector2D& UV);
 	FVector2D GetUV(const FVector2D& Pos);
 	FVector2D GetUV(const FVector& Pos);
+	FVector2D GetUVNear(const FVector2D& Pos, int& Hint);
 	TArray<URoadLane*> GetLanes(URoadBoundary* Boundary, int Side, const TArray<ELaneType>& Types = {});
 	TArray<URoadLane*> GetLanes(int Side, const TArray<ELaneType>& Types = {})
 	{
@@ -288,6 +289,7 @@ public:
 	void UpdateCurveBySegments();
 	void UpdateLanes();
 	void BuildMesh(const TArray<FJunctionSlot>& Slots);
+	uint32 CalcMeshHash(const TArray<FJunctionSlot>& Slots);
 	bool IsLink();
 	bool IsRamp();
 	FConnectInfo& GetConnectedChild(ARoadActor* Child, int Index)
@@ -355,6 +357,13 @@ public:
 
 	UPROPERTY(EditAnywhere, Category = Road)
 	TArray<FConnectInfo> ConnectedChildren;
+
+	//Marking mask of each chunk, refilled on rebuild
+	UPROPERTY()
+	TArray<UTexture2D*> MaskTextures;
+
+	//Hash of all inputs of last BuildMesh, 0 forces a rebuild
+	uint32 MeshHash = 0;
 };
 
 UCLASS()
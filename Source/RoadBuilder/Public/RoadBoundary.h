@@ -48,6 +48,8 @@ public:
 	double& SegmentStart(int i) { return Segments[i].Dist; }
 	double& SegmentEnd(int i) { return i + 1 < Segments.Num() ? Segments[i + 1].Dist : Length(); }
 	URoadLane*& GetLane(int Side) { return Side ? LeftLane : RightLane; }
+	virtual void PostInitProperties() override;
+	virtual void PostLoad() override;
 
 	UPROPERTY(EditAnywhere, Category = Boundary)
 	TArray<FBoundarySegment> Segments;
@@ -58,5 +60,9 @@ public:
 	UPROPERTY()
 	URoadLane* RightLane = nullptr;
 
+	//Random seed of props, saved so placement survives renames and lane edits
+	UPROPERTY()
+	uint32 PropSeed = 0;
+
 	TArray<FOctreeElementId2> OctreeIds;
 };
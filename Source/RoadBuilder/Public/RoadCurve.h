@@ -4,6 +4,7 @@
 #pragma once
 #include "CoreMinimal.h"
 #include "Math/GenericOctree.h"
+#include "Algo/BinarySearch.h"
 #include "XmlFile.h"
 #include "Spiral.h"
 #include "RoadCurve.generated.h"
@@ -96,6 +97,16 @@ struct FPolyPoint
 	{
 		return FVector2D(Pos);
 	}
+	FVector GetDir() const
+	{
+		return FVector(FMath::Cos(Radian), FMath::Sin(Radian), 0);
+	}
+	FVector GetNormal(const FVector& Base) const
+	{
+		FVector Dir = GetDir();
+		FVector Right = (Base ^ Dir).GetSafeNormal();
+		return (Dir ^ Right).GetSafeNormal();
+	}
 
 	UPROPERTY(EditAnywhere, Category = Point)
 	FVector Pos = FVector::ZeroVector;
@@ -164,8 +175,7 @@ struct FPolyline
 	}
 	FVector GetDir(int i) const
 	{
-		double Radian = Points[i].Radian;
-		return FVector(FMath::Cos(Radian), FMath::Sin(Radian), 0);
+		return Points[i].GetDir();
 	}
 	FVector GetRight(int i) const
 	{
@@ -207,9 +217,7 @@ struct FPolyline
 	}
 	FVector GetNormal(int i, const FVector& Base) const
 	{
-		FVector Dir = GetDir(i);
-		FVector Right = (Base ^ Dir).GetSafeNormal();
-		return (Dir ^ Right).GetSafeNormal();
+		return Points[i].GetNormal(Base);
 	}
 	FVector2D GetUV(const FVector2D& Pos, int i) const
 	{
@@ -255,6 +263,40 @@ struct FPolyline
 	{
 		return GetUV((const FVector2D&)Pos);
 	}
+	//Searches segments around Hint first, for coherent queries like vertices of a mesh
+	FVector2D GetUVNear(const FVector2D& Pos, int& Hint) const
+	{
+		int NumSegments = Points.Num() - 1;
+		FVector2D BestUV(0, MAX_dbl);
+		if (Hint >= 0 && Hint < NumSegments)
+		{
+			int BestIndex = Hint;
+			for (int i = FMath::Max(Hint - 8, 0); i <= FMath::Min(Hint + 8, NumSegments - 1); i++)
+			{
+				FVector2D UV = GetUV(Pos, i);
+				if (FMath::Abs(BestUV.Y) > FMath::Abs(UV.Y))
+				{
+					BestUV = UV;
+					BestIndex = i;
+				}
+			}
+			if (BestUV.Y != MAX_dbl)
+			{
+				Hint = BestIndex;
+				return BestUV;
+			}
+		}
+		for (int i = 0; i < NumSegments; i++)
+		{
+			FVector2D UV = GetUV(Pos, i);
+			if (FMath::Abs(BestUV.Y) > FMath::Abs(UV.Y))
+			{
+				BestUV = UV;
+				Hint = i;
+			}
+		}
+		return BestUV;
+	}
 	bool SolveIntersection(const FPolyline& Other, double& Dist1, double& Dist2) const
 	{
 		if (Points.Num() < 2 || Other.Points.Num() < 2)
@@ -477,6 +519,61 @@ struct FPolyline
 	TArray<FPolyPoint> Points;
 };
 
+//Cumulative arc length of a polyline shifted sideways by Offset, maps curve distance (s) to arc length and back
+struct FArcLengthTable
+{
+	FArcLengthTable(const FPolyline& InCurve, double Offset = 0) : Curve(&InCurve)
+	{
+		int Num = Curve->Points.Num();
+		Positions.SetNumUninitialized(Num);
+		Arcs.SetNumUninitialized(Num);
+		for (int i = 0; i < Num; i++)
+		{
+			Positions[i] = Curve->Points[i].Pos + Curve->GetRight(i) * Offset;
+			Arcs[i] = i > 0 ? Arcs[i - 1] + FVector::Dist(Positions[i - 1], Positions[i]) : 0;
+		}
+	}
+	double Length() const
+	{
+		return Arcs.Last();
+	}
+	int GetSegment(double Arc) const
+	{
+		return FMath::Clamp(Algo::UpperBound(Arcs, Arc) - 1, 0, Arcs.Num() - 2);
+	}
+	double SToArc(double S) const
+	{
+		int i = Curve->GetPoint(S);
+		return FMath::Lerp(Arcs[i], Arcs[i + 1], GetAlpha(Curve->Points[i].Dist, Curve->Points[i + 1].Dist, S));
+	}
+	double ArcToS(double Arc) const
+	{
+		int i = GetSegment(Arc);
+		return FMath::Lerp(Curve->Points[i].Dist, Curve->Points[i + 1].Dist, GetAlpha(Arcs[i], Arcs[i + 1], Arc));
+	}
+	//Point on the offset curve, Dist is s of the source curve
+	FPolyPoint Sample(double Arc) const
+	{
+		int i = GetSegment(Arc);
+		double Alpha = GetAlpha(Arcs[i], Arcs[i + 1], Arc);
+		const FPolyPoint& Start = Curve->Points[i];
+		const FPolyPoint& End = Curve->Points[i + 1];
+		return FPolyPoint(FMath::Lerp(Positions[i], Positions[i + 1], Alpha), LerpRadian(Start.Radian, End.Radian, Alpha), FMath::Lerp(Start.Dist, End.Dist, Alpha));
+	}
+	FVector GetDir(double Arc) const
+	{
+		int i = GetSegment(Arc);
+		return (Positions[i + 1] - Positions[i]).GetSafeNormal();
+	}
+	static double GetAlpha(double A, double B, double X)
+	{
+		return B > A ? FMath::Clamp((X - A) / (B - A), 0.0, 1.0) : 0;
+	}
+	const FPolyline* Curve;
+	TArray<FVector> Positions;
+	TArray<double> Arcs;
+};
+
 class ARoadActor;
 class URoadBoundary;
 class URoadLane;
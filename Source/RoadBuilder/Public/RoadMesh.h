@@ -10,19 +10,77 @@
 #include "ConstrainedDelaunay2.h"
 #include "Misc/FileHelper.h"
 #include "RoadCurve.h"
+#include "RoadMesh.generated.h"
 
 using namespace UE::Geometry;
 
-class ROADBUILDER_API FStaticRoadMesh
+class ARoadActor;
+class URoadProps;
+class UInstancedStaticMeshComponent;
+class UMaterialInstanceDynamic;
+
+UENUM()
+enum class ERoadMeshBackend : uint8
+{
+	//Builds UStaticMesh assets, editor only
+	Static,
+	//Builds sections of a UProceduralMeshComponent, usable at runtime
+	Procedural,
+};
+
+USTRUCT()
+struct FPolygonRefinement
+{
+	GENERATED_USTRUCT_BODY()
+	//Triangles with a smaller angle are split, 0 to disable
+	UPROPERTY(EditAnywhere, Category = Refinement, meta = (ClampMin = 0, ClampMax = 30))
+	double MinAngle = 20;
+
+	//Triangles larger than this (cm^2) are split, 0 to disable
+	UPROPERTY(EditAnywhere, Category = Refinement, meta = (ClampMin = 0))
+	double MaxTriangleArea = 0;
+
+	//Triangles whose neighbors deviate more than this from their plane are split, 0 to disable
+	UPROPERTY(EditAnywhere, Category = Refinement, meta = (ClampMin = 0))
+	double MaxHeightDeviation = 0;
+
+	//Safety cap on vertices inserted by refinement, the criteria above decide how many are added
+	UPROPERTY(EditAnywhere, Category = Refinement, meta = (ClampMin = 0))
+	int MaxVertices = 20000;
+};
+
+//Writes base heights into Z of the given positions, polygon heights are then interpolated as offsets from it
+typedef TFunction<void(TArray<FVector>&)> FHeightSampler;
+
+struct FPolygonTile
+{
+	FIntPoint Coord;
+	TArray<FVector> Vertices;
+	TArray<FIndex3i> Triangles;
+};
+
+USTRUCT()
+struct FPolygonStats
+{
+	GENERATED_USTRUCT_BODY()
+	UPROPERTY(VisibleAnywhere, Category = Stats)
+	int NumVertices = 0;
+
+	UPROPERTY(VisibleAnywhere, Category = Stats)
+	int NumTriangles = 0;
+};
+
+class ROADBUILDER_API FRoadMesh
 {
 public:
-	FStaticRoadMesh();
-	UStaticMesh* CreateMesh(UObject* Outer, FName Name = NAME_None, EObjectFlags Flags = RF_NoFlags);
-	FPolygonGroupID GetGroupID(UMaterialInterface* Material);
-	void AddStrip(UMaterialInterface* Material, const FPolyline& LeftCurve, const FPolyline& RightCurve);
-	void AddPolygon(UMaterialInterface* SurfaceMaterial, UMaterialInterface* BackfaceMaterial, const TArray<FVector>& Points);
-	void AddPolygons(UMaterialInterface* Material, const TArray<FVector>& Positions, const TArray<FVector2D>& UVs, int NumCols, int NumRows);
-	void AddTriangles(UMaterialInterface* Material, const TArray<FIndex3i>& Triangles, const TArray<FVector>& Vertices, const FVector& Normal);
+	static TUniquePtr<FRoadMesh> Create(ERoadMeshBackend Backend);
+	static UPrimitiveComponent* GetMeshComponent(USceneComponent* Component);
+	virtual ~FRoadMesh() {}
+	virtual void AddStrip(UMaterialInterface* Material, const FPolyline& LeftCurve, const FPolyline& RightCurve) = 0;
+	//Adds one strip per span, a span (Start, Num) selects the same range of both point arrays
+	virtual void AddStrips(UMaterialInterface* Material, const TArray<FPolyPoint>& LeftPoints, const TArray<FPolyPoint>& RightPoints, const TArray<FIntPoint>& Spans) = 0;
+	virtual void AddPolygons(UMaterialInterface* Material, const TArray<FVector>& Positions, const TArray<FVector2D>& UVs, int NumCols, int NumRows) = 0;
+	virtual void AddTriangles(UMaterialInterface* Material, const TArray<FIndex3i>& Triangles, const TArray<FVector>& Vertices, const FVector& Normal) = 0;
 	void AddTriangles(UMaterialInterface* Material, const TArray<FIndex3i>& Triangles, const TArray<FVector2D>& Vertices, const FVector& Normal)
 	{
 		TArray<FVector> Positions;
@@ -31,58 +89,131 @@ public:
 			Positions[i] = FVector(Vertices[i], 0);
 		AddTriangles(Material, Triangles, Positions, Normal);
 	}
-	void Build(USceneComponent* Component);
+	FPolygonStats AddPolygon(UMaterialInterface* SurfaceMaterial, UMaterialInterface* BackfaceMaterial, const TArray<FVector>& Points, const FPolygonRefinement& Refinement = FPolygonRefinement(), const FHeightSampler& BaseHeights = nullptr);
+	FPolygonStats AddPolygonTile(UMaterialInterface* SurfaceMaterial, UMaterialInterface* BackfaceMaterial, const FPolygonTile& Tile);
+	//Clips the polygon into a grid of TileSize cells triangulated in parallel, seams share vertices and heights are solved over all tiles
+	static TArray<FPolygonTile> TriangulateTiles(const TArray<FVector>& Points, const FPolygonRefinement& Refinement, double TileSize, const FHeightSampler& BaseHeights = nullptr);
+	static void Clear(USceneComponent* Component);
+	//Douglas-Peucker between points Start and End, indices of the interior points to keep are added to OutIndices
+	static void SimplifyPoints(TFunctionRef<FVector(int)> GetPos, int Start, int End, double Tolerance, TArray<int>& OutIndices);
+	void AddCollisionStrip(const FPolyline& LeftCurve, const FPolyline& RightCurve);
+	virtual void Build(USceneComponent* Component) = 0;
+	virtual void SetMaskRoad(ARoadActor* Road) { MaskRoad = Road; }
+	FVector2D GetMaskUV(const FVector& Pos);
+	UMaterialInterface* GetMaterial(UMaterialInterface* Material) const
+	{
+		UMaterialInterface* const* Override = MaterialOverrides.Find(Material);
+		return Override ? *Override : Material;
+	}
+	TArray<TArray<FVector>> CollisionHulls;
+	//Materials replaced for geometry added afterwards
+	TMap<UMaterialInterface*, UMaterialInterface*> MaterialOverrides;
+	//Road space (s, t) of this road is written to UV1 for marking masks
+	ARoadActor* MaskRoad = nullptr;
+	int MaskHint = INDEX_NONE;
+};
+
+class ROADBUILDER_API FStaticRoadMesh : public FRoadMesh
+{
+public:
+	FStaticRoadMesh();
+	UStaticMesh* CreateMesh(UObject* Outer, FName Name = NAME_None, EObjectFlags Flags = RF_NoFlags);
+	FPolygonGroupID GetGroupID(UMaterialInterface* Material);
+	void AppendStrip(FPolygonGroupID Group, TArrayView<const FPolyPoint> LeftPoints, TArrayView<const FPolyPoint> RightPoints, double UVScale);
+	virtual void SetMaskRoad(ARoadActor* Road) override;
+	virtual void AddStrip(UMaterialInterface* Material, const FPolyline& LeftCurve, const FPolyline& RightCurve) override;
+	virtual void AddStrips(UMaterialInterface* Material, const TArray<FPolyPoint>& LeftPoints, const TArray<FPolyPoint>& RightPoints, const TArray<FIntPoint>& Spans) override;
+	virtual void AddPolygons(UMaterialInterface* Material, const TArray<FVector>& Positions, const TArray<FVector2D>& UVs, int NumCols, int NumRows) override;
+	virtual void AddTriangles(UMaterialInterface* Material, const TArray<FIndex3i>& Triangles, const TArray<FVector>& Vertices, const FVector& Normal) override;
+	using FRoadMesh::AddTriangles;
+	virtual void Build(USceneComponent* Component) override;
 	TMap<UMaterialInterface*, FPolygonGroupID> PolygonGroups;
 	TSharedPtr<FMeshDescription> MeshDescription;
 	TSharedPtr<FStaticMeshAttributes> MeshAttributes;
 	TSharedPtr<FMeshDescriptionBuilder> Builder;
 };
 
-class ROADBUILDER_API FProcRoadMesh
+class ROADBUILDER_API FProcRoadMesh : public FRoadMesh
 {
 public:
-	void AddStrip(UMaterialInterface* Material, const FPolyline& LeftCurve, const FPolyline& RightCurve);
-	void AddPolygons(UMaterialInterface* Material, const TArray<FVector>& Positions, const TArray<FVector2D>& UVs, int NumCols, int NumRows);
-	void AddTriangles(UMaterialInterface* Material, const TArray<FIndex3i>& Triangles, const TArray<FVector>& Vertices);
-	void AddTriangles(UMaterialInterface* Material, const TArray<FIndex3i>& Triangles, const TArray<FVector2D>& Vertices)
-	{
-		TArray<FVector> Positions;
-		Positions.AddUninitialized(Vertices.Num());
-		for (int i = 0; i < Vertices.Num(); i++)
-			Positions[i] = FVector(Vertices[i], 0);
-		AddTriangles(Material, Triangles, Positions);
-	}
-	void Build(USceneComponent* Component);
+	FProcMeshSection& GetSection(UMaterialInterface* Material);
+	void AppendStrip(FProcMeshSection& Section, TArrayView<const FPolyPoint> LeftPoints, TArrayView<const FPolyPoint> RightPoints, double UVScale);
+	virtual void AddStrip(UMaterialInterface* Material, const FPolyline& LeftCurve, const FPolyline& RightCurve) override;
+	virtual void AddStrips(UMaterialInterface* Material, const TArray<FPolyPoint>& LeftPoints, const TArray<FPolyPoint>& RightPoints, const TArray<FIntPoint>& Spans) override;
+	virtual void AddPolygons(UMaterialInterface* Material, const TArray<FVector>& Positions, const TArray<FVector2D>& UVs, int NumCols, int NumRows) override;
+	virtual void AddTriangles(UMaterialInterface* Material, const TArray<FIndex3i>& Triangles, const TArray<FVector>& Vertices, const FVector& Normal) override;
+	using FRoadMesh::AddTriangles;
+	virtual void Build(USceneComponent* Component) override;
 	TMap<UMaterialInterface*, FProcMeshSection> Sections;
 };
 
-#define USE_PROC_ROAD_MESH	0
-
-#if USE_PROC_ROAD_MESH
-	typedef FProcRoadMesh FRoadMesh;
-#else
-	typedef FStaticRoadMesh FRoadMesh;
-#endif
+//Rasterizes marking geometry into road space (s, t) mask textures, one per chunk along the road
+class ROADBUILDER_API FRoadMarkingMask : public FRoadMesh
+{
+public:
+	struct FTriangle
+	{
+		FVector2D Points[3];
+		int Channel;
+	};
+	FRoadMarkingMask(ARoadActor* Road);
+	int GetChunk(double S) const { return FMath::Max(FMath::FloorToInt(S / ChunkLength), 0); }
+	UMaterialInterface* GetChunkMaterial(UMaterialInterface* Material, int Chunk);
+	int GetChannel(UMaterialInterface* Material);
+	void AddTriangle(int Channel, const FVector2D& P0, const FVector2D& P1, const FVector2D& P2);
+	void AppendStrip(int Channel, TArrayView<const FPolyPoint> LeftPoints, TArrayView<const FPolyPoint> RightPoints);
+	virtual void AddStrip(UMaterialInterface* Material, const FPolyline& LeftCurve, const FPolyline& RightCurve) override;
+	virtual void AddStrips(UMaterialInterface* Material, const TArray<FPolyPoint>& LeftPoints, const TArray<FPolyPoint>& RightPoints, const TArray<FIntPoint>& Spans) override;
+	virtual void AddPolygons(UMaterialInterface* Material, const TArray<FVector>& Positions, const TArray<FVector2D>& UVs, int NumCols, int NumRows) override;
+	virtual void AddTriangles(UMaterialInterface* Material, const TArray<FIndex3i>& Triangles, const TArray<FVector>& Vertices, const FVector& Normal) override;
+	using FRoadMesh::AddTriangles;
+	virtual void Build(USceneComponent* Component) override;
+	double TexelSize;
+	int MaxSize;
+	double ChunkLength;
+	TArray<FTriangle> Triangles;
+	//Marking material of each RGBA channel
+	TArray<UMaterialInterface*> Channels;
+	TMap<TPair<UMaterialInterface*, int>, UMaterialInstanceDynamic*> ChunkMaterials;
+};
 
 DECLARE_CYCLE_STAT(TEXT("AddStrip"), STAT_AddStrip, STATGROUP_RoadBuilder);
 DECLARE_CYCLE_STAT(TEXT("BuildMesh"), STAT_BuildMesh, STATGROUP_RoadBuilder);
+DECLARE_CYCLE_STAT(TEXT("SolveHeights"), STAT_SolveHeights, STATGROUP_RoadBuilder);
 
 class FInstanceBuilder
 {
 public:
 	struct FInstances
 	{
+		//0 never culls, so it wins over any distance
+		static double MergeCullDistance(double A, double B)
+		{
+			return A < 0 ? B : (A > 0 && B > 0 ? FMath::Max(A, B) : 0);
+		}
+		void AddCullDistance(double Distance)
+		{
+			CullDistance = MergeCullDistance(CullDistance, Distance);
+		}
 		TArray<FTransform> Instances;
 		bool bForceISM = false;
+		bool bDensityScaling = false;
+		//Negative until an instance sets it, then 0 or the largest cull distance
+		double CullDistance = -1;
 	};
+	typedef TPair<UStaticMesh*, UMaterialInterface*> FKey;
 	void AttachToActor(AActor* Actor);
-	void AddInstance(UStaticMesh* Mesh, const FTransform& Trans, bool bForceISM = false)
+	FInstances& AddInstance(UStaticMesh* Mesh, const FTransform& Trans, bool bForceISM = false, UMaterialInterface* Material = nullptr)
 	{
-		if (!Instances.Contains(Mesh))
-			Instances.Add(Mesh).bForceISM = bForceISM;
-		Instances[Mesh].Instances.Add(Trans);
+		FKey Key(Mesh, Material);
+		if (!Instances.Contains(Key))
+			Instances.Add(Key).bForceISM = bForceISM;
+		FInstances& Entry = Instances[Key];
+		Entry.Instances.Add(Trans);
+		return Entry;
 	}
-	TMap<UStaticMesh*, FInstances> Instances;
+	static void SetupComponent(UInstancedStaticMeshComponent* Component, double CullDistance, bool bDensityScaling);
+	TMap<FKey, FInstances> Instances;
 };
 
 class FDecalBuilder
@@ -102,43 +233,78 @@ public:
 	TArray<FDecal> Decals;
 };
 
+class FActorBuilder
+{
+public:
+	struct FActor
+	{
+		UClass* Class;
+		FTransform Trans;
+	};
+	void AttachToActor(AActor* Actor);
+	void AddActor(UClass* Class, const FTransform& Trans)
+	{
+		Actors.Add({ Class, Trans });
+	}
+	TArray<FActor> Actors;
+};
+
 struct FRoadActorBuilder
 {
-	FRandomStream Stream;
-	FRoadMesh MeshBuilder;
+	FRoadActorBuilder(ERoadMeshBackend Backend) : MeshBuilder(FRoadMesh::Create(Backend)) {}
+	FRoadMesh& GetMarkingBuilder() { return MaskBuilder ? *MaskBuilder : *MeshBuilder; }
+	TUniquePtr<FRoadMesh> MeshBuilder;
+	//Markings go here instead of MeshBuilder in mask texture mode
+	TUniquePtr<FRoadMarkingMask> MaskBuilder;
 	FInstanceBuilder InstanceBuilder;
 	FDecalBuilder DecalBuilder;
+	FActorBuilder ActorBuilder;
+	//Arc length of each boundary built so far
+	TMap<const UObject*, double> DashPhases;
+	struct FPropJob
+	{
+		URoadProps* Props;
+		FPolyline Baseline;
+		uint32 Seed;
+	};
+	//Props of all boundary pieces, placed together once the road's boundaries are walked
+	TArray<FPropJob> PropJobs;
 };
 
-inline void BuildStrip(const FPolyline& LeftCurve, const FPolyline& RightCurve, TFunction<void(int,int,bool)>&& AddTriangle)
+inline void BuildStrip(TArrayView<const FPolyPoint> LeftPoints, TArrayView<const FPolyPoint> RightPoints, TFunction<void(int,int,bool)>&& AddTriangle)
 {
 	int CurLeft = 0, CurRight = 0;
-	bool Ascending = LeftCurve.Points.Last().Dist > LeftCurve.Points[0].Dist || RightCurve.Points.Last().Dist > RightCurve.Points[0].Dist;
+	bool Ascending = LeftPoints.Last().Dist > LeftPoints[0].Dist || RightPoints.Last().Dist > RightPoints[0].Dist;
 	auto Behind = [&]()
 	{
-		return Ascending ? LeftCurve.Points[CurLeft + 1].Dist < RightCurve.Points[CurRight + 1].Dist : LeftCurve.Points[CurLeft + 1].Dist > RightCurve.Points[CurRight + 1].Dist;
+		return Ascending ? LeftPoints[CurLeft + 1].Dist < RightPoints[CurRight + 1].Dist : LeftPoints[CurLeft + 1].Dist > RightPoints[CurRight + 1].Dist;
 	};
 	while (true)
 	{
-		bool CanLeft = CurLeft + 1 < LeftCurve.Points.Num();
-		bool CanRight = CurRight + 1 < RightCurve.Points.Num();
+		bool CanLeft = CurLeft + 1 < LeftPoints.Num();
+		bool CanRight = CurRight + 1 < RightPoints.Num();
 		if (!CanLeft && !CanRight)
 			break;
 		bool LeftSide = (CanLeft && CanRight) ? Behind() : CanLeft;
 		AddTriangle(CurLeft, CurRight, LeftSide);
 		if (LeftSide)
 		{
-			if (CurLeft + 1 < LeftCurve.Points.Num())
+			if (CurLeft + 1 < LeftPoints.Num())
 				CurLeft++;
 		}
 		else
 		{
-			if (CurRight + 1 < RightCurve.Points.Num())
+			if (CurRight + 1 < RightPoints.Num())
 				CurRight++;
 		}
 	}
 }
 
+inline void BuildStrip(const FPolyline& LeftCurve, const FPolyline& RightCurve, TFunction<void(int,int,bool)>&& AddTriangle)
+{
+	BuildStrip(MakeArrayView(LeftCurve.Points), MakeArrayView(RightCurve.Points), MoveTemp(AddTriangle));
+}
+
 inline void LoadPoints(TArray<FVector>& Points, const FString& FilePath)
 {
 	TArray<FString> FileLines;
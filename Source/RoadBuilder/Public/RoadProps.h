@@ -11,19 +11,19 @@ struct FRoadProp
 {
 	GENERATED_USTRUCT_BODY()
 
-	UObject* GetAsset(FRandomStream& Stream)
+	UObject* GetAsset(FRandomStream& Stream) const
 	{
 		return Assets.Num() ? Assets[Stream.RandHelper(Assets.Num())] : nullptr;
 	}
-	FVector GetOffset(FRandomStream& Stream)
+	FVector GetOffset(FRandomStream& Stream) const
 	{
 		return Offset + FVector((Stream.FRand() - 0.5f) * RandomOffset.X, (Stream.FRand() - 0.5f) * RandomOffset.Y, (Stream.FRand() - 0.5f) * RandomOffset.Z);
 	}
-	FVector GetScale(FRandomStream& Stream)
+	FVector GetScale(FRandomStream& Stream) const
 	{
 		return Scale + FVector((Stream.FRand() - 0.5f) * RandomScale.X, (Stream.FRand() - 0.5f) * RandomScale.Y, (Stream.FRand() - 0.5f) * RandomScale.Z);
 	}
-	FRotator GetRotation(FRandomStream& Stream)
+	FRotator GetRotation(FRandomStream& Stream) const
 	{
 		return FRotator(Rotation.Pitch + (Stream.FRand() - 0.5f) * RandomRotation.Pitch, Rotation.Yaw + (Stream.FRand() - 0.5f) * RandomRotation.Yaw, Rotation.Roll + (Stream.FRand() - 0.5f) * RandomRotation.Roll);
 	}
@@ -69,6 +69,16 @@ struct FRoadProp
 
 	UPROPERTY(EditAnywhere, Category = Filter)
 	uint8 Of = 1;
+
+	double GetCullDistance(UStaticMesh* Mesh, const FTransform& Trans) const;
+
+	//Instances covering less than this fraction of screen are culled, 0 never culls
+	UPROPERTY(EditAnywhere, Category = Scalability, meta = (ClampMin = 0))
+	double CullScreenSize = 0.005;
+
+	//All instances are built, foliage.DensityScale of the scalability settings thins them at runtime
+	UPROPERTY(EditAnywhere, Category = Scalability)
+	bool bDensityScaling = true;
 };
 
 UCLASS()
@@ -76,7 +86,17 @@ class ROADBUILDER_API URoadProps : public UObject
 {
 	GENERATED_BODY()
 public:
-	void Generate(ARoadActor* Road, const FPolyline& Baseline, FRoadActorBuilder& Builder);
+	struct FPlacement
+	{
+		int PropIndex;
+		UObject* Asset;
+		FTransform Trans;
+	};
+	//Places all rules along Baseline, safe to call from worker threads
+	void Place(const FPolyline& Baseline, uint32 Seed, TArray<FPlacement>& Placements) const;
+	void Commit(const TArray<FPlacement>& Placements, FRoadActorBuilder& Builder) const;
+	//Places the props of all boundary pieces in parallel, then adds them to the builders in order
+	static void Generate(FRoadActorBuilder& Builder);
 #if WITH_EDITOR
 	virtual void PostEditChangeProperty(FPropertyChangedEvent& PropertyChangedEvent);
 #endif
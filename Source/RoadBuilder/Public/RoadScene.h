@@ -8,6 +8,8 @@
 #include "GroundActor.h"
 #include "RoadScene.generated.h"
 
+class UHierarchicalInstancedStaticMeshComponent;
+
 #define DefaultJunctionExtent	800.0
 
 struct FRoadOctreeElement
@@ -202,6 +204,7 @@ public:
 	bool Contains(ARoadActor* Road, double Dist);
 	void FixHeight(FPolyline& Polyline);
 	void FixHeight(TArray<FVector>& Points);
+	void FixHeight(TArray<FPolyPoint>& Points);
 	void Join(AJunctionActor* Junction);
 	void Update(TOctree2<FRoadOctreeElement, FRoadOctreeSemantics>& Octree);
 	void UpdateCorner(FJunctionGate& SrcGate, double SrcDist, FJunctionGate& DstGate, double DstDist);
@@ -216,10 +219,60 @@ public:
 	
 	UPROPERTY()
 	TArray<FJunctionGate> Gates;
+
+	UPROPERTY(EditAnywhere, Category = Junction)
+	FPolygonRefinement Refinement;
+
+	UPROPERTY(VisibleAnywhere, Transient, Category = Junction)
+	FPolygonStats MeshStats;
+	//Link road markings are projected onto the surface, so they depend on this
+	uint32 SurfaceHash = 0;
 	TArray<FVector> DebugPoints;
 	TArray<FPolyline> DebugCurves;
 };
 
+USTRUCT()
+struct FPropRoadInstances
+{
+	GENERATED_USTRUCT_BODY()
+	UPROPERTY()
+	TArray<FTransform> Transforms;
+
+	UPROPERTY()
+	double CullDistance = -1;
+
+	UPROPERTY()
+	bool bDensityScaling = false;
+};
+
+//Instances of one mesh within one cell of the scene, merged from all roads into a single component
+USTRUCT()
+struct FPropCell
+{
+	GENERATED_USTRUCT_BODY()
+	typedef TTuple<UStaticMesh*, UMaterialInterface*, FIntPoint> FKey;
+	FKey GetKey() const { return FKey(Mesh, Material, Coord); }
+
+	UPROPERTY()
+	UStaticMesh* Mesh = nullptr;
+
+	UPROPERTY()
+	UMaterialInterface* Material = nullptr;
+
+	UPROPERTY()
+	FIntPoint Coord = FIntPoint::ZeroValue;
+
+	UPROPERTY()
+	UHierarchicalInstancedStaticMeshComponent* Component = nullptr;
+
+	UPROPERTY()
+	TMap<ARoadActor*, FPropRoadInstances> Roads;
+
+	//Road of each instance of Component
+	UPROPERTY()
+	TArray<ARoadActor*> Owners;
+};
+
 UCLASS()
 class ROADBUILDER_API ARoadScene : public AActor
 {
@@ -236,15 +289,24 @@ public:
 //	FVector2D GetRoadUV(ARoadActor* Road, const FVector& Pos);
 	void Rebuild();
 	void GenerateGrounds(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadSlots);
+	void UpdatePCGSplines(TMap<ARoadActor*, TArray<FJunctionSlot>>& RoadSlots);
 	void OctreeAddBoundary(URoadBoundary* Boundary);
 	void OctreeRemoveBoundary(URoadBoundary* Boundary);
 	void OctreeAddRoad(ARoadActor* Road);
 	void OctreeRemoveRoad(ARoadActor* Road);
 	void DestroyRoad(ARoadActor* Road);
+	void SetPropInstances(ARoadActor* Road, FInstanceBuilder& Builder);
+	void RemovePropInstances(ARoadActor* Road);
+	void UpdatePropCells();
+	void UpdatePropCellIndices();
 	virtual void PostLoad() override;
 #if WITH_EDITOR
+	virtual void PostEditUndo() override;
 	void ExportXodr();
 #endif
+	//Creates or updates the PCG spline of every ground
+	UFUNCTION(CallInEditor, Category = Build)
+	void GeneratePCGSplines();
 
 	UPROPERTY()
 	TArray<ARoadActor*> Roads;
@@ -255,5 +317,27 @@ public:
 	UPROPERTY()
 	TArray<AGroundActor*> Grounds;
 
+	UPROPERTY(EditAnywhere, Category = Build)
+	ERoadMeshBackend MeshBackend = ERoadMeshBackend::Static;
+
+	//Keep PCG splines of grounds up to date on every rebuild
+	UPROPERTY(EditAnywhere, Category = Build)
+	bool bGeneratePCGSplines = false;
+
+	//Gather prop instances of all roads into one HISM per mesh per cell instead of components on each road
+	UPROPERTY(EditAnywhere, Category = Build)
+	bool bMergePropInstances = false;
+
+	UPROPERTY(EditAnywhere, Category = Build, meta = (ClampMin = 1000, EditCondition = "bMergePropInstances"))
+	double PropCellSize = 50000;
+
+	UPROPERTY()
+	TArray<FPropCell> PropCells;
+
+	TMap<FPropCell::FKey, int> PropCellIndices;
+	TMap<ARoadActor*, TSet<int>> RoadPropCells;
+	//Roads whose instances changed in each cell
+	TMap<int, TSet<ARoadActor*>> DirtyPropCells;
+
 	TOctree2<FRoadOctreeElement, FRoadOctreeSemantics> Octree;
 };
\ No newline at end of file
@@ -8,6 +8,22 @@
 #include "RoadActor.h"
 #include "Settings.generated.h"
 
+UENUM()
+enum class ERoadCollisionMode : uint8
+{
+	ComplexAsSimple,
+	Simplified,
+};
+
+UENUM()
+enum class ERoadMarkingMode : uint8
+{
+	//Markings are triangles on top of road surface
+	Geometry,
+	//Markings are rasterized into road space mask textures sampled by road surface materials
+	MaskTexture,
+};
+
 UCLASS(config = RoadBuilder)
 class ROADBUILDER_API USettings_Base : public UObject
 {
@@ -44,6 +60,17 @@ public:
 	UPROPERTY(config, EditAnywhere, Category = Marking)
 	TSoftObjectPtr<UPolygonMarkStyle> DefaultGoreMarking;
 
+	UPROPERTY(config, EditAnywhere, Category = Marking)
+	ERoadMarkingMode MarkingMode = ERoadMarkingMode::Geometry;
+
+	//Size of a mask texel along road in cm
+	UPROPERTY(config, EditAnywhere, Category = Marking, meta = (ClampMin = 1, EditCondition = "MarkingMode == ERoadMarkingMode::MaskTexture"))
+	double MarkingMaskTexelSize = 5;
+
+	//Roads longer than this many texels are split into chunks, each with its own mask texture
+	UPROPERTY(config, EditAnywhere, Category = Marking, meta = (ClampMin = 64, ClampMax = 8192, EditCondition = "MarkingMode == ERoadMarkingMode::MaskTexture"))
+	int MarkingMaskMaxSize = 4096;
+
 	UPROPERTY(config, EditAnywhere, Category = Build)
 	double UVScale = 0.001;
 
@@ -53,6 +80,18 @@ public:
 	UPROPERTY(config, EditAnywhere, Category = Build)
 	uint32 BuildProps : 1;
 
+	UPROPERTY(config, EditAnywhere, Category = Collision)
+	ERoadCollisionMode CollisionMode = ERoadCollisionMode::ComplexAsSimple;
+
+	UPROPERTY(config, EditAnywhere, Category = Collision, meta = (EditCondition = "CollisionMode == ERoadCollisionMode::Simplified"))
+	double CollisionTolerance = 20;
+
+	UPROPERTY(config, EditAnywhere, Category = Collision, meta = (EditCondition = "CollisionMode == ERoadCollisionMode::Simplified"))
+	double CollisionSegmentLength = 5000;
+
+	UPROPERTY(config, EditAnywhere, Category = Collision, meta = (EditCondition = "CollisionMode == ERoadCollisionMode::Simplified"))
+	double CollisionThickness = 50;
+
 	UPROPERTY(config, EditAnywhere, Category = Debug)
 	uint32 DisplayGateRadianPoints : 1;
 };
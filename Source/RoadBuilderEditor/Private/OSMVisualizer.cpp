@@ -13,20 +13,21 @@ void FOSMVisualizer::DrawVisualization(const UActorComponent* Component, const F
 		return;
 	if (AOSMActor* OSM = Cast<AOSMActor>(Component->GetOwner()))
 	{
-		for (TPair<uint64, FOSMWay>& KV : OSM->Ways)
+		for (int32 Way = 0; Way < OSM->DrivableWays.Num(); Way++)
 		{
-			if (KV.Value.IsDrivable())
+			if (OSM->DrivableWays[Way])
 			{
-				FPolyline& Curve = KV.Value.Curve;
-				PDI->SetHitProxy(new HOSMVisProxy(Component, KV.Key));
+				uint64 Id = OSM->Data.WayIds[Way];
+				FPolyline& Curve = OSM->WayCurves[Way];
+				PDI->SetHitProxy(new HOSMVisProxy(Component, Id));
 				for (int i = 0; i < Curve.Points.Num(); i++)
 				{
 					const FVector& Start = Curve.Points[i].Pos;
-					PDI->DrawPoint(Start, SelectedWay == KV.Key ? FColor::Blue : FColor::Red, 4, SDPG_Foreground);
+					PDI->DrawPoint(Start, SelectedWay == Id ? FColor::Blue : FColor::Red, 4, SDPG_Foreground);
 					if (i < Curve.Points.Num() - 1)
 					{
 						const FVector& End = Curve.Points[i + 1].Pos;
-						PDI->DrawLine(Start, End, SelectedWay == KV.Key ? FColor::Blue : FColor::Red, SDPG_Foreground, 0);
+						PDI->DrawLine(Start, End, SelectedWay == Id ? FColor::Blue : FColor::Red, SDPG_Foreground, 0);
 					}
 				}
 			}
@@ -96,6 +97,19 @@ void FOSMVisualizer::ConvertToRoadClicked() const
 void FOSMVisualizer::PropertiesClicked() const
 {
 	if (AOSMActor* OSM = Cast<AOSMActor>(SelectedComponent->GetOwner()))
-		IsDataDialogProceed(OSM->Ways[SelectedWay]);
+	{
+		int32 Way = OSM->Data.FindWay(SelectedWay);
+		if (Way != INDEX_NONE)
+		{
+			//The dialog edits a copy, accepted edits are written back and the ways rebuilt
+			FOSMWay Record = OSM->Data.GetWay(Way);
+			if (IsDataDialogProceed(Record))
+			{
+				OSM->Modify();
+				OSM->Data.SetWay(Way, Record);
+				OSM->Build();
+			}
+		}
+	}
 }
 #undef LOCTEXT_NAMESPACE
\ No newline at end of file